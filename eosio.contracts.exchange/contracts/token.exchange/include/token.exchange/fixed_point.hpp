@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstdint>
+
+// decimals every exchange amount is normalized to
+#define EXCHANGE_PRECISION 8
+
+namespace tokenexchange {
+
+   // largest int128_t, the bound of every intermediate product
+   constexpr int128_t int128_max = int128_t( ~uint128_t( 0 ) >> 1 );
+
+   /**
+    *  Returns 10 to the power of exponent, the scale of that many decimals.
+    *  Evaluated at compile time for constant exponents, and an integer loop
+    *  otherwise.
+    */
+   constexpr int64_t decimal_scale( uint8_t exponent ) {
+      int64_t result = 1;
+      for( uint8_t i = 0; i < exponent; ++i )
+         result *= 10;
+      return result;
+   }
+
+   /**
+    *  Returns the integer square root of n, rounded down.  Newton's method
+    *  from a power of two above the root, so it takes a handful of steps
+    *  even for 128 bit values.
+    */
+   constexpr int128_t isqrt( int128_t n ) {
+      if( n < 2 )
+         return n;
+
+      int128_t x = 2;
+      for( int128_t m = n; m > 3; m >>= 2 )
+         x <<= 1;
+
+      int128_t y = ( x + n / x ) / 2;
+      while( y < x ) {
+         x = y;
+         y = ( x + n / x ) / 2;
+      }
+      return x;
+   }
+
+   struct price_tag {};
+   struct qty_tag {};
+
+   /**
+    *  Fixed point amount with a compile time number of decimals.
+    *
+    *  Description:
+    *  Prices and quantities are separate types, and amounts of different
+    *  precision only mix through an explicit rescale, so unit and precision
+    *  mistakes fail to compile.  Products and quotients are computed in
+    *  int128_t with constant scale factors and truncated.
+    *
+    *  ex: price_t<8>( 132000000 ) is 1.32 quote per base,
+    *      qty_t<4>( 15000 ) is 1.5 tokens.
+    */
+   template <typename Tag, uint8_t Precision>
+   struct fixed_point {
+      static constexpr uint8_t precision = Precision;
+      static constexpr int64_t scale     = decimal_scale( Precision );
+
+      int64_t value = 0;
+
+      constexpr fixed_point() = default;
+      constexpr explicit fixed_point( int64_t v ) : value( v ) {}
+
+      // converts an amount with a runtime number of decimals, truncating extra decimals
+      static constexpr fixed_point from_decimals( int64_t v, uint8_t decimals ) {
+         return decimals <= Precision ? fixed_point( v * decimal_scale( Precision - decimals ) )
+                                      : fixed_point( v / decimal_scale( decimals - Precision ) );
+      }
+
+      // the amount with a runtime number of decimals, truncating extra decimals
+      constexpr int64_t to_decimals( uint8_t decimals ) const {
+         return decimals >= Precision ? value * decimal_scale( decimals - Precision )
+                                      : value / decimal_scale( Precision - decimals );
+      }
+
+      // converts to another precision, truncating extra decimals
+      template <uint8_t To>
+      constexpr fixed_point<Tag, To> rescale() const {
+         if constexpr( To >= Precision )
+            return fixed_point<Tag, To>( value * decimal_scale( To - Precision ) );
+         else
+            return fixed_point<Tag, To>( value / decimal_scale( Precision - To ) );
+      }
+
+      constexpr fixed_point operator+( fixed_point other ) const { return fixed_point( value + other.value ); }
+      constexpr fixed_point operator-( fixed_point other ) const { return fixed_point( value - other.value ); }
+      constexpr fixed_point& operator+=( fixed_point other ) { value += other.value; return *this; }
+      constexpr fixed_point& operator-=( fixed_point other ) { value -= other.value; return *this; }
+
+      constexpr bool operator==( fixed_point other ) const { return value == other.value; }
+      constexpr bool operator!=( fixed_point other ) const { return value != other.value; }
+      constexpr bool operator< ( fixed_point other ) const { return value <  other.value; }
+      constexpr bool operator<=( fixed_point other ) const { return value <= other.value; }
+      constexpr bool operator> ( fixed_point other ) const { return value >  other.value; }
+      constexpr bool operator>=( fixed_point other ) const { return value >= other.value; }
+   };
+
+   // quote tokens per base token
+   template <uint8_t Precision = EXCHANGE_PRECISION>
+   using price_t = fixed_point<price_tag, Precision>;
+
+   // token quantity
+   template <uint8_t Precision = EXCHANGE_PRECISION>
+   using qty_t = fixed_point<qty_tag, Precision>;
+
+   /**
+    *  Returns the quote quantity of a base quantity at a price, in the
+    *  precision of the price.
+    *
+    *    1.32 quote/base * 1.5 base = 1.98 quote
+    */
+   template <uint8_t P, uint8_t B>
+   constexpr qty_t<P> operator*( price_t<P> price, qty_t<B> volume ) {
+      return qty_t<P>( int128_t( price.value ) * volume.value / qty_t<B>::scale );
+   }
+
+   /**
+    *  Returns the base quantity a quote quantity pays for at a price, in
+    *  base precision B.
+    *
+    *    1.98 quote / 1.32 quote/base = 1.5 base
+    */
+   template <uint8_t B, uint8_t P>
+   constexpr qty_t<B> base_volume( qty_t<P> quote, price_t<P> price ) {
+      return qty_t<B>( int128_t( quote.value ) * qty_t<B>::scale / price.value );
+   }
+
+   /**
+    *  Returns the average of two prices weighted by the quantities traded at
+    *  each, truncated.
+    *
+    *    ( 1.30 * 2 base + 1.40 * 3 base ) / 5 base = 1.36 quote/base
+    */
+   template <uint8_t P, uint8_t B>
+   constexpr price_t<P> average_price( price_t<P> a, qty_t<B> a_volume, price_t<P> b, qty_t<B> b_volume ) {
+      return price_t<P>( ( int128_t( a.value ) * a_volume.value + int128_t( b.value ) * b_volume.value ) / ( a_volume.value + b_volume.value ) );
+   }
+
+   /**
+    *  Returns an amount multiplied by the ratio numerator / denominator, such
+    *  as a fee in basis points or a share of a total.  The product is taken
+    *  in int128_t before dividing and truncated.
+    *
+    *    1.98 quote * 30 / 10000 = 0.00594 quote
+    */
+   template <typename Tag, uint8_t P>
+   constexpr fixed_point<Tag, P> scale_by( fixed_point<Tag, P> amount, int128_t numerator, int128_t denominator ) {
+      return fixed_point<Tag, P>( int128_t( amount.value ) * numerator / denominator );
+   }
+
+   // scale_by, rounded up
+   template <typename Tag, uint8_t P>
+   constexpr fixed_point<Tag, P> scale_by_ceil( fixed_point<Tag, P> amount, int128_t numerator, int128_t denominator ) {
+      return fixed_point<Tag, P>( ( int128_t( amount.value ) * numerator + denominator - 1 ) / denominator );
+   }
+
+} // namespace tokenexchange
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <tuple>
+#include <utility>
+
+#include <token.exchange/token.exchange_base.hpp>
+
+namespace tokenexchange {
+
+   /**
+    *  Secondary index of a memory_table, named like its multi_index
+    *  counterpart and keyed by a const member function of the row.
+    */
+   template <uint64_t IndexName, auto Key>
+   struct memory_index {
+      static constexpr uint64_t index_name = IndexName;
+      static constexpr auto key = Key;
+   };
+
+   /**
+    *  Order book table for native builds of the engine, such as simulators
+    *  and backtests.
+    *
+    *  Description:
+    *  Rows are kept in a std::map per contract and scope for the life of the
+    *  process, and every secondary index is a std::map from the secondary
+    *  and primary key to the row.  Rows are never serialized, so a lookup is
+    *  one tree walk and a modify only touches the index entries of the row.
+    *  Implements the part of the eosio::multi_index interface the engine
+    *  uses on its books, so a storage policy can name it for bids and asks.
+    *
+    *  Not for contract builds, the rows do not outlive the process.
+    */
+   template <uint64_t TableName, typename T, typename... Indices>
+   class memory_table {
+      typedef std::map<uint64_t, T> rows_type;
+      typedef std::map<std::pair<uint64_t, uint64_t>, const T*> keys_type;
+
+      struct state {
+         rows_type rows;
+         std::array<keys_type, sizeof...(Indices)> keys;
+
+         template <size_t... I>
+         void add_keys( const T& row, std::index_sequence<I...> ) {
+            ( keys[I].emplace( std::make_pair( (row.*Indices::key)(), row.primary_key() ), &row ), ... );
+         }
+
+         template <size_t... I>
+         void remove_keys( const T& row, std::index_sequence<I...> ) {
+            ( keys[I].erase( std::make_pair( (row.*Indices::key)(), row.primary_key() ) ), ... );
+         }
+
+         template <typename Lambda>
+         typename rows_type::iterator emplace( Lambda&& constructor ) {
+            T row;
+            constructor( row );
+
+            auto [ itr, inserted ] = rows.emplace( row.primary_key(), std::move( row ) );
+            eosio::check( inserted, "could not insert object, possibly due to a uniqueness constraint" );
+
+            add_keys( itr->second, std::index_sequence_for<Indices...>() );
+            return itr;
+         }
+
+         // moves the index entry of a modified row, entries whose key did not change stay valid
+         template <size_t I>
+         void rekey( uint64_t old_key, const T& row ) {
+            uint64_t new_key = ( row.*std::tuple_element_t<I, std::tuple<Indices...>>::key )();
+            if( new_key == old_key )
+               return;
+
+            keys[I].erase( std::make_pair( old_key, row.primary_key() ) );
+            keys[I].emplace( std::make_pair( new_key, row.primary_key() ), &row );
+         }
+
+         template <typename Lambda, size_t... I>
+         void modify( uint64_t primary_key, Lambda&& updater, std::index_sequence<I...> ) {
+            auto itr = rows.find( primary_key );
+            eosio::check( itr != rows.end(), "cannot modify a row that is not in the table" );
+
+            std::array<uint64_t, sizeof...(Indices)> old_keys = { ( itr->second.*Indices::key )()... };
+            updater( itr->second );
+            eosio::check( itr->second.primary_key() == primary_key, "updater cannot change primary key when modifying an object" );
+            ( rekey<I>( old_keys[I], itr->second ), ... );
+         }
+
+         template <typename Lambda>
+         void modify( uint64_t primary_key, Lambda&& updater ) {
+            modify( primary_key, std::forward<Lambda>( updater ), std::index_sequence_for<Indices...>() );
+         }
+
+         typename rows_type::iterator erase( uint64_t primary_key ) {
+            auto itr = rows.find( primary_key );
+            eosio::check( itr != rows.end(), "cannot erase a row that is not in the table" );
+
+            remove_keys( itr->second, std::index_sequence_for<Indices...>() );
+            return rows.erase( itr );
+         }
+      };
+
+      // tables of every contract and scope, keyed by contract and scope
+      static std::map<std::pair<uint64_t, uint64_t>, state>& store() {
+         static std::map<std::pair<uint64_t, uint64_t>, state> tables;
+         return tables;
+      }
+
+      template <uint64_t IndexName>
+      static constexpr size_t index_position() {
+         constexpr uint64_t names[] = { Indices::index_name... };
+         for( size_t i = 0; i < sizeof...(Indices); ++i ) {
+            if( names[i] == IndexName )
+               return i;
+         }
+         return sizeof...(Indices);
+      }
+
+      state* data;
+
+   public:
+      class const_iterator {
+      public:
+         typedef std::bidirectional_iterator_tag iterator_category;
+         typedef T                               value_type;
+         typedef std::ptrdiff_t                  difference_type;
+         typedef const T*                        pointer;
+         typedef const T&                        reference;
+
+         const_iterator() = default;
+         explicit const_iterator( typename rows_type::const_iterator i ) : itr( i ) {}
+
+         const T& operator*() const { return itr->second; }
+         const T* operator->() const { return &itr->second; }
+
+         const_iterator& operator++() { ++itr; return *this; }
+         const_iterator& operator--() { --itr; return *this; }
+         const_iterator operator++( int ) { return const_iterator( itr++ ); }
+         const_iterator operator--( int ) { return const_iterator( itr-- ); }
+
+         bool operator==( const const_iterator& other ) const { return itr == other.itr; }
+         bool operator!=( const const_iterator& other ) const { return itr != other.itr; }
+
+         typename rows_type::const_iterator itr;
+      };
+
+      typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+      /**
+       *  Rows ordered by one secondary key, ties broken by primary key as
+       *  in multi_index.
+       */
+      class index {
+      public:
+         class const_iterator {
+         public:
+            typedef std::bidirectional_iterator_tag iterator_category;
+            typedef T                               value_type;
+            typedef std::ptrdiff_t                  difference_type;
+            typedef const T*                        pointer;
+            typedef const T&                        reference;
+
+            const_iterator() = default;
+            explicit const_iterator( typename keys_type::const_iterator i ) : itr( i ) {}
+
+            const T& operator*() const { return *itr->second; }
+            const T* operator->() const { return itr->second; }
+
+            const_iterator& operator++() { ++itr; return *this; }
+            const_iterator& operator--() { --itr; return *this; }
+            const_iterator operator++( int ) { return const_iterator( itr++ ); }
+            const_iterator operator--( int ) { return const_iterator( itr-- ); }
+
+            bool operator==( const const_iterator& other ) const { return itr == other.itr; }
+            bool operator!=( const const_iterator& other ) const { return itr != other.itr; }
+
+            typename keys_type::const_iterator itr;
+         };
+
+         typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+         index( state* d, keys_type* k ) : data( d ), keys( k ) {}
+
+         const_iterator begin() const { return const_iterator( keys->begin() ); }
+         const_iterator end() const { return const_iterator( keys->end() ); }
+         const_reverse_iterator rbegin() const { return const_reverse_iterator( end() ); }
+         const_reverse_iterator rend() const { return const_reverse_iterator( begin() ); }
+
+         const_iterator lower_bound( uint64_t secondary ) const {
+            return const_iterator( keys->lower_bound( std::make_pair( secondary, uint64_t( 0 ) ) ) );
+         }
+         const_iterator upper_bound( uint64_t secondary ) const {
+            return const_iterator( keys->upper_bound( std::make_pair( secondary, std::numeric_limits<uint64_t>::max() ) ) );
+         }
+         const_iterator find( uint64_t secondary ) const {
+            const_iterator itr = lower_bound( secondary );
+            return itr != end() && itr.itr->first.first == secondary ? itr : end();
+         }
+
+         template <typename Lambda>
+         void modify( const_iterator itr, eosio::name, Lambda&& updater ) {
+            data->modify( itr->primary_key(), std::forward<Lambda>( updater ) );
+         }
+
+         const_iterator erase( const_iterator itr ) {
+            const_iterator next = std::next( itr );
+            data->erase( itr->primary_key() );
+            return next;
+         }
+
+      private:
+         state*     data;
+         keys_type* keys;
+      };
+
+      memory_table( eosio::name code, uint64_t scope )
+      : data( &store()[ std::make_pair( code.value, scope ) ] ) {}
+
+      const_iterator begin() const { return const_iterator( data->rows.cbegin() ); }
+      const_iterator end() const { return const_iterator( data->rows.cend() ); }
+      const_reverse_iterator rbegin() const { return const_reverse_iterator( end() ); }
+      const_reverse_iterator rend() const { return const_reverse_iterator( begin() ); }
+
+      const_iterator find( uint64_t primary_key ) const { return const_iterator( data->rows.find( primary_key ) ); }
+      const_iterator lower_bound( uint64_t primary_key ) const { return const_iterator( data->rows.lower_bound( primary_key ) ); }
+      const_iterator upper_bound( uint64_t primary_key ) const { return const_iterator( data->rows.upper_bound( primary_key ) ); }
+
+      const T& get( uint64_t primary_key, const char* error_msg = "unable to find key" ) const {
+         const_iterator itr = find( primary_key );
+         eosio::check( itr != end(), error_msg );
+         return *itr;
+      }
+
+      uint64_t available_primary_key() const {
+         return data->rows.empty() ? 0 : data->rows.rbegin()->first + 1;
+      }
+
+      template <typename Lambda>
+      const_iterator emplace( eosio::name, Lambda&& constructor ) {
+         return const_iterator( data->emplace( std::forward<Lambda>( constructor ) ) );
+      }
+
+      template <typename Lambda>
+      void modify( const_iterator itr, eosio::name, Lambda&& updater ) {
+         data->modify( itr->primary_key(), std::forward<Lambda>( updater ) );
+      }
+
+      template <typename Lambda>
+      void modify( const T& row, eosio::name, Lambda&& updater ) {
+         data->modify( row.primary_key(), std::forward<Lambda>( updater ) );
+      }
+
+      const_iterator erase( const_iterator itr ) {
+         return const_iterator( data->erase( itr->primary_key() ) );
+      }
+
+      void erase( const T& row ) {
+         data->erase( row.primary_key() );
+      }
+
+      template <uint64_t IndexName>
+      index get_index() {
+         constexpr size_t position = index_position<IndexName>();
+         static_assert( position < sizeof...(Indices), "name not among the indices of the table" );
+         return index( data, &data->keys[position] );
+      }
+
+      // drops the tables of a contract, every scope
+      static void drop( eosio::name code ) {
+         auto& tables = store();
+         for( auto itr = tables.begin(); itr != tables.end(); ) {
+            if( itr->first.first == code.value )
+               itr = tables.erase( itr );
+            else
+               ++itr;
+         }
+      }
+   };
+
+   /**
+    *  Storage policy of exchange_base for native builds.  The order books
+    *  are memory_tables, every other table stays on the eosio interface.
+    */
+   struct memory_book_storage : eosio_storage {
+      typedef memory_table<"bidorders"_n, order,
+         memory_index<"byprice"_n, &order::by_price>,
+         memory_index<"byexpiry"_n, &order::by_expiry>
+      > bids;
+      typedef memory_table<"askorders"_n, order,
+         memory_index<"byprice"_n, &order::by_price>,
+         memory_index<"byexpiry"_n, &order::by_expiry>
+      > asks;
+   };
+
+} // namespace tokenexchange
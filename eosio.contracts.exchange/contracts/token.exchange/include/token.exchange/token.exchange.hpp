@@ -1,14 +1,15 @@
 #include <eosio/asset.hpp>
+#include <eosio/binary_extension.hpp>
 #include <eosio/eosio.hpp>
 #include <eosio/singleton.hpp>
 #include <eosio/system.hpp>
 #include <token.exchange/token.exchange_base.hpp>
-#include <cmath>
 
 
 namespace tokenexchange {
 
    using eosio::action;
+   using eosio::binary_extension;
    using eosio::current_time_point;
    using eosio::datastream;
    using eosio::extended_asset;
@@ -30,14 +31,23 @@ namespace tokenexchange {
       : contract( receiver, code, ds )
       , exchange_base( get_self() ) {}
 
-      void perform_auto_withdraw( name trader, bool order_type, extended_asset return_bid, extended_asset return_ask );
+      void send_payouts();
 
       [[eosio::action]]
       void init( bool user_pays );
 
+      [[eosio::action]]
+      void regtoken( name contract_account, symbol sym );
+
+      [[eosio::action]]
+      void migrate( name scope );
+
       [[eosio::action]]
       void withdraw( name  from, extended_asset token );
 
+      [[eosio::action]]
+      void withdrawmany( name from, vector<extended_asset> tokens );
+
       [[eosio::on_notify("*::transfer")]]
       void transfer( name from, name to, asset quantity, string memo );
 
@@ -57,10 +67,66 @@ namespace tokenexchange {
       void removepair( extended_asset quote, extended_asset base );
 
       [[eosio::action]]
-      void trade( name trader, bool order_type, extended_asset price, extended_asset volume, bool auto_withdraw );
+      void setmode( extended_asset base, extended_asset quote, uint8_t mode );
+
+      [[eosio::action]]
+      void clear( extended_asset base, extended_asset quote );
+
+      [[eosio::action]]
+      void setfees( extended_asset base, extended_asset quote, uint16_t maker_fee_bps, uint16_t taker_fee_bps );
+
+      [[eosio::action]]
+      void claimfees( name to, extended_symbol token );
+
+      [[eosio::action]]
+      void setsettle( extended_asset base, extended_asset quote, bool deferred );
+
+      [[eosio::action]]
+      void crank( extended_asset base, extended_asset quote, uint32_t max_events );
+
+      [[eosio::action]]
+      void trade( name trader, bool order_type, extended_asset price, extended_asset volume, bool auto_withdraw,
+                  binary_extension<time_point> expiration, binary_extension<uint8_t> stp_mode,
+                  binary_extension<extended_asset> display );
 
       [[eosio::action]]
       void cancel( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id );
+
+      [[eosio::action]]
+      void purge( extended_asset base, extended_asset quote, uint32_t max_orders );
+
+      [[eosio::action]]
+      void setdust( extended_asset base, extended_asset quote, extended_asset min_volume );
+
+      [[eosio::action]]
+      void setratelimit( extended_asset base, extended_asset quote, uint32_t max_orders, uint32_t window_sec );
+
+      [[eosio::action]]
+      void setbands( extended_asset base, extended_asset quote, uint16_t price_band_bps, uint16_t max_sweep_levels );
+
+      [[eosio::action]]
+      void sweepdust( extended_asset base, extended_asset quote, uint64_t from_id, uint32_t max_orders );
+
+      [[eosio::action]]
+      void stop( name trader, bool order_type, extended_asset trigger_price, extended_asset price, extended_asset volume, bool limit );
+
+      [[eosio::action]]
+      void cancelstop( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id );
+
+      [[eosio::action]]
+      void swap( name trader, extended_asset input, extended_asset quote, extended_asset min_output );
+
+      [[eosio::action]]
+      void addliquidity( name owner, extended_asset base, extended_asset quote );
+
+      [[eosio::action]]
+      void rmliquidity( name owner, extended_asset base, extended_asset quote, uint64_t shares );
+
+      [[eosio::action]]
+      void poolswap( name trader, extended_asset base, extended_asset quote, extended_asset input, extended_asset min_output );
+
+      [[eosio::action]]
+      void routeswap( name trader, extended_asset base, extended_asset quote, extended_asset input, extended_asset min_output );
    };
 
 } // namespace tokenexchange
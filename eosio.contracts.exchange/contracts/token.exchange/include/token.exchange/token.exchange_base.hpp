@@ -1,5 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <limits>
+#include <optional>
+#include <set>
+#include <string_view>
+
+#include <token.exchange/fixed_point.hpp>
+
 #ifndef SYSCONTATTRIBUTE
 #define SYSCONTATTRIBUTE [[eosio::table, eosio::contract("token.exchange")]]
 #endif
@@ -11,10 +19,43 @@
 #define BID 0
 #define ASK 1
 
+#define NO_TOKEN_ID uint64_t(-1)
+
+// matching modes
+#define CONTINUOUS    0
+#define BATCH_AUCTION 1
+#define PRO_RATA      2
+
+// self-trade prevention modes, applied by the newest of two crossing orders from the same trader
+#define STP_NONE                 0
+#define STP_CANCEL_NEWEST        1
+#define STP_CANCEL_OLDEST        2
+#define STP_DECREMENT_AND_CANCEL 3
+
+// fees are in basis points of the tokens a trader receives
+#define FEE_BPS_SCALE 10000
+#define MAX_FEE_BPS   1000
+
+// price bands are in basis points of the last trade price
+#define PRICE_BAND_BPS_SCALE 10000
+
+// liquidity pool fee in basis points of the input, kept in the pool for its providers
+#define POOL_FEE_BPS 30
+
+// fill events each pair can hold before maker balances must be cranked
+#define EVENT_QUEUE_SIZE 256
+
+// fills each pair keeps in its recent trade history
+#define TRADE_HISTORY_SIZE 100
+
+// orders each pair keeps the final status of once they leave the book filled
+#define ORDER_HISTORY_SIZE 100
+
 namespace tokenexchange {
 
    using eosio::asset;
    using eosio::extended_asset;
+   using eosio::extended_symbol;
    using eosio::check;
    using eosio::const_mem_fun;
    using eosio::indexed_by;
@@ -24,10 +65,43 @@ namespace tokenexchange {
    using eosio::time_point;
 
    using std::map;
+   using std::pair;
+   using std::set;
    using std::string;
+   using std::vector;
 
    uint128_t get_token_key( name contract_account, symbol sym );
 
+   /**
+    *  Order request carried in the memo of a deposit transfer, which lets a
+    *  user deposit and trade in a single action:
+    *
+    *    trade:<pair>:<order_type>:<price>[:<ioc>[:<withdraw>]]
+    *
+    *  ex: "trade:eosusd:1:1.32:1:1" buys EOS at 1.32 USD with the transferred
+    *  USD, cancels whatever does not fill immediately and sends the proceeds
+    *  back to the sender.
+    */
+   struct trade_instruction {
+      name     market_name;
+      bool     order_type;
+      int64_t  price;                 // quote price normalized to 8 decimals
+      bool     immediate_or_cancel;
+      bool     withdraw;
+   };
+
+   bool parse_trade_memo( std::string_view memo, trade_instruction& instruction );
+
+   /**
+    *  Balance changes summed in memory per account and token, so that each
+    *  exchange balance is written once no matter how many fills touch it.
+    */
+   struct balance_batch {
+      map<pair<name, uint128_t>, extended_asset> balances;
+
+      void add( name owner, extended_asset delta );
+   };
+
    struct SYSCON_TABLE("config") config {
       bool user_pays;
       bool is_initialized;
@@ -35,22 +109,41 @@ namespace tokenexchange {
 
    typedef eosio::singleton<"config"_n, config> configuration;
 
+   /**
+    *  Sequence of a market pair, scoped to the pair.  Numbers the pairs
+    *  orders of both sides and its stop orders in strict arrival order.
+    */
+   struct SYSCON_TABLE("sequence") sequence {
+      uint64_t next = 1;
+   };
+
+   typedef eosio::singleton<"sequence"_n, sequence> sequences;
+
+   /**
+    *  Registry of every token the exchange has seen.  Maps a token contract and
+    *  symbol to a dense numeric id, which is used as the primary key of the
+    *  exaccounts table.  The symbol is stored with the token's native precision.
+    */
+   struct SYSCONTATTRIBUTE token {
+      uint64_t  token_id;
+      name      contract;
+      symbol    sym;
+
+      uint64_t primary_key() const { return token_id; }
+      uint128_t by_token() const { return get_token_key( contract, sym ); }
+   };
+
    /**
     *  Each user has their own account with the exchange contract that keeps track
-    *  of how much a user has on deposit for each extended asset type. The assumption
-    *  is that storing a single flat map of all balances for a particular user will
-    *  be more practical than breaking this down into a multi-index table sorted by
-    *  the extended_symbol.  
+    *  of how much a user has on deposit for each extended asset type.  Rows are
+    *  keyed by the registry id of the token, so a balance is a single primary
+    *  key lookup.
     */
    struct SYSCONTATTRIBUTE exaccount {
-      uint64_t        account_id;
+      uint64_t        token_id;
       extended_asset  balance;
 
-      uint64_t primary_key() const { return account_id; }
-      uint128_t secondary_key() const {
-         return get_token_key( balance.contract,
-                                 balance.get_extended_symbol().get_symbol() );
-      }
+      uint64_t primary_key() const { return token_id; }
    };
 
    struct SYSCONTATTRIBUTE market {
@@ -61,9 +154,149 @@ namespace tokenexchange {
       uint64_t primary_key() const { return market_name.value; }
    };
 
+   /**
+    *  Last trade price of a market pair and its time weighted sum.  The TWAP
+    *  between two reads is the change in price_cumulative over the seconds
+    *  between them, after bringing each read up to date:
+    *
+    *    price_cumulative + price * ( now - last_update )
+    */
    struct SYSCONTATTRIBUTE stat {
       name           market_name;
       extended_asset price;
+      uint128_t      price_cumulative = 0;   // sum of price * seconds it was the last price, in price units
+      time_point     last_update;            // time price_cumulative was last brought up to date
+
+      uint64_t primary_key() const { return market_name.value; }
+   };
+
+   /**
+    *  Per market pair settings.  Pairs without a row use the defaults.
+    */
+   struct SYSCONTATTRIBUTE pairconfig {
+      name     market_name;
+      uint8_t  matching_mode = CONTINUOUS;
+      bool     deferred_settlement = false;
+      uint16_t maker_fee_bps = 0;
+      uint16_t taker_fee_bps = 0;
+      int64_t  min_volume = 0;   // smallest base volume an order may have or leave behind
+      uint32_t rate_limit = 0;   // orders a trader may place per window, 0 for no limit
+      uint32_t rate_window = 0;  // length of a rate limit window in seconds
+      uint16_t price_band_bps = 0;     // farthest an order price may be from the last price, 0 for no band
+      uint16_t max_sweep_levels = 0;   // price levels one order may trade through, 0 for no limit
+
+      uint64_t primary_key() const { return market_name.value; }
+   };
+
+   /**
+    *  Orders a trader placed in the current rate limit window of a market
+    *  pair, scoped to the pair.
+    */
+   struct SYSCONTATTRIBUTE ratelimit {
+      name     trader;
+      uint32_t window_start;   // seconds since epoch the window opened
+      uint32_t orders;
+
+      uint64_t primary_key() const { return trader.value; }
+   };
+
+   /**
+    *  Constant product liquidity pool of a market pair.  Swaps keep
+    *  base_reserve * quote_reserve from falling, and providers own the
+    *  reserves in proportion to their shares.  The reserves are held in this
+    *  row rather than the exchanges balance, so a swap writes one pool row.
+    */
+   struct SYSCONTATTRIBUTE pool {
+      name           market_name;
+      extended_asset base_reserve;
+      extended_asset quote_reserve;
+      uint64_t       shares = 0;   // shares issued to every provider
+
+      uint64_t primary_key() const { return market_name.value; }
+   };
+
+   /**
+    *  Liquidity pool shares of a provider, scoped to the market pair.
+    */
+   struct SYSCONTATTRIBUTE lpshare {
+      name     owner;
+      uint64_t shares;
+
+      uint64_t primary_key() const { return owner.value; }
+   };
+
+   /**
+    *  Maker proceeds waiting to be cranked.  Rows are slots of a fixed size
+    *  ring buffer and are overwritten once the queue wraps around.
+    */
+   struct SYSCONTATTRIBUTE fillevent {
+      uint64_t slot;
+      uint64_t sequence;   // event number, the queue tail when it was written
+      name     maker;
+      uint64_t token_id;
+      int64_t  amount;
+
+      uint64_t primary_key() const { return slot; }
+   };
+
+   /**
+    *  Recent fill of a market pair, scoped to the pair.  Rows are slots of a
+    *  fixed size ring buffer, each fill overwrites slot
+    *  sequence % TRADE_HISTORY_SIZE, so the history never grows.
+    */
+   struct SYSCONTATTRIBUTE recenttrade {
+      uint64_t       slot;
+      uint64_t       sequence;    // trade number of the fill within the pair
+      extended_asset price;       // normalized to 8 decimals
+      extended_asset volume;      // base volume, normalized to 8 decimals
+      bool           side;        // order type of the taker, BID sold and ASK bought
+      time_point     timestamp;
+
+      uint64_t primary_key() const { return slot; }
+      uint64_t by_sequence() const { return sequence; }
+   };
+
+   /**
+    *  Final status of an order that left the book by trading, scoped to the
+    *  pair.  The order row is erased once nothing is left, so its fills are
+    *  kept here, in slot sequence % ORDER_HISTORY_SIZE of a ring like the
+    *  recent trades.
+    */
+   struct SYSCONTATTRIBUTE filledorder {
+      uint64_t       slot;
+      uint64_t       sequence;               // number of the order among the pairs filled orders
+      uint64_t       id;                     // id the order had on the book
+      name           trader;
+      bool           side;                   // BID or ASK
+      extended_asset price;                  // limit price, normalized to 8 decimals
+      int64_t        orig_qty = 0;           // base volume the order was placed with
+      int64_t        filled_qty = 0;         // base volume traded
+      int64_t        avg_fill_price = 0;     // volume weighted price of the fills, normalized to 8 decimals
+
+      uint64_t primary_key() const { return slot; }
+      uint64_t by_sequence() const { return sequence; }
+      uint64_t by_order() const { return id; }
+   };
+
+   /**
+    *  Ring buffer cursors of a market pairs fill events.  Events head up to
+    *  tail are pending, each stored in slot sequence % EVENT_QUEUE_SIZE.
+    */
+   struct SYSCONTATTRIBUTE eventqueue {
+      name     market_name;
+      uint64_t head = 0;
+      uint64_t tail = 0;
+
+      uint64_t primary_key() const { return market_name.value; }
+   };
+
+   /**
+    *  Fees collected for a token, one row per market pair, scoped to the
+    *  registry id of the token.  Claiming a token sums every row.
+    */
+   struct SYSCONTATTRIBUTE feeshard {
+      name           market_name;
+      extended_asset balance;
 
       uint64_t primary_key() const { return market_name.value; }
    };
@@ -74,42 +307,311 @@ namespace tokenexchange {
       time_point     timestamp;
       extended_asset price;
       extended_asset volume;
+      time_point     expiration;   // good till time, default time_point() never expires
+      uint8_t        stp_mode = STP_NONE;
+      int64_t        hidden  = 0;  // iceberg reserve in base units, refills volume as it trades
+      int64_t        display = 0;  // iceberg slice size in base units, 0 for a fully visible order
+      int64_t        orig_qty = 0;        // base volume the order was placed with
+      int64_t        filled_qty = 0;      // base volume traded so far
+      int64_t        avg_fill_price = 0;  // volume weighted price of the fills, normalized to 8 decimals
+
+      bool expired( time_point now ) const { return expiration != time_point() && expiration <= now; }
+
+      // ids come from the pair sequence, so they break ties between orders placed at the same time
+      bool arrived_before( const order& other ) const {
+         return timestamp != other.timestamp ? timestamp < other.timestamp : id < other.id;
+      }
+
+      extended_asset total_volume() const {
+         extended_asset total = volume;
+         total.quantity.amount += hidden;
+         return total;
+      }
+
+      // the normalized price and visible volume, typed for the matching math
+      price_t<> limit_price() const { return price_t<>( price.quantity.amount ); }
+      qty_t<> visible_qty() const { return qty_t<>( volume.quantity.amount ); }
 
       uint64_t primary_key() const { return id; }
       uint64_t  by_price() const { return price.quantity.amount; }
+      uint64_t by_expiry() const {
+         return expiration == time_point() ? std::numeric_limits<uint64_t>::max() : expiration.time_since_epoch().count();
+      }
+   };
+
+   /**
+    *  Conditional order waiting for the last price to reach its trigger.
+    *  A triggered stop-limit order rests on the book at its limit price,
+    *  a stop order is immediate or cancel at its limit price.
+    */
+   struct SYSCONTATTRIBUTE stoporder {
+      uint64_t       id;
+      name           trader;
+      time_point     timestamp;
+      extended_asset trigger_price;
+      extended_asset price;
+      extended_asset volume;
+      bool           limit;
+
+      uint64_t primary_key() const { return id; }
+      uint64_t  by_trigger() const { return trigger_price.quantity.amount; }
    };
 
-   typedef eosio::multi_index<"exaccounts"_n, exaccount,
-   indexed_by<"bybalance"_n, const_mem_fun<exaccount, uint128_t, &exaccount::secondary_key>>
-   > exaccounts;
+   typedef eosio::multi_index<"tokens"_n, token,
+   indexed_by<"bytoken"_n, const_mem_fun<token, uint128_t, &token::by_token>>
+   > tokens;
+   typedef eosio::multi_index<"exaccounts"_n, exaccount> exaccounts;
    typedef eosio::multi_index<"markets"_n, market> markets;
    typedef eosio::multi_index<"stats"_n, stat> stats;
+   typedef eosio::multi_index<"pairconfigs"_n, pairconfig> pairconfigs;
+   typedef eosio::multi_index<"ratelimits"_n, ratelimit> ratelimits;
+   typedef eosio::multi_index<"fillevents"_n, fillevent> fillevents;
+   typedef eosio::multi_index<"eventqueues"_n, eventqueue> eventqueues;
+   typedef eosio::multi_index<"trades"_n, recenttrade,
+   indexed_by<"bysequence"_n, const_mem_fun<recenttrade, uint64_t, &recenttrade::by_sequence>>
+   > recenttrades;
+   typedef eosio::multi_index<"filledorders"_n, filledorder,
+   indexed_by<"bysequence"_n, const_mem_fun<filledorder, uint64_t, &filledorder::by_sequence>>,
+   indexed_by<"byorder"_n, const_mem_fun<filledorder, uint64_t, &filledorder::by_order>>
+   > filledorders;
+   typedef eosio::multi_index<"feeshards"_n, feeshard> feeshards;
+   typedef eosio::multi_index<"pools"_n, pool> pools;
+   typedef eosio::multi_index<"lpshares"_n, lpshare> lpshares;
    typedef eosio::multi_index<"bidorders"_n, order,
-   indexed_by<"byprice"_n, const_mem_fun<order, uint64_t, &order::by_price>>
+   indexed_by<"byprice"_n, const_mem_fun<order, uint64_t, &order::by_price>>,
+   indexed_by<"byexpiry"_n, const_mem_fun<order, uint64_t, &order::by_expiry>>
    > bids;
    typedef eosio::multi_index<"askorders"_n, order,
-   indexed_by<"byprice"_n, const_mem_fun<order, uint64_t, &order::by_price>>
+   indexed_by<"byprice"_n, const_mem_fun<order, uint64_t, &order::by_price>>,
+   indexed_by<"byexpiry"_n, const_mem_fun<order, uint64_t, &order::by_expiry>>
    > asks;
+   typedef eosio::multi_index<"stopbids"_n, stoporder,
+   indexed_by<"bytrigger"_n, const_mem_fun<stoporder, uint64_t, &stoporder::by_trigger>>
+   > stop_bids;
+   typedef eosio::multi_index<"stopasks"_n, stoporder,
+   indexed_by<"bytrigger"_n, const_mem_fun<stoporder, uint64_t, &stoporder::by_trigger>>
+   > stop_asks;
+
+   /**
+    *  Scope of a table whose rows migrate has rewritten in the current
+    *  layout, scoped to the contract.  Guards against migrating twice.
+    */
+   struct SYSCON_TABLE("migrations") migration {
+      name scope;
+
+      uint64_t primary_key() const { return scope.value; }
+   };
+
+   typedef eosio::multi_index<"migrations"_n, migration> migrations;
+
+   /**
+    *  Row layouts of the exaccounts, stats and order tables before the token
+    *  registry, read by migrate only.  Balances were keyed by a per-account
+    *  counter with a bybalance index, and stats and orders had none of the
+    *  fields appended since.
+    */
+   struct exaccount_v1 {
+      uint64_t       account_id;
+      extended_asset balance;
+
+      uint64_t primary_key() const { return account_id; }
+      uint128_t by_balance() const { return get_token_key( balance.contract, balance.quantity.symbol ); }
+
+      EOSLIB_SERIALIZE( exaccount_v1, (account_id)(balance) )
+   };
+
+   struct stat_v1 {
+      name           market_name;
+      extended_asset price;
+
+      uint64_t primary_key() const { return market_name.value; }
+
+      EOSLIB_SERIALIZE( stat_v1, (market_name)(price) )
+   };
+
+   struct order_v1 {
+      uint64_t       id;
+      name           trader;
+      time_point     timestamp;
+      extended_asset price;
+      extended_asset volume;
+
+      uint64_t primary_key() const { return id; }
+      uint64_t  by_price() const { return price.quantity.amount; }
+
+      EOSLIB_SERIALIZE( order_v1, (id)(trader)(timestamp)(price)(volume) )
+   };
+
+   typedef eosio::multi_index<"exaccounts"_n, exaccount_v1,
+   indexed_by<"bybalance"_n, const_mem_fun<exaccount_v1, uint128_t, &exaccount_v1::by_balance>>
+   > exaccounts_v1;
+   typedef eosio::multi_index<"stats"_n, stat_v1> stats_v1;
+   typedef eosio::multi_index<"bidorders"_n, order_v1,
+   indexed_by<"byprice"_n, const_mem_fun<order_v1, uint64_t, &order_v1::by_price>>
+   > bids_v1;
+   typedef eosio::multi_index<"askorders"_n, order_v1,
+   indexed_by<"byprice"_n, const_mem_fun<order_v1, uint64_t, &order_v1::by_price>>
+   > asks_v1;
+
+   /**
+    *  Storage policy of exchange_base backed by eosio tables.
+    *
+    *  A storage policy names the singleton and table types the engine keeps
+    *  its state in.  Any store with the eosio singleton and multi_index
+    *  interfaces can be used, the policy is chosen at compile time and calls
+    *  into it are not virtual.
+    */
+   struct eosio_storage {
+      typedef tokenexchange::configuration configuration;
+      typedef tokenexchange::sequences     sequences;
+      typedef tokenexchange::tokens        tokens;
+      typedef tokenexchange::exaccounts    exaccounts;
+      typedef tokenexchange::markets       markets;
+      typedef tokenexchange::stats         stats;
+      typedef tokenexchange::pairconfigs   pairconfigs;
+      typedef tokenexchange::ratelimits    ratelimits;
+      typedef tokenexchange::fillevents    fillevents;
+      typedef tokenexchange::eventqueues   eventqueues;
+      typedef tokenexchange::recenttrades  recenttrades;
+      typedef tokenexchange::filledorders  filledorders;
+      typedef tokenexchange::feeshards     feeshards;
+      typedef tokenexchange::pools         pools;
+      typedef tokenexchange::lpshares      lpshares;
+      typedef tokenexchange::bids          bids;
+      typedef tokenexchange::asks          asks;
+      typedef tokenexchange::stop_bids     stop_bids;
+      typedef tokenexchange::stop_asks     stop_asks;
+      typedef tokenexchange::migrations    migrations;
+      typedef tokenexchange::exaccounts_v1 exaccounts_v1;
+      typedef tokenexchange::stats_v1      stats_v1;
+      typedef tokenexchange::bids_v1       bids_v1;
+      typedef tokenexchange::asks_v1       asks_v1;
+   };
+
+   /**
+    *  State kept for the lifetime of one action.  The contract config,
+    *  token ids, market pair names and pair settings are read once, and table
+    *  handles are opened once per scope and shared by every helper, so rows a
+    *  handle has already loaded are not read again.
+    */
+   template <typename Storage>
+   struct exec_context {
+      std::optional<config> contract_settings;
+
+      // token ids resolved during this action, keyed by get_token_key
+      map<uint128_t, uint64_t> token_ids;
+
+      // market pair names, keyed by the base and quote token keys
+      map<pair<uint128_t, uint128_t>, name> market_pairs;
+
+      // base and quote tokens of market pairs, keyed by pair name
+      map<name, pair<extended_asset, extended_asset>> pair_tokens;
+
+      // settings of the pairs read or written during this action
+      map<name, pairconfig> pair_configs;
+
+      // next recent trade number of the pairs traded during this action
+      map<name, uint64_t> next_trades;
+
+      // next filled order number of the pairs traded during this action
+      map<name, uint64_t> next_filled_orders;
+
+      // last price level and number of levels each incoming order has traded
+      // through, keyed by market pair and order id
+      map<pair<name, uint64_t>, pair<int64_t, uint32_t>> sweeps;
+
+      // table handles, keyed by scope
+      map<name, typename Storage::exaccounts>   accounts;
+      map<name, typename Storage::bids>         bid_tables;
+      map<name, typename Storage::asks>         ask_tables;
+      map<name, typename Storage::stop_bids>    stop_bid_tables;
+      map<name, typename Storage::stop_asks>    stop_ask_tables;
+      map<name, typename Storage::sequences>    sequence_tables;
+      map<name, typename Storage::fillevents>   fill_event_tables;
+      map<name, typename Storage::recenttrades> trade_tables;
+      map<name, typename Storage::filledorders> filled_order_tables;
+   };
+
+   template <typename Storage>
+   struct basic_exchange_base {
+      // tables of the storage policy
+      typedef typename Storage::configuration configuration;
+      typedef typename Storage::sequences     sequences;
+      typedef typename Storage::tokens        tokens;
+      typedef typename Storage::exaccounts    exaccounts;
+      typedef typename Storage::markets       markets;
+      typedef typename Storage::stats         stats;
+      typedef typename Storage::pairconfigs   pairconfigs;
+      typedef typename Storage::ratelimits    ratelimits;
+      typedef typename Storage::fillevents    fillevents;
+      typedef typename Storage::eventqueues   eventqueues;
+      typedef typename Storage::recenttrades  recenttrades;
+      typedef typename Storage::filledorders  filledorders;
+      typedef typename Storage::feeshards     feeshards;
+      typedef typename Storage::pools         pools;
+      typedef typename Storage::lpshares      lpshares;
+      typedef typename Storage::bids          bids;
+      typedef typename Storage::asks          asks;
+      typedef typename Storage::stop_bids     stop_bids;
+      typedef typename Storage::stop_asks     stop_asks;
+      typedef typename Storage::migrations    migrations;
+      typedef typename Storage::exaccounts_v1 exaccounts_v1;
+      typedef typename Storage::stats_v1      stats_v1;
+      typedef typename Storage::bids_v1       bids_v1;
+      typedef typename Storage::asks_v1       asks_v1;
 
-   struct exchange_base {
       // singletons
       configuration contract_config;
 
       // tables
+      tokens  exchange_tokens;
       markets exchange_markets;
       stats   exchange_market_stats;
+      pairconfigs exchange_pair_configs;
+      eventqueues exchange_event_queues;
+      pools       exchange_pools;
 
       name self;
 
+      // lookups and table handles cached for this action
+      exec_context<Storage> ctx;
+
+      // accounts whose proceeds are transferred out at the end of the action
+      set<name> auto_withdraw_accounts;
+
+      // proceeds owed to auto_withdraw_accounts
+      balance_batch pending_payouts;
+
+      // fees charged during this action, keyed by market pair and token
+      balance_batch pending_fees;
+
       // constructor
-      exchange_base( name _self );
+      basic_exchange_base( name _self );
 
       void init_contract( bool user_pays );
       name get_ram_payer(name owner);
 
       extended_asset normalize_precision( extended_asset token );
+      extended_asset denormalize_precision( extended_asset token );
+      uint64_t find_token_id( name contract_account, symbol sym );
+      uint64_t register_token( name payer, name contract_account, symbol sym );
+      exaccounts& get_accounts( name owner );
+      bids& get_bids( name market_name );
+      asks& get_asks( name market_name );
+      stop_bids& get_stop_bids( name market_name );
+      stop_asks& get_stop_asks( name market_name );
+      sequences& get_sequences( name market_name );
+      fillevents& get_fill_events( name market_name );
+      recenttrades& get_recent_trades( name market_name );
+      filledorders& get_filled_orders( name market_name );
+      int64_t get_balance( name owner, extended_symbol token );
       void adjust_balance( name owner, extended_asset delta );
+      void credit_proceeds( name owner, extended_asset proceeds );
+      void credit_proceeds( const balance_batch& proceeds );
+      vector<pair<name, extended_asset>> collect_payouts();
       void close_account( const name& owner, const name& contract_account, const symbol& sym );
+      void migrate_scope( name scope );
+      vector<extended_asset> withdraw_balances( name owner, const vector<extended_asset>& tokens );
 
       name create_market_name( extended_asset quote );
       name create_market_pair_name( extended_asset base, extended_asset quote );
@@ -118,16 +620,68 @@ namespace tokenexchange {
       void add_market_pair( name new_owner, name market_name, extended_asset base );
 
       void remove_market_pair( extended_asset base, extended_asset quote );
+      name find_market_pair( extended_asset base, extended_asset quote );
+      pair<extended_asset, extended_asset> find_pair_tokens( name market_name );
+      pairconfig get_pair_config( name market_name );
+      uint64_t next_sequence( name market_name, uint64_t tx_id = 0 );
+      template <typename F>
+      void update_pair_config( name market_name, F&& update );
+      void set_matching_mode( extended_asset base, extended_asset quote, uint8_t matching_mode, time_point time_stamp );
+      void set_deferred_settlement( extended_asset base, extended_asset quote, bool deferred );
+      void set_fees( extended_asset base, extended_asset quote, uint16_t maker_fee_bps, uint16_t taker_fee_bps );
+      void set_min_volume( extended_asset base, extended_asset quote, extended_asset min_volume );
+      void check_min_volume( name market_name, extended_asset volume );
+      void set_rate_limit( extended_asset base, extended_asset quote, uint32_t max_orders, uint32_t window_sec );
+      void check_rate_limit( name market_name, name trader, time_point time_stamp );
+      void set_price_band( extended_asset base, extended_asset quote, uint16_t price_band_bps, uint16_t max_sweep_levels );
+      bool in_price_band( name market_name, int64_t price );
+      void check_price_band( name market_name, extended_asset price );
+      bool sweep_level( name market_name, uint64_t taker_id, int64_t level_price );
+      extended_asset charge_fee( name market_name, extended_asset proceeds, uint16_t fee_bps );
+      void flush_fees();
+      extended_asset claim_fees( extended_symbol token );
       void check_sufficient_funds( name trader, extended_asset volume_requested );
       extended_asset calculate_volume( extended_asset price, extended_asset volume );
       void cancel_order( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id );
-      void place_bid_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id );
-      void place_ask_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id );
+      uint64_t place_bid_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id = 0,
+                                time_point expiration = time_point(), uint8_t stp_mode = STP_NONE, int64_t display = 0 );
+      uint64_t place_ask_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id = 0,
+                                time_point expiration = time_point(), uint8_t stp_mode = STP_NONE, int64_t display = 0 );
+      uint64_t insert_bid_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id,
+                                 time_point expiration = time_point(), uint8_t stp_mode = STP_NONE, int64_t display = 0 );
+      uint64_t insert_ask_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id,
+                                 time_point expiration = time_point(), uint8_t stp_mode = STP_NONE, int64_t display = 0 );
+      void expire_orders( name market_name, bool order_type, const vector<order>& expired );
+      template <typename T, typename I>
+      void fill_order( name market_name, bool order_type, T& orders, I row, qty_t<> amount, price_t<> fill_price = price_t<>() );
+      void reduce_order( name market_name, bool order_type, const order& o, int64_t amount );
+      bool prevent_self_trade( name market_name, const order& taker, bool taker_type, const order& maker );
+      uint32_t purge_expired_orders( extended_asset base, extended_asset quote, time_point time_stamp, uint32_t max_orders );
+      uint32_t sweep_dust_orders( extended_asset base, extended_asset quote, uint64_t from_id, uint32_t max_orders );
+      uint64_t place_stop_order( name trader, bool order_type, extended_asset trigger_price, extended_asset price, extended_asset volume, bool limit, time_point time_stamp, uint64_t tx_id = 0 );
+      void cancel_stop_order( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id );
+      void trigger_stop_orders( name market_name, extended_asset last_price, time_point time_stamp );
+      void deposit_and_trade( name trader, extended_asset deposit, const trade_instruction& instruction, time_point time_stamp );
+      extended_asset swap_tokens( name trader, extended_asset input, extended_asset quote, extended_asset min_output, time_point time_stamp );
+      uint64_t add_liquidity( name owner, extended_asset base, extended_asset quote );
+      pair<extended_asset, extended_asset> remove_liquidity( name owner, extended_asset base, extended_asset quote, uint64_t shares );
+      extended_asset swap_pool( name trader, extended_asset base, extended_asset quote, extended_asset input, extended_asset min_output );
+      extended_asset route_swap( name trader, extended_asset base, extended_asset quote, extended_asset input, extended_asset min_output, time_point time_stamp );
 
       template <typename T, typename F>
       extended_asset calculate_price( int64_t spread, T bid, F ask );
 
-      void match_orders( name market_name );
+      void update_market_price( name market_name, extended_asset trade_price, time_point time_stamp );
+      bool queue_fill_event( name market_name, name maker, extended_asset proceeds );
+      void record_trade( name market_name, extended_asset price, extended_asset volume, bool taker_side, time_point time_stamp );
+      void record_filled_order( name market_name, bool order_type, const order& o, qty_t<> amount, price_t<> fill_price );
+      void settle_fill( name market_name, name trader, extended_asset proceeds, bool maker );
+      uint32_t crank_events( extended_asset base, extended_asset quote, uint32_t max_events );
+      void match_orders( name market_name, time_point time_stamp );
+      void match_pro_rata( name market_name, time_point time_stamp );
+      void clear_auction( extended_asset base, extended_asset quote, time_point time_stamp );
    };
 
+   typedef basic_exchange_base<eosio_storage> exchange_base;
+
 } // namespace tokenexchange
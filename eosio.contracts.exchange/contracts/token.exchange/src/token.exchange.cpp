@@ -11,6 +11,17 @@ namespace tokenexchange {
       init_contract( user_pays );
    }
 
+   void exchange::regtoken( name contract_account, symbol sym ) {
+      require_auth( get_self() );   // the symbol is trusted to carry the tokens native precision
+      check( sym.is_valid(), "invalid symbol" );
+      register_token( get_self(), contract_account, sym );
+   }
+
+   void exchange::migrate( name scope ) {
+      require_auth( get_self() );
+      migrate_scope( scope );
+   }
+
    void exchange::withdraw( name from, extended_asset token ) {
       require_auth( from );
       extended_asset normalized_token = normalize_precision( token );
@@ -27,12 +38,39 @@ namespace tokenexchange {
       ).send();
    }
 
+   void exchange::withdrawmany( name from, vector<extended_asset> tokens ) {
+      require_auth( from );
+
+      for( const auto& token : withdraw_balances( from, tokens ) ) {
+         action(
+            permission_level{ get_self(), "active"_n },
+            token.contract,
+            "transfer"_n,
+            std::make_tuple( get_self(), from, token.quantity, std::string("withdraw") )
+         ).send();
+      }
+   }
+
    void exchange::transfer( name from, name to, asset quantity, string memo ) {
       if( to == get_self() ) {
          auto a = normalize_precision( extended_asset( quantity, get_first_receiver() ) );
          check( a.quantity.is_valid(), "invalid quantity in transfer" );
          check( a.quantity.amount > 0, "transfer quantity must be positive" );
-         adjust_balance( from, a );
+         trade_instruction instruction;
+         bool trade = parse_trade_memo( memo, instruction );
+         if( trade )
+            check_rate_limit( instruction.market_name, from, current_time_point() );
+
+         register_token( from, get_first_receiver(), quantity.symbol );
+
+         if( !trade ) {
+            adjust_balance( from, a );
+            return;
+         }
+
+         deposit_and_trade( from, a, instruction, current_time_point() );
+         flush_fees();
+         send_payouts();
       }
    }
 
@@ -62,20 +100,69 @@ namespace tokenexchange {
       remove_market_pair( base, quote );
    }
 
-   void exchange::trade( name trader, bool order_type, extended_asset price, extended_asset volume, bool auto_withdraw ) {
+   void exchange::setmode( extended_asset base, extended_asset quote, uint8_t mode ) {
+      require_auth( get_self() );   // only contract account can change how market pairs match
+      set_matching_mode( base, quote, mode, current_time_point() );
+      flush_fees();
+      send_payouts();
+   }
+
+   void exchange::clear( extended_asset base, extended_asset quote ) {
+      // anyone may clear a batch auction
+      clear_auction( base, quote, current_time_point() );
+      flush_fees();
+      send_payouts();
+   }
+
+   void exchange::setfees( extended_asset base, extended_asset quote, uint16_t maker_fee_bps, uint16_t taker_fee_bps ) {
+      require_auth( get_self() );   // only contract account can set market pair fees
+      set_fees( base, quote, maker_fee_bps, taker_fee_bps );
+   }
+
+   void exchange::claimfees( name to, extended_symbol token ) {
+      require_auth( get_self() );   // only contract account can claim fees
+      adjust_balance( to, claim_fees( token ) );
+   }
+
+   void exchange::setsettle( extended_asset base, extended_asset quote, bool deferred ) {
+      require_auth( get_self() );   // only contract account can change how market pairs settle
+      set_deferred_settlement( base, quote, deferred );
+   }
+
+   void exchange::crank( extended_asset base, extended_asset quote, uint32_t max_events ) {
+      // anyone may crank the fill events of a market pair
+      crank_events( base, quote, max_events );
+   }
+
+   void exchange::trade( name trader, bool order_type, extended_asset price, extended_asset volume, bool auto_withdraw,
+                         binary_extension<time_point> expiration, binary_extension<uint8_t> stp_mode,
+                         binary_extension<extended_asset> display ) {
       require_auth( trader );
-      extended_asset return_asset;
-      int64_t        return_amount;
+
+      extended_asset normalized_price  = normalize_precision( price );
+      extended_asset normalized_volume = normalize_precision( volume );
+      check_rate_limit( find_market_pair( normalized_volume, normalized_price ), trader, current_time_point() );
+
+      if ( auto_withdraw ) {
+         auto_withdraw_accounts.insert( trader );
+      }
+
+      int64_t display_volume = 0;
+      if ( display.has_value() ) {
+         check( display.value().get_extended_symbol() == volume.get_extended_symbol(), "display must be in the base token" );
+         display_volume = normalize_precision( display.value() ).quantity.amount;
+      }
 
       if ( order_type == BID ) {
-         place_bid_order( trader, normalize_precision(price), normalize_precision(volume), current_time_point() );
+         place_bid_order( trader, normalized_price, normalized_volume, current_time_point(), 0,
+                          expiration.value_or( time_point() ), stp_mode.value_or( STP_NONE ), display_volume );
       } else if ( order_type == ASK ) {
-         place_ask_order( trader, normalize_precision(price), normalize_precision(volume), current_time_point() );
+         place_ask_order( trader, normalized_price, normalized_volume, current_time_point(), 0,
+                          expiration.value_or( time_point() ), stp_mode.value_or( STP_NONE ), display_volume );
       }
 
-      if ( auto_withdraw ) {
-         perform_auto_withdraw( trader, order_type, price, volume );
-      }
+      flush_fees();
+      send_payouts();
    }
 
    void exchange::cancel( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id ) {
@@ -84,45 +171,94 @@ namespace tokenexchange {
       cancel_order( base, quote, trader, order_type, id );
    }
 
-   void exchange::perform_auto_withdraw( name trader, bool order_type, extended_asset return_bid, extended_asset return_ask ) {
-      extended_asset return_asset;
-      int64_t        return_amount;
+   void exchange::purge( extended_asset base, extended_asset quote, uint32_t max_orders ) {
+      // anyone may purge expired orders
+      purge_expired_orders( base, quote, current_time_point(), max_orders );
+   }
 
-      if ( order_type == BID ) {
-         return_asset = return_bid;
-      } else if ( order_type == ASK ) {
-         return_asset = return_ask;
-      }
+   void exchange::setdust( extended_asset base, extended_asset quote, extended_asset min_volume ) {
+      require_auth( get_self() );   // only contract account can set the minimum volume
+      set_min_volume( base, quote, normalize_precision( min_volume ) );
+   }
 
-      // find user balance
-      exaccounts exchange_accounts( self, trader.value );
-      auto exchange_accounts_by_balance = exchange_accounts.get_index<"bybalance"_n>();
-      auto useraccount = exchange_accounts_by_balance.find( get_token_key( return_asset.contract, return_asset.quantity.symbol ) );
+   void exchange::setratelimit( extended_asset base, extended_asset quote, uint32_t max_orders, uint32_t window_sec ) {
+      require_auth( get_self() );   // only contract account can set rate limits
+      set_rate_limit( base, quote, max_orders, window_sec );
+   }
 
-      if ( order_type == BID ) {
-         return_amount = calculate_volume( normalize_precision(return_bid), normalize_precision(return_ask) ).quantity.amount;
+   void exchange::setbands( extended_asset base, extended_asset quote, uint16_t price_band_bps, uint16_t max_sweep_levels ) {
+      require_auth( get_self() );   // only contract account can set price bands
+      set_price_band( base, quote, price_band_bps, max_sweep_levels );
+   }
 
-         // denormalized token
-         if ( return_asset.quantity.symbol.precision() < useraccount->balance.quantity.symbol.precision() )
-            return_amount /= pow( 10, useraccount->balance.quantity.symbol.precision() - return_asset.quantity.symbol.precision() );
+   void exchange::sweepdust( extended_asset base, extended_asset quote, uint64_t from_id, uint32_t max_orders ) {
+      // anyone may sweep dust orders
+      sweep_dust_orders( base, quote, from_id, max_orders );
+   }
 
-      } else if ( order_type == ASK ) {
-         return_amount = return_ask.quantity.amount;
-      }
+   void exchange::stop( name trader, bool order_type, extended_asset trigger_price, extended_asset price, extended_asset volume, bool limit ) {
+      require_auth( trader );
 
-      asset return_tokens = asset(
-         return_amount,
-         symbol( return_asset.quantity.symbol.code().to_string(), return_asset.quantity.symbol.precision() )
-      );
+      extended_asset normalized_price  = normalize_precision( price );
+      extended_asset normalized_volume = normalize_precision( volume );
+      check_rate_limit( find_market_pair( normalized_volume, normalized_price ), trader, current_time_point() );
 
-      // withdraw to trader
-      adjust_balance( trader, -normalize_precision( extended_asset(return_tokens, return_asset.contract) ) );
-      action(
-         permission_level{ get_self(), "active"_n },
-         return_asset.contract,
-         "transfer"_n,
-         std::make_tuple( get_self(), trader, return_tokens, std::string("withdraw") )
-      ).send();
+      place_stop_order( trader, order_type, normalize_precision(trigger_price), normalized_price, normalized_volume, limit, current_time_point() );
+   }
+
+   void exchange::cancelstop( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id ) {
+      require_auth( trader );
+
+      cancel_stop_order( base, quote, trader, order_type, id );
+   }
+
+   void exchange::swap( name trader, extended_asset input, extended_asset quote, extended_asset min_output ) {
+      require_auth( trader );
+
+      swap_tokens( trader, normalize_precision(input), normalize_precision(quote), normalize_precision(min_output),
+                   current_time_point() );
+
+      flush_fees();
+      send_payouts();
+   }
+
+   void exchange::addliquidity( name owner, extended_asset base, extended_asset quote ) {
+      require_auth( owner );
+      add_liquidity( owner, normalize_precision(base), normalize_precision(quote) );
+   }
+
+   void exchange::rmliquidity( name owner, extended_asset base, extended_asset quote, uint64_t shares ) {
+      require_auth( owner );
+      remove_liquidity( owner, base, quote, shares );
+   }
+
+   void exchange::poolswap( name trader, extended_asset base, extended_asset quote, extended_asset input, extended_asset min_output ) {
+      require_auth( trader );
+      swap_pool( trader, base, quote, normalize_precision(input), normalize_precision(min_output) );
+   }
+
+   void exchange::routeswap( name trader, extended_asset base, extended_asset quote, extended_asset input, extended_asset min_output ) {
+      require_auth( trader );
+
+      route_swap( trader, base, quote, normalize_precision(input), normalize_precision(min_output), current_time_point() );
+
+      flush_fees();
+      send_payouts();
+   }
+
+   /**
+    *  Sends one inline transfer per account and token for the proceeds
+    *  collected from auto withdraw accounts during this action.
+    */
+   void exchange::send_payouts() {
+      for( const auto& [ to, payout ] : collect_payouts() ) {
+         action(
+            permission_level{ get_self(), "active"_n },
+            payout.contract,
+            "transfer"_n,
+            std::make_tuple( get_self(), to, payout.quantity, std::string("withdraw") )
+         ).send();
+      }
    }
 
 } /// namespace tokenexchange
@@ -6,10 +6,15 @@ namespace tokenexchange {
     *  Constructor initializes self to the operating account name
     *  and all of the exchange tables scoped to self.
     */
-   exchange_base::exchange_base( name _self )
+   template <typename Storage>
+   basic_exchange_base<Storage>::basic_exchange_base( name _self )
    : contract_config(_self, _self.value)
+   , exchange_tokens( _self, _self.value )
    , exchange_markets( _self, _self.value )
    , exchange_market_stats( _self, _self.value )
+   , exchange_pair_configs( _self, _self.value )
+   , exchange_event_queues( _self, _self.value )
+   , exchange_pools( _self, _self.value )
    , self( _self ) {}
 
    /**
@@ -29,6 +34,114 @@ namespace tokenexchange {
       return ( uint128_t( contract_account.value ) << 64 ) | sym.code().raw();
    }
 
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Adds a balance change for an account to the batch.
+    *
+    *  owner - Account name for user the balance belongs to.
+    *  delta - Balance change, normalized to 8 decimals.
+    *
+    *  return - None.
+    */
+   void balance_batch::add( name owner, extended_asset delta ) {
+      auto key = std::make_pair( owner, get_token_key( delta.contract, delta.quantity.symbol ) );
+      auto entry = balances.find( key );
+
+      if( entry == balances.end() )
+         balances.emplace( key, delta );
+      else
+         entry->second += delta;
+   }
+
+   /**
+    *  Returns the next ':' separated field of a memo and advances the memo
+    *  past it.  Fields are views into the memo so no strings are allocated.
+    */
+   std::string_view next_memo_field( std::string_view& memo ) {
+      auto separator = memo.find( ':' );
+      std::string_view field = memo.substr( 0, separator );
+
+      memo = separator == std::string_view::npos ? std::string_view() : memo.substr( separator + 1 );
+      return field;
+   }
+
+   /**
+    *  Returns a 0/1 memo flag.  Missing flags default to false.
+    */
+   bool parse_memo_flag( std::string_view field ) {
+      check( field.empty() || field == "0" || field == "1", "invalid trade memo: flags must be 0 or 1" );
+      return field == "1";
+   }
+
+   /**
+    *  Returns a decimal memo price as an amount normalized to 8 decimal places.
+    *  ex: "1.31" becomes 131000000
+    */
+   int64_t parse_memo_price( std::string_view field ) {
+      int64_t amount   = 0;
+      int64_t decimals = -1;
+
+      check( !field.empty(), "invalid trade memo: missing price" );
+
+      for( char c : field ) {
+         if( c == '.' ) {
+            check( decimals < 0, "invalid trade memo: malformed price" );
+            decimals = 0;
+            continue;
+         }
+
+         check( c >= '0' && c <= '9', "invalid trade memo: malformed price" );
+         check( decimals < 8, "only supports precision up to 8 decimals" );
+         check( amount <= ( std::numeric_limits<int64_t>::max() - 9 ) / 10, "invalid trade memo: price overflow" );
+
+         amount = amount * 10 + ( c - '0' );
+         if( decimals >= 0 )
+            ++decimals;
+      }
+
+      for( decimals = decimals < 0 ? 0 : decimals; decimals < 8; ++decimals ) {
+         check( amount <= std::numeric_limits<int64_t>::max() / 10, "invalid trade memo: price overflow" );
+         amount *= 10;
+      }
+
+      return amount;
+   }
+
+   /**
+    *  Returns true if the memo carries a trade instruction.
+    *
+    *  Description:
+    *  Parses "trade:<pair>:<order_type>:<price>[:<ioc>[:<withdraw>]]".  Memos
+    *  that do not start with "trade:" are plain deposits and return false,
+    *  malformed trade memos fail the action.
+    *
+    *  memo        - Transfer memo.
+    *  instruction - Parsed trade instruction.
+    *
+    *  return - True if memo is a trade instruction.
+    */
+   bool parse_trade_memo( std::string_view memo, trade_instruction& instruction ) {
+      if( next_memo_field( memo ) != "trade" || memo.empty() )
+         return false;
+
+      std::string_view pair_name  = next_memo_field( memo );
+      std::string_view order_type = next_memo_field( memo );
+
+      check( !pair_name.empty() && pair_name.size() <= 12, "invalid trade memo: malformed market pair" );
+      check( order_type == "0" || order_type == "1", "invalid trade memo: order type must be 0 or 1" );
+
+      instruction.market_name         = name( pair_name );
+      instruction.order_type          = order_type == "1" ? ASK : BID;
+      instruction.price               = parse_memo_price( next_memo_field( memo ) );
+      instruction.immediate_or_cancel = parse_memo_flag( next_memo_field( memo ) );
+      instruction.withdraw            = parse_memo_flag( next_memo_field( memo ) );
+
+      check( memo.empty(), "invalid trade memo: too many fields" );
+      return true;
+   }
+
    /**
     *  Returns RAM payer.
     *
@@ -39,11 +152,14 @@ namespace tokenexchange {
     *
     *  return - RAM payer account name
     */
-   name exchange_base::get_ram_payer(name owner) {
-      check( contract_config.exists(), "contract not initialized" );
-      auto entry_stored = contract_config.get();
+   template <typename Storage>
+   name basic_exchange_base<Storage>::get_ram_payer(name owner) {
+      if( !ctx.contract_settings ) {
+         check( contract_config.exists(), "contract not initialized" );
+         ctx.contract_settings = contract_config.get();
+      }
 
-      return entry_stored.user_pays ? owner : self;
+      return ctx.contract_settings->user_pays ? owner : self;
    }
 
    /**
@@ -56,7 +172,8 @@ namespace tokenexchange {
     *
     *  return - None
     */
-   void exchange_base::init_contract( bool user_pays ) {
+   template <typename Storage>
+   void basic_exchange_base<Storage>::init_contract( bool user_pays ) {
       if ( !contract_config.exists() ) {
          contract_config.get_or_create( self, config{ user_pays, true } );
          return;
@@ -88,28 +205,205 @@ namespace tokenexchange {
     *  return - Input token converted to 8 decimal places.
     *           ex: "10.12345 ABC" becomes "10.12345000 ABC"
     */
-   extended_asset exchange_base::normalize_precision( extended_asset input_token ) {
+   template <typename Storage>
+   extended_asset basic_exchange_base<Storage>::normalize_precision( extended_asset input_token ) {
       name contract_name = input_token.contract;
       string symbol_name = input_token.get_extended_symbol().get_symbol().code().to_string();
 
       int64_t input_token_precision = input_token.get_extended_symbol().get_symbol().precision();
       int64_t input_token_amount    = input_token.quantity.amount;
 
-      check( input_token_precision <= 8, "only supports precision up to 8 decimals" );
+      check( input_token_precision <= EXCHANGE_PRECISION, "only supports precision up to 8 decimals" );
 
-      if( input_token_precision < 8 ) {
-         // find precision difference
-         int64_t precision_delta = 8 - input_token_precision;
+      if( input_token_precision < EXCHANGE_PRECISION ) {
+         // normalized amount by the precision difference
+         int64_t normalized_amount = qty_t<>::from_decimals( input_token_amount, input_token_precision ).value;
 
-         // normalized amount by delta
-         int64_t normalized_amount = input_token_amount * pow( 10, precision_delta );
-
-         return extended_asset( asset(normalized_amount, symbol(symbol_name,8)), contract_name );
+         return extended_asset( asset(normalized_amount, symbol(symbol_name,EXCHANGE_PRECISION)), contract_name );
       } else {
          return input_token;
       }
    }
 
+   /**
+    *  Returns an extended_asset with the tokens native precision.
+    *
+    *  Description:
+    *  Reverses normalize_precision using the precision stored in the token
+    *  registry.  Amounts smaller than the native precision are truncated.
+    *
+    *  input_token - Token normalized to 8 decimal places.
+    *                ex: "10.12345678 EOS"
+    *
+    *  return - Input token converted to native precision.
+    *           ex: "10.12345678 EOS" becomes "10.1234 EOS"
+    */
+   template <typename Storage>
+   extended_asset basic_exchange_base<Storage>::denormalize_precision( extended_asset input_token ) {
+      uint64_t token_id = find_token_id( input_token.contract, input_token.quantity.symbol );
+      check( token_id != NO_TOKEN_ID, "token is not registered" );
+
+      symbol native_symbol = exchange_tokens.get( token_id ).sym;
+      int64_t native_amount = qty_t<>( input_token.quantity.amount ).to_decimals( native_symbol.precision() );
+
+      return extended_asset( asset( native_amount, native_symbol ), input_token.contract );
+   }
+
+   /**
+    *  Returns the registry id of a token.
+    *
+    *  Description:
+    *  Looks up the token registry by contract account and symbol code.  Ids
+    *  resolved during the current action are cached so that repeated balance
+    *  updates for the same token only cost a single primary key lookup.
+    *
+    *  contract_account - Token contract account.
+    *  sym              - Token symbol.
+    *
+    *  return - Token id, or NO_TOKEN_ID if the token has never been registered.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::find_token_id( name contract_account, symbol sym ) {
+      uint128_t key = get_token_key( contract_account, sym );
+
+      auto cached = ctx.token_ids.find( key );
+      if( cached != ctx.token_ids.end() )
+         return cached->second;
+
+      auto exchange_tokens_by_key = exchange_tokens.template get_index<"bytoken"_n>();
+      auto registered = exchange_tokens_by_key.find( key );
+
+      if( registered == exchange_tokens_by_key.end() )
+         return NO_TOKEN_ID;
+
+      ctx.token_ids.emplace( key, registered->token_id );
+      return registered->token_id;
+   }
+
+   /**
+    *  Returns the registry id of a token, registering it if needed.
+    *
+    *  Description:
+    *  Emplaces a new token registry entry the first time a token is seen.
+    *  The symbol is stored as given, so deposits should register the token
+    *  with its native precision before any normalized balance is written.
+    *
+    *  payer            - RAM payer if end-user set to pay for RAM
+    *  contract_account - Token contract account.
+    *  sym              - Token symbol.
+    *
+    *  return - Token id.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::register_token( name payer, name contract_account, symbol sym ) {
+      uint64_t token_id = find_token_id( contract_account, sym );
+
+      if( token_id != NO_TOKEN_ID )
+         return token_id;
+
+      token_id = exchange_tokens.available_primary_key();
+      exchange_tokens.emplace( get_ram_payer(payer), [&]( auto& t ) {
+         t.token_id = token_id;
+         t.contract = contract_account;
+         t.sym      = sym;
+      });
+
+      ctx.token_ids.emplace( get_token_key( contract_account, sym ), token_id );
+      return token_id;
+   }
+
+   /**
+    *  Returns the exaccounts table of an owner, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_accounts( name owner ) -> exaccounts& {
+      return ctx.accounts.try_emplace( owner, self, owner.value ).first->second;
+   }
+
+   /**
+    *  Returns the bidorders table of a market pair, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_bids( name market_name ) -> bids& {
+      return ctx.bid_tables.try_emplace( market_name, self, market_name.value ).first->second;
+   }
+
+   /**
+    *  Returns the askorders table of a market pair, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_asks( name market_name ) -> asks& {
+      return ctx.ask_tables.try_emplace( market_name, self, market_name.value ).first->second;
+   }
+
+   /**
+    *  Returns the stopbids table of a market pair, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_stop_bids( name market_name ) -> stop_bids& {
+      return ctx.stop_bid_tables.try_emplace( market_name, self, market_name.value ).first->second;
+   }
+
+   /**
+    *  Returns the stopasks table of a market pair, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_stop_asks( name market_name ) -> stop_asks& {
+      return ctx.stop_ask_tables.try_emplace( market_name, self, market_name.value ).first->second;
+   }
+
+   /**
+    *  Returns the sequence singleton of a market pair, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_sequences( name market_name ) -> sequences& {
+      return ctx.sequence_tables.try_emplace( market_name, self, market_name.value ).first->second;
+   }
+
+   /**
+    *  Returns the fillevents table of a market pair, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_fill_events( name market_name ) -> fillevents& {
+      return ctx.fill_event_tables.try_emplace( market_name, self, market_name.value ).first->second;
+   }
+
+   /**
+    *  Returns the trades table of a market pair, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_recent_trades( name market_name ) -> recenttrades& {
+      return ctx.trade_tables.try_emplace( market_name, self, market_name.value ).first->second;
+   }
+
+   /**
+    *  Returns the filledorders table of a market pair, opened once per action.
+    */
+   template <typename Storage>
+   auto basic_exchange_base<Storage>::get_filled_orders( name market_name ) -> filledorders& {
+      return ctx.filled_order_tables.try_emplace( market_name, self, market_name.value ).first->second;
+   }
+
+   /**
+    *  Returns a users exchange balance amount for a token.
+    *
+    *  owner - Account name for user the balance belongs to.
+    *  token - Token contract and symbol.
+    *
+    *  return - Balance amount, 0 if the user has no balance row.
+    */
+   template <typename Storage>
+   int64_t basic_exchange_base<Storage>::get_balance( name owner, extended_symbol token ) {
+      uint64_t token_id = find_token_id( token.get_contract(), token.get_symbol() );
+      if( token_id == NO_TOKEN_ID )
+         return 0;
+
+      exaccounts& exchange_accounts = get_accounts( owner );
+      auto useraccount = exchange_accounts.find( token_id );
+
+      return useraccount == exchange_accounts.end() ? 0 : useraccount->balance.quantity.amount;
+   }
+
    /**
     *  No return value.
     *
@@ -118,25 +412,29 @@ namespace tokenexchange {
     *  modifies or deletes a users exchange balance upon placing orders
     *  or withdrawal.
     *
+    *  The token must already be registered, by its deposit, so the registry
+    *  never records the normalized precision of a delta.
+    *
     *  owner  - Account name for user the balance belongs to.
     *  delta - Incoming asset balance. Positive delta increases users balance,
     *          negative delta decreases users balance.
     *
     *  return - None.
     */
-   void exchange_base::adjust_balance( name owner, extended_asset delta ) {
-      exaccounts exchange_accounts( self, owner.value );
-      auto exchange_accounts_by_balance = exchange_accounts.get_index<"bybalance"_n>();
-
-      uint128_t key = get_token_key( delta.contract, delta.get_extended_symbol().get_symbol() );
+   template <typename Storage>
+   void basic_exchange_base<Storage>::adjust_balance( name owner, extended_asset delta ) {
+      exaccounts& exchange_accounts = get_accounts( owner );
 
-      auto useraccount = exchange_accounts_by_balance.find( key );
+      uint64_t token_id = find_token_id( delta.contract, delta.get_extended_symbol().get_symbol() );
+      auto useraccount = token_id == NO_TOKEN_ID ? exchange_accounts.end() : exchange_accounts.find( token_id );
 
-      if( useraccount == exchange_accounts_by_balance.end() ) {
+      if( useraccount == exchange_accounts.end() ) {
          check( delta.quantity.amount >= 0, "exchange balance overdrawn" );
+         check( token_id != NO_TOKEN_ID, "token is not registered" );
+
          exchange_accounts.emplace( get_ram_payer(owner), [&]( auto& exa ) {
-            exa.account_id = exchange_accounts.available_primary_key();
-            exa.balance = delta;
+            exa.token_id = token_id;
+            exa.balance  = delta;
          });
          return;
       }
@@ -144,11 +442,83 @@ namespace tokenexchange {
       int64_t new_user_balance = useraccount->balance.quantity.amount + delta.quantity.amount;
 
       check( new_user_balance >= 0, "exchange balance overdrawn" );
-         exchange_accounts_by_balance.modify( useraccount, same_payer, [&]( auto& exa ) {
+      exchange_accounts.modify( useraccount, same_payer, [&]( auto& exa ) {
          exa.balance += delta;
       });
    }
 
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Credits tokens received from a fill or refund.  Accounts that asked for
+    *  an auto withdraw have their proceeds summed in memory per token instead
+    *  of being written to their exchange balance, and are paid out once by
+    *  collect_payouts at the end of the action.
+    *
+    *  owner    - Account receiving the tokens.
+    *  proceeds - Tokens received, normalized to 8 decimals.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::credit_proceeds( name owner, extended_asset proceeds ) {
+      if( proceeds.quantity.amount == 0 )
+         return;
+
+      if( auto_withdraw_accounts.count( owner ) == 0 ) {
+         adjust_balance( owner, proceeds );
+         return;
+      }
+
+      pending_payouts.add( owner, proceeds );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Credits every entry of a balance batch, one write per account and token.
+    *
+    *  proceeds - Summed fills and refunds.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::credit_proceeds( const balance_batch& proceeds ) {
+      for( const auto& [ key, delta ] : proceeds.balances )
+         credit_proceeds( key.first, delta );
+   }
+
+   /**
+    *  Returns the transfers owed to auto withdraw accounts.
+    *
+    *  Description:
+    *  Converts the proceeds summed by credit_proceeds to each tokens native
+    *  precision, one entry per account and token.  Amounts below the native
+    *  precision cannot be transferred and are credited to the exchange
+    *  balance instead.  Clears the pending payouts.
+    *
+    *  return - Account and token amount pairs to transfer.
+    */
+   template <typename Storage>
+   vector<pair<name, extended_asset>> basic_exchange_base<Storage>::collect_payouts() {
+      vector<pair<name, extended_asset>> payouts;
+
+      for( const auto& [ key, proceeds ] : pending_payouts.balances ) {
+         extended_asset payout = denormalize_precision( proceeds );
+         extended_asset dust   = proceeds - normalize_precision( payout );
+
+         if( payout.quantity.amount > 0 )
+            payouts.emplace_back( key.first, payout );
+         if( dust.quantity.amount > 0 )
+            adjust_balance( key.first, dust );
+      }
+
+      pending_payouts.balances.clear();
+      return payouts;
+   }
+
    /**
     *  No return value.
     *
@@ -161,17 +531,176 @@ namespace tokenexchange {
     *
     *  return - None.
     */
-   void exchange_base::close_account( const name& owner, const name& contract_account, const symbol& sym ) {
-      exaccounts exchange_accounts( self, owner.value );
-      auto exchange_accounts_by_balance = exchange_accounts.get_index<"bybalance"_n>();
+   template <typename Storage>
+   void basic_exchange_base<Storage>::close_account( const name& owner, const name& contract_account, const symbol& sym ) {
+      exaccounts& exchange_accounts = get_accounts( owner );
 
-      uint128_t key = get_token_key( contract_account, sym );
-      auto useraccount = exchange_accounts_by_balance.find( key );
+      uint64_t token_id = find_token_id( contract_account, sym );
+      check( token_id != NO_TOKEN_ID, "balance row already deleted or never existed" );
 
-      check( useraccount != exchange_accounts_by_balance.end(), "balance row already deleted or never existed" );
+      auto useraccount = exchange_accounts.find( token_id );
+
+      check( useraccount != exchange_accounts.end(), "balance row already deleted or never existed" );
       check( useraccount->balance.quantity.amount == 0, "cannot close because the balance is not zero" );
 
-      exchange_accounts_by_balance.erase( useraccount );
+      exchange_accounts.erase( useraccount );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Rewrites the rows an older deployment left in one scope in the current
+    *  layout.  Balances are re-keyed by their token registry id, stats rows
+    *  start a new TWAP, and orders keep their id and rest with no expiry, no
+    *  iceberg reserve and their volume as orig_qty.  Each old row is erased
+    *  through its old indexes before the new row is written, and the new
+    *  rows are paid by the contract.
+    *
+    *  The tokens of the balances must be registered at their native
+    *  precision first, the old rows only hold the normalized symbol.  Old and
+    *  new rows cannot be told apart, so every scope is migrated once, before
+    *  the upgraded contract writes to it.
+    *
+    *  scope - Account scope of exaccounts, market pair scope of the order
+    *          tables, or the contract for stats.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::migrate_scope( name scope ) {
+      migrations exchange_migrations( self, self.value );
+      check( exchange_migrations.find( scope.value ) == exchange_migrations.end(), "scope is already migrated" );
+
+      // read and erase every old row before writing, old keys may equal new ones
+      exaccounts_v1 old_accounts( self, scope.value );
+      vector<exaccount_v1> old_balances;
+      for( auto itr = old_accounts.begin(); itr != old_accounts.end(); ) {
+         old_balances.push_back( *itr );
+         itr = old_accounts.erase( itr );
+      }
+
+      stats_v1 old_stats( self, scope.value );
+      vector<stat_v1> old_prices;
+      for( auto itr = old_stats.begin(); itr != old_stats.end(); ) {
+         old_prices.push_back( *itr );
+         itr = old_stats.erase( itr );
+      }
+
+      bids_v1 old_bids( self, scope.value );
+      asks_v1 old_asks( self, scope.value );
+      vector<order_v1> old_bid_orders;
+      vector<order_v1> old_ask_orders;
+      for( auto itr = old_bids.begin(); itr != old_bids.end(); ) {
+         old_bid_orders.push_back( *itr );
+         itr = old_bids.erase( itr );
+      }
+      for( auto itr = old_asks.begin(); itr != old_asks.end(); ) {
+         old_ask_orders.push_back( *itr );
+         itr = old_asks.erase( itr );
+      }
+
+      exaccounts& exchange_accounts = get_accounts( scope );
+      for( const auto& old_balance : old_balances ) {
+         uint64_t token_id = find_token_id( old_balance.balance.contract, old_balance.balance.quantity.symbol );
+         check( token_id != NO_TOKEN_ID, "token is not registered" );
+
+         auto useraccount = exchange_accounts.find( token_id );
+         if( useraccount == exchange_accounts.end() ) {
+            exchange_accounts.emplace( self, [&]( auto& exa ) {
+               exa.token_id = token_id;
+               exa.balance  = old_balance.balance;
+            });
+         } else {
+            exchange_accounts.modify( useraccount, same_payer, [&]( auto& exa ) {
+               exa.balance += old_balance.balance;
+            });
+         }
+      }
+
+      for( const auto& old_price : old_prices ) {
+         exchange_market_stats.emplace( self, [&]( auto& s ) {
+            s.market_name = old_price.market_name;
+            s.price       = old_price.price;
+         });
+      }
+
+      auto migrate_orders = [&]( auto& orders, const vector<order_v1>& old_orders ) {
+         for( const auto& old_order : old_orders ) {
+            orders.emplace( self, [&]( auto& o ) {
+               o.id        = old_order.id;
+               o.trader    = old_order.trader;
+               o.timestamp = old_order.timestamp;
+               o.price     = old_order.price;
+               o.volume    = old_order.volume;
+               o.orig_qty  = old_order.volume.quantity.amount;
+            });
+         }
+      };
+      migrate_orders( get_bids( scope ), old_bid_orders );
+      migrate_orders( get_asks( scope ), old_ask_orders );
+
+      exchange_migrations.emplace( self, [&]( auto& m ) {
+         m.scope = scope;
+      });
+   }
+
+   /**
+    *  Returns the tokens to transfer to the owner.
+    *
+    *  Description:
+    *  Debits several exchange balances in one pass over the owners exaccounts
+    *  scope.  Requests for the same token are summed first, so every balance
+    *  row is modified once and every token is transferred once, no matter how
+    *  many times it is listed.
+    *
+    *  owner  - Account name for user the balances belong to.
+    *  tokens - Tokens to withdraw at their native precision.
+    *
+    *  return - Coalesced tokens to transfer, one per token contract and symbol.
+    */
+   template <typename Storage>
+   vector<extended_asset> basic_exchange_base<Storage>::withdraw_balances( name owner, const vector<extended_asset>& tokens ) {
+      map<uint128_t, extended_asset> requested;
+
+      for( const auto& token : tokens ) {
+         check( token.quantity.is_valid(), "invalid quantity" );
+         check( token.quantity.amount >= 0, "cannot withdraw negative balance" );
+         if( token.quantity.amount == 0 )
+            continue;
+
+         auto key = get_token_key( token.contract, token.quantity.symbol );
+         auto entry = requested.find( key );
+
+         if( entry == requested.end() ) {
+            requested.emplace( key, token );
+         } else {
+            check( entry->second.quantity.symbol == token.quantity.symbol, "mismatched precision for the same token" );
+            entry->second += token;
+         }
+      }
+
+      exaccounts& exchange_accounts = get_accounts( owner );
+      vector<extended_asset> transfers;
+      transfers.reserve( requested.size() );
+
+      for( const auto& [ key, token ] : requested ) {
+         extended_asset normalized_token = normalize_precision( token );
+
+         uint64_t token_id = find_token_id( token.contract, token.quantity.symbol );
+         auto useraccount = token_id == NO_TOKEN_ID ? exchange_accounts.end() : exchange_accounts.find( token_id );
+
+         check( useraccount != exchange_accounts.end(), "exchange balance overdrawn" );
+         check( useraccount->balance.quantity.amount >= normalized_token.quantity.amount, "exchange balance overdrawn" );
+
+         exchange_accounts.modify( useraccount, same_payer, [&]( auto& exa ) {
+            exa.balance -= normalized_token;
+         });
+
+         transfers.push_back( token );
+      }
+
+      return transfers;
    }
 
    /**
@@ -185,7 +714,8 @@ namespace tokenexchange {
     *
     *  return - An eosio name for the market pair.
     */
-   name exchange_base::create_market_name( extended_asset quote ) {
+   template <typename Storage>
+   name basic_exchange_base<Storage>::create_market_name( extended_asset quote ) {
       string quote_symbol  = quote.get_extended_symbol().get_symbol().code().to_string();
 
       // convert to lowercase
@@ -209,7 +739,8 @@ namespace tokenexchange {
     *
     *  return - An eosio name for the market pair.
     */
-   name exchange_base::create_market_pair_name( extended_asset base, extended_asset quote ) {
+   template <typename Storage>
+   name basic_exchange_base<Storage>::create_market_pair_name( extended_asset base, extended_asset quote ) {
       string base_symbol  = base.get_extended_symbol().get_symbol().code().to_string();
       string quote_symbol = quote.get_extended_symbol().get_symbol().code().to_string();
 
@@ -234,7 +765,8 @@ namespace tokenexchange {
     *
     *  return - None.
     */
-   void exchange_base::create_market( name owner, extended_asset quote ) {
+   template <typename Storage>
+   void basic_exchange_base<Storage>::create_market( name owner, extended_asset quote ) {
       name market_name = create_market_name( quote );
       auto market = exchange_markets.find( market_name.value );
       check( market == exchange_markets.end(), "market already exists" );
@@ -255,7 +787,8 @@ namespace tokenexchange {
     *
     *  return - None.
     */
-   void exchange_base::remove_market( extended_asset quote ) {
+   template <typename Storage>
+   void basic_exchange_base<Storage>::remove_market( extended_asset quote ) {
       name market_name = create_market_name( quote );
       auto market = exchange_markets.find( market_name.value );
       check( market != exchange_markets.end(), "market does not exist" );
@@ -276,7 +809,8 @@ namespace tokenexchange {
     *
     *  return - None.
     */
-   void exchange_base::add_market_pair( name new_owner, name market_name, extended_asset base ) {
+   template <typename Storage>
+   void basic_exchange_base<Storage>::add_market_pair( name new_owner, name market_name, extended_asset base ) {
       auto market = exchange_markets.find( market_name.value );
       check( market != exchange_markets.end(), "market does not exist" );
       check( market_name != create_market_name( base ), "cannot pair asset against itself" );
@@ -308,176 +842,1960 @@ namespace tokenexchange {
     *
     *  return - None.
     */
-   void exchange_base::remove_market_pair( extended_asset base, extended_asset quote ) {
+   template <typename Storage>
+   void basic_exchange_base<Storage>::remove_market_pair( extended_asset base, extended_asset quote ) {
       auto market = exchange_markets.find( create_market_name( quote ).value );
       check( market != exchange_markets.end(), "market does not exist" );
       auto market_pair = market->bases.find( create_market_pair_name( base, quote ) );
       check( market_pair != market->bases.end(), "market pair does not exist" );
 
+      name market_name = market_pair->first;
+      ctx.market_pairs.clear();
+      ctx.pair_tokens.clear();
+      ctx.pair_configs.erase( market_name );
+
+      auto event_queue = exchange_event_queues.find( market_name.value );
+      if( event_queue != exchange_event_queues.end() ) {
+         check( event_queue->head == event_queue->tail, "fill events must be cranked before removing the market pair" );
+
+         fillevents& events = get_fill_events( market_name );
+         for( auto event = events.begin(); event != events.end(); )
+            event = events.erase( event );
+         exchange_event_queues.erase( event_queue );
+      }
+
+      check( exchange_pools.find( market_name.value ) == exchange_pools.end(), "liquidity must be removed before removing the market pair" );
+
       exchange_markets.modify( market, same_payer, [&]( auto& m ) {
          m.bases.erase( market_pair );
 
-         auto market_stats = exchange_market_stats.find( create_market_pair_name( base, quote ).value );
+         auto market_stats = exchange_market_stats.find( market_name.value );
          exchange_market_stats.erase( market_stats );
       });
-   }
-
-   void exchange_base::check_sufficient_funds( name trader, extended_asset volume_requested ) {
-      exaccounts exchange_accounts( self, trader.value );
-      auto exaccounts = exchange_accounts.get_index<"bybalance"_n>();
-      uint128_t key = get_token_key( volume_requested.contract, volume_requested.get_extended_symbol().get_symbol() );
-      auto useraccount = exaccounts.find( key );
 
-      int64_t user_balance_amount = useraccount->balance.quantity.amount;
-      const char *error = ( "user does not have sufficient funds, only has "
-         + std::to_string(user_balance_amount) + ", requires "
-         + std::to_string(volume_requested.quantity.amount) ).c_str();
-
-      check( user_balance_amount >= volume_requested.quantity.amount, error );
+      auto pair_config = exchange_pair_configs.find( market_name.value );
+      if( pair_config != exchange_pair_configs.end() )
+         exchange_pair_configs.erase( pair_config );
    }
 
    /**
-    *  Returns the amount for tokens needed to place an ask order
+    *  Returns the market pair name.
     *
-    *  Example:
-    *  A ask for is request for buying 100 EOS at 3.50 USD per token.  To calculate the amount of
-    *  USD needed to buy the entire order, perform the following math:
-    *    volume_needed(USD) = price(USD/EOS) * volume(EOS)
+    *  Description:
+    *  Checks that the market and market pair exist.  Pairs found during the
+    *  current action are cached.
     *
-    *    volume_needed(USD) = 3.50000000 USD/EOS * 100.00000000 EOS
-    *    volume_needed(USD) = 350.00000000 USD
+    *  base  - Base asset.
+    *  quote - Quote asset.
+    *
+    *  return - An eosio name for the market pair.
     */
-   extended_asset exchange_base::calculate_volume( extended_asset price, extended_asset volume ) {
-      int64_t volume_total =  int128_t( price.quantity.amount ) * int128_t( volume.quantity.amount )
-                              / pow( 10, price.get_extended_symbol().get_symbol().precision() );
+   template <typename Storage>
+   name basic_exchange_base<Storage>::find_market_pair( extended_asset base, extended_asset quote ) {
+      auto key = std::make_pair( get_token_key( base.contract, base.quantity.symbol ), get_token_key( quote.contract, quote.quantity.symbol ) );
+
+      auto cached = ctx.market_pairs.find( key );
+      if( cached != ctx.market_pairs.end() )
+         return cached->second;
+
+      auto market = exchange_markets.find( create_market_name( quote ).value );
+      check( market != exchange_markets.end(), "market does not exist" );
+      auto market_pair = market->bases.find( create_market_pair_name( base, quote ) );
+      check( market_pair != market->bases.end(), "market pair does not exist" );
 
-      return extended_asset( asset( volume_total, price.get_extended_symbol().get_symbol() ), price.contract );
+      ctx.market_pairs.emplace( key, market_pair->first );
+      return market_pair->first;
    }
 
    /**
-    *  No return value.
+    *  Returns the base and quote tokens of a market pair.
     *
     *  Description:
-    *  Cancels a traders order given the order type (BID/ASK)
-    *  and trade ID.
+    *  Checks that the market pair exists.  Pairs found during the current
+    *  action are cached, and find_market_pair then hits the cache for them
+    *  too.
     *
-    *  market     - Market name where the order exists.
-    *  trader     - Traders account name.
-    *  order_type - Order type: BID or ASK.
-    *  id         - trade ID.
+    *  market_name - Market pair name.
     *
-    *  return - None.
+    *  return - Base and quote tokens with zero amounts, in native precision.
     */
-   void exchange_base::cancel_order( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id ) {
-      // find market
+   template <typename Storage>
+   pair<extended_asset, extended_asset> basic_exchange_base<Storage>::find_pair_tokens( name market_name ) {
+      auto cached = ctx.pair_tokens.find( market_name );
+      if( cached != ctx.pair_tokens.end() )
+         return cached->second;
+
+      auto market_stats = exchange_market_stats.find( market_name.value );
+      check( market_stats != exchange_market_stats.end(), "market pair does not exist" );
+
+      extended_asset quote = market_stats->price;
+      quote.quantity.amount = 0;
       auto market = exchange_markets.find( create_market_name( quote ).value );
       check( market != exchange_markets.end(), "market does not exist" );
-      auto market_pair = market->bases.find( create_market_pair_name( base, quote ) );
+      auto market_pair = market->bases.find( market_name );
       check( market_pair != market->bases.end(), "market pair does not exist" );
-      name market_pair_name = market_pair->first;
+
+      extended_asset base = market_pair->second;
+      base.quantity.amount = 0;
+
+      auto key = std::make_pair( get_token_key( base.contract, base.quantity.symbol ), get_token_key( quote.contract, quote.quantity.symbol ) );
+      ctx.market_pairs.emplace( key, market_name );
+
+      return ctx.pair_tokens.emplace( market_name, std::make_pair( base, quote ) ).first->second;
+   }
+
+   /**
+    *  Returns the next sequence number of a market pair.
+    *
+    *  Description:
+    *  Issues order ids for both sides of a pair and stop order ids from one
+    *  counter, in strict arrival order.  A provided id moves the counter
+    *  past it.  A pair that predates the sequence starts after the ids
+    *  already in its tables.
+    *
+    *  market_name - Market pair name.
+    *  tx_id       - Provided ID, used for testing, 0 to issue the next number.
+    *
+    *  return - The sequence number.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::next_sequence( name market_name, uint64_t tx_id ) {
+      sequences& pair_sequence = get_sequences( market_name );
+      sequence seq;
+
+      if( pair_sequence.exists() ) {
+         seq = pair_sequence.get();
+      } else {
+         bids& bid_orders = get_bids( market_name );
+         asks& ask_orders = get_asks( market_name );
+         stop_bids& stop_bid_orders = get_stop_bids( market_name );
+         stop_asks& stop_ask_orders = get_stop_asks( market_name );
+         seq.next = std::max( { seq.next, bid_orders.available_primary_key(), ask_orders.available_primary_key(),
+                                stop_bid_orders.available_primary_key(), stop_ask_orders.available_primary_key() } );
+      }
+
+      uint64_t number = tx_id != 0 ? tx_id : seq.next;
+      seq.next = std::max( seq.next, number + 1 );
+      pair_sequence.set( seq, self );
+
+      return number;
+   }
+
+   /**
+    *  Returns the settings of a market pair, read once per action.
+    *
+    *  market_name - Market pair name.
+    *
+    *  return - Stored settings, or the defaults if none were set.
+    */
+   template <typename Storage>
+   pairconfig basic_exchange_base<Storage>::get_pair_config( name market_name ) {
+      auto cached = ctx.pair_configs.find( market_name );
+      if( cached != ctx.pair_configs.end() )
+         return cached->second;
+
+      auto pair_config = exchange_pair_configs.find( market_name.value );
+
+      pairconfig settings;
+      if( pair_config == exchange_pair_configs.end() )
+         settings.market_name = market_name;
+      else
+         settings = *pair_config;
+
+      ctx.pair_configs.emplace( market_name, settings );
+      return settings;
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Applies a change to a market pairs settings, creating the row from the
+    *  defaults the first time a pair is configured.
+    *
+    *  market_name - Market pair name.
+    *  update      - Callback modifying the pairconfig row.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   template <typename F>
+   void basic_exchange_base<Storage>::update_pair_config( name market_name, F&& update ) {
+      auto pair_config = exchange_pair_configs.find( market_name.value );
+
+      if( pair_config == exchange_pair_configs.end() ) {
+         exchange_pair_configs.emplace( self, [&]( auto& c ) {
+            c.market_name = market_name;
+            update( c );
+         });
+      } else {
+         exchange_pair_configs.modify( pair_config, same_payer, update );
+      }
+
+      ctx.pair_configs.erase( market_name );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Sets how a market pair matches orders.  Orders in CONTINUOUS pairs are
+    *  matched as soon as they are placed, one order at a time in price-time
+    *  priority.  PRO_RATA pairs also match on placement, but split each fill
+    *  across every resting order at the best price.  Orders in BATCH_AUCTION
+    *  pairs rest until clear_auction settles every crossing order at one
+    *  price.  Any orders left crossing when a pair leaves BATCH_AUCTION are
+    *  matched immediately.
+    *
+    *  base          - Base asset.
+    *  quote         - Quote asset.
+    *  matching_mode - CONTINUOUS, BATCH_AUCTION or PRO_RATA.
+    *  time_stamp    - Time setmode action was executed.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::set_matching_mode( extended_asset base, extended_asset quote, uint8_t matching_mode, time_point time_stamp ) {
+      check( matching_mode <= PRO_RATA, "invalid matching mode" );
+      name market_name = find_market_pair( base, quote );
+
+      update_pair_config( market_name, [&]( auto& c ) {
+         c.matching_mode = matching_mode;
+      });
+
+      if( matching_mode != BATCH_AUCTION )
+         match_orders( market_name, time_stamp );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Sets the maker and taker fees of a market pair.
+    *
+    *  base          - Base asset.
+    *  quote         - Quote asset.
+    *  maker_fee_bps - Fee charged to resting orders, in basis points.
+    *  taker_fee_bps - Fee charged to incoming orders, in basis points.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::set_fees( extended_asset base, extended_asset quote, uint16_t maker_fee_bps, uint16_t taker_fee_bps ) {
+      check( maker_fee_bps <= MAX_FEE_BPS && taker_fee_bps <= MAX_FEE_BPS, "fee is too high" );
+      name market_name = find_market_pair( base, quote );
+
+      update_pair_config( market_name, [&]( auto& c ) {
+         c.maker_fee_bps = maker_fee_bps;
+         c.taker_fee_bps = taker_fee_bps;
+      });
+   }
+
+   /**
+    *  Returns the fee charged.
+    *
+    *  Description:
+    *  Charges a fee on tokens a trader receives from a fill.  The fee stays in
+    *  the exchanges balance and is summed in memory until flush_fees, so fills
+    *  write no fee rows.  The caller credits the trader proceeds - fee.
+    *
+    *  market_name - Market pair name.
+    *  proceeds    - Tokens received from the fill, normalized to 8 decimals.
+    *  fee_bps     - Fee in basis points.
+    *
+    *  return - Fee charged, in the proceeds token.
+    */
+   template <typename Storage>
+   extended_asset basic_exchange_base<Storage>::charge_fee( name market_name, extended_asset proceeds, uint16_t fee_bps ) {
+      extended_asset fee = proceeds;
+      fee.quantity.amount = scale_by( qty_t<>( proceeds.quantity.amount ), fee_bps, FEE_BPS_SCALE ).value;
+
+      if( fee.quantity.amount > 0 )
+         pending_fees.add( market_name, fee );
+
+      return fee;
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Writes the fees charged during the action to the fee rows.  Each market
+    *  pair and token row is written once, and the exchanges balance is
+    *  debited once per token.  Call once at the end of every action that can
+    *  match orders.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::flush_fees() {
+      balance_batch collected;
+
+      for( const auto& [ key, fee ] : pending_fees.balances ) {
+         feeshards fee_shards( self, find_token_id( fee.contract, fee.quantity.symbol ) );
+         auto shard = fee_shards.find( key.first.value );
+
+         if( shard == fee_shards.end() ) {
+            fee_shards.emplace( self, [&]( auto& f ) {
+               f.market_name = key.first;
+               f.balance     = fee;
+            });
+         } else {
+            fee_shards.modify( shard, same_payer, [&]( auto& f ) {
+               f.balance += fee;
+            });
+         }
+
+         collected.add( self, fee );
+      }
+
+      for( const auto& [ key, total ] : collected.balances )
+         adjust_balance( self, -total );
+
+      pending_fees.balances.clear();
+   }
+
+   /**
+    *  Returns the fees claimed.
+    *
+    *  Description:
+    *  Sums and removes every fee row of a token.
+    *
+    *  token - Token contract and symbol.
+    *
+    *  return - Fees collected for the token, normalized to 8 decimals.
+    */
+   template <typename Storage>
+   extended_asset basic_exchange_base<Storage>::claim_fees( extended_symbol token ) {
+      uint64_t token_id = find_token_id( token.get_contract(), token.get_symbol() );
+      check( token_id != NO_TOKEN_ID, "token is not registered" );
+
+      feeshards fee_shards( self, token_id );
+      auto shard = fee_shards.begin();
+      check( shard != fee_shards.end(), "no fees to claim" );
+
+      extended_asset total = shard->balance;
+      total.quantity.amount = 0;
+
+      while( shard != fee_shards.end() ) {
+         total += shard->balance;
+         shard = fee_shards.erase( shard );
+      }
+
+      return total;
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Sets whether makers of a market pair are paid when their orders fill,
+    *  or later by crank_events.  Events already queued stay crankable when
+    *  deferred settlement is switched off.
+    *
+    *  base     - Base asset.
+    *  quote    - Quote asset.
+    *  deferred - True to queue maker proceeds as fill events.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::set_deferred_settlement( extended_asset base, extended_asset quote, bool deferred ) {
+      name market_name = find_market_pair( base, quote );
+
+      update_pair_config( market_name, [&]( auto& c ) {
+         c.deferred_settlement = deferred;
+      });
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Sets the smallest base volume an order of a market pair may have.
+    *  Smaller orders are rejected, and fills that leave less than this
+    *  behind cancel and refund the remainder instead of keeping it on the
+    *  book.  Orders already below it are removed by sweep_dust_orders.
+    *
+    *  base       - Base asset.
+    *  quote      - Quote asset.
+    *  min_volume - Minimum base volume, normalized to 8 decimals.  0 allows any volume.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::set_min_volume( extended_asset base, extended_asset quote, extended_asset min_volume ) {
+      name market_name = find_market_pair( base, quote );
+      check( min_volume.get_extended_symbol() == normalize_precision( base ).get_extended_symbol(), "minimum volume must be in the base token" );
+      check( min_volume.quantity.amount >= 0, "minimum volume must not be negative" );
+
+      update_pair_config( market_name, [&]( auto& c ) {
+         c.min_volume = min_volume.quantity.amount;
+      });
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Rejects an order whose base volume is below its pairs minimum.
+    *
+    *  market_name - Market pair name.
+    *  volume      - Order volume, normalized to 8 decimals.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::check_min_volume( name market_name, extended_asset volume ) {
+      check( volume.quantity.amount >= get_pair_config( market_name ).min_volume, "order volume is below the pair minimum" );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Sets how many orders one trader may place in a market pair per window.
+    *  Windows are fixed, a trader's window opens with their first order and
+    *  the count starts over once it has passed.
+    *
+    *  base       - Base asset.
+    *  quote      - Quote asset.
+    *  max_orders - Orders a trader may place per window.  0 removes the limit.
+    *  window_sec - Length of a window in seconds.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::set_rate_limit( extended_asset base, extended_asset quote, uint32_t max_orders, uint32_t window_sec ) {
+      check( max_orders == 0 || window_sec > 0, "rate limit window must be positive" );
+      name market_name = find_market_pair( base, quote );
+
+      update_pair_config( market_name, [&]( auto& c ) {
+         c.rate_limit  = max_orders;
+         c.rate_window = window_sec;
+      });
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Counts an order against the traders rate limit in a market pair and
+    *  rejects it once the limit of the current window is reached.  Pairs
+    *  without a limit read and write nothing.  Called before an order touches
+    *  any balance or book, so a rejected order costs a single row read.
+    *
+    *  market_name - Market pair name.
+    *  trader      - Account placing the order.
+    *  time_stamp  - Time the order was placed.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::check_rate_limit( name market_name, name trader, time_point time_stamp ) {
+      pairconfig settings = get_pair_config( market_name );
+      if( settings.rate_limit == 0 )
+         return;
+
+      uint32_t now = time_stamp.sec_since_epoch();
+      ratelimits rate_limits( self, market_name.value );
+      auto row = rate_limits.find( trader.value );
+
+      if( row == rate_limits.end() ) {
+         rate_limits.emplace( get_ram_payer(trader), [&]( auto& r ) {
+            r.trader       = trader;
+            r.window_start = now;
+            r.orders       = 1;
+         });
+         return;
+      }
+
+      bool window_passed = now - row->window_start >= settings.rate_window;
+      check( window_passed || row->orders < settings.rate_limit, "order rate limit exceeded" );
+
+      rate_limits.modify( row, same_payer, [&]( auto& r ) {
+         if( window_passed ) {
+            r.window_start = now;
+            r.orders       = 0;
+         }
+         r.orders += 1;
+      });
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Bounds how far one order can move a market pair.  Orders priced
+    *  further than price_band_bps from the last trade price are rejected
+    *  before they reach the book, and an incoming order that has traded
+    *  through max_sweep_levels price levels has the rest of its volume
+    *  cancelled and refunded instead of taking the next level.
+    *
+    *  base             - Base asset.
+    *  quote            - Quote asset.
+    *  price_band_bps   - Width of the band on each side of the last price, in basis points.  0 removes the band.
+    *  max_sweep_levels - Price levels one order may trade through.  0 removes the limit.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::set_price_band( extended_asset base, extended_asset quote, uint16_t price_band_bps, uint16_t max_sweep_levels ) {
+      check( price_band_bps <= PRICE_BAND_BPS_SCALE, "price band is too wide" );
+      name market_name = find_market_pair( base, quote );
+
+      update_pair_config( market_name, [&]( auto& c ) {
+         c.price_band_bps   = price_band_bps;
+         c.max_sweep_levels = max_sweep_levels;
+      });
+   }
+
+   /**
+    *  Returns true if a price is inside the market pairs price band.
+    *
+    *  Description:
+    *  Pairs without a band, or without a trade to take the last price from,
+    *  accept any price.
+    *
+    *  market_name - Market pair name.
+    *  price       - Quote price, normalized to 8 decimals.
+    *
+    *  return - True if the price is inside the band.
+    */
+   template <typename Storage>
+   bool basic_exchange_base<Storage>::in_price_band( name market_name, int64_t price ) {
+      uint16_t price_band_bps = get_pair_config( market_name ).price_band_bps;
+      if( price_band_bps == 0 )
+         return true;
+
+      auto market_stats = exchange_market_stats.find( market_name.value );
+      price_t<> last_price( normalize_precision( market_stats->price ).quantity.amount );
+      if( last_price.value == 0 )
+         return true;
+
+      price_t<> band = scale_by( last_price, price_band_bps, PRICE_BAND_BPS_SCALE );
+      return price_t<>( price ) >= last_price - band && price_t<>( price ) <= last_price + band;
+   }
+
+   template <typename Storage>
+   void basic_exchange_base<Storage>::check_price_band( name market_name, extended_asset price ) {
+      check( in_price_band( market_name, price.quantity.amount ), "price is outside the pair price band" );
+   }
+
+   /**
+    *  Returns true if an incoming order may trade at a price level.
+    *
+    *  Description:
+    *  Counts the distinct maker price levels an incoming order trades
+    *  through during this action.  Returns false once the order has used
+    *  up its pairs max_sweep_levels and the price opens another level, so
+    *  the work one order causes is bounded however deep the book is.
+    *
+    *  market_name - Market pair name.
+    *  taker_id    - ID of the incoming order.
+    *  level_price - Price of the maker it would trade with.
+    *
+    *  return - True if the order may trade at the level.
+    */
+   template <typename Storage>
+   bool basic_exchange_base<Storage>::sweep_level( name market_name, uint64_t taker_id, int64_t level_price ) {
+      uint16_t max_sweep_levels = get_pair_config( market_name ).max_sweep_levels;
+      if( max_sweep_levels == 0 )
+         return true;
+
+      auto& [ last_level, levels ] = ctx.sweeps[ { market_name, taker_id } ];
+      if( levels > 0 && last_level == level_price )
+         return true;
+      if( levels >= max_sweep_levels )
+         return false;
+
+      last_level = level_price;
+      levels += 1;
+      return true;
+   }
+
+   template <typename Storage>
+   void basic_exchange_base<Storage>::check_sufficient_funds( name trader, extended_asset volume_requested ) {
+      exaccounts& exchange_accounts = get_accounts( trader );
+
+      uint64_t token_id = find_token_id( volume_requested.contract, volume_requested.get_extended_symbol().get_symbol() );
+      auto useraccount = token_id == NO_TOKEN_ID ? exchange_accounts.end() : exchange_accounts.find( token_id );
+
+      int64_t user_balance_amount = useraccount == exchange_accounts.end() ? 0 : useraccount->balance.quantity.amount;
+      string error = "user does not have sufficient funds, only has "
+         + std::to_string(user_balance_amount) + ", requires "
+         + std::to_string(volume_requested.quantity.amount);
+
+      check( user_balance_amount >= volume_requested.quantity.amount, error.c_str() );
+   }
+
+   /**
+    *  Returns the amount for tokens needed to place an ask order
+    *
+    *  Example:
+    *  A ask for is request for buying 100 EOS at 3.50 USD per token.  To calculate the amount of
+    *  USD needed to buy the entire order, perform the following math:
+    *    volume_needed(USD) = price(USD/EOS) * volume(EOS)
+    *
+    *    volume_needed(USD) = 3.50000000 USD/EOS * 100.00000000 EOS
+    *    volume_needed(USD) = 350.00000000 USD
+    *
+    *  Both amounts must be normalized to 8 decimals.  The product is taken
+    *  in fixed point with a constant scale and truncated.
+    */
+   template <typename Storage>
+   extended_asset basic_exchange_base<Storage>::calculate_volume( extended_asset price, extended_asset volume ) {
+      qty_t<> volume_total = price_t<>( price.quantity.amount ) * qty_t<>( volume.quantity.amount );
+
+      return extended_asset( asset( volume_total.value, price.get_extended_symbol().get_symbol() ), price.contract );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Cancels a traders order given the order type (BID/ASK)
+    *  and trade ID.
+    *
+    *  market     - Market name where the order exists.
+    *  trader     - Traders account name.
+    *  order_type - Order type: BID or ASK.
+    *  id         - trade ID.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::cancel_order( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id ) {
+      // find market
+      name market_pair_name = find_market_pair( base, quote );
 
       // find order by id
       if( order_type == BID ) {
-         bids bid_orders( self, market_pair_name.value );
+         bids& bid_orders = get_bids( market_pair_name );
          auto order = bid_orders.find( id );
          check(order != bid_orders.end(), "order does not exist");
 
          // refund trader
-         adjust_balance( self, -order->volume );
-         adjust_balance( trader, order->volume );
+         adjust_balance( self, -order->total_volume() );
+         credit_proceeds( trader, order->total_volume() );
 
          // delete order
          bid_orders.erase( order );
       } else if ( order_type == ASK ) {
-         asks ask_orders( self, market_pair_name.value );
+         asks& ask_orders = get_asks( market_pair_name );
          auto order = ask_orders.find( id );
          check(order != ask_orders.end(), "order does not exist");
 
          // refund trader
-         adjust_balance( self, -calculate_volume(order->price, order->volume) );
-         adjust_balance( trader, calculate_volume(order->price, order->volume) );
+         adjust_balance( self, -calculate_volume(order->price, order->total_volume()) );
+         credit_proceeds( trader, calculate_volume(order->price, order->total_volume()) );
+
+         // delete order
+         ask_orders.erase( order );
+      }
+   }
+
+   /**
+    *  Returns the order ID.
+    *
+    *  Description:
+    *  Places a BID order funded from the traders exchange balance.
+    *
+    *  trader     - Traders account name.
+    *  price      - Price trader is will to accept in quote asset.
+    *  volume     - Amount to trade in base asset.
+    *  time_stamp - Time trade action was executed.
+    *  tx_id      - (Optional) Provided trade ID, used for testing.
+    *  expiration - (Optional) Time the order expires, time_point() for never.
+    *  stp_mode   - (Optional) Self-trade prevention mode.
+    *  display    - (Optional) Iceberg slice shown on the book, 0 to show the whole volume.
+    *
+    *  return - ID of the placed order.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::place_bid_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id,
+                                                           time_point expiration, uint8_t stp_mode, int64_t display ) {
+      extended_asset bid_volume = volume;
+
+      check( price.quantity.amount > 0, "price must be positive" );
+      name market_name = find_market_pair( volume, price );
+      check_min_volume( market_name, volume );
+      check_price_band( market_name, price );
+      check_sufficient_funds( trader, bid_volume );
+      adjust_balance( trader, -bid_volume );  // subtract from traders available balance
+
+      return insert_bid_order( trader, price, volume, time_stamp, tx_id, expiration, stp_mode, display );
+   }
+
+   /**
+    *  Returns the order ID.
+    *
+    *  Description:
+    *  Places an ASK order funded from the traders exchange balance.
+    *
+    *  trader     - Traders account name.
+    *  price      - Price trader is will to pay in quote asset.
+    *  volume     - Amount to trade in base asset.
+    *  time_stamp - Time trade action was executed.
+    *  tx_id      - (Optional) Provided trade ID, used for testing.
+    *  expiration - (Optional) Time the order expires, time_point() for never.
+    *  stp_mode   - (Optional) Self-trade prevention mode.
+    *  display    - (Optional) Iceberg slice shown on the book, 0 to show the whole volume.
+    *
+    *  return - ID of the placed order.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::place_ask_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id,
+                                                           time_point expiration, uint8_t stp_mode, int64_t display ) {
+      extended_asset ask_volume = calculate_volume( price, volume );
+
+      check( price.quantity.amount > 0, "price must be positive" );
+      name market_name = find_market_pair( volume, price );
+      check_min_volume( market_name, volume );
+      check_price_band( market_name, price );
+      check_sufficient_funds( trader, ask_volume );
+      adjust_balance( trader, -ask_volume );  // subtract from traders available balance
+
+      return insert_ask_order( trader, price, volume, time_stamp, tx_id, expiration, stp_mode, display );
+   }
+
+   /**
+    *  Returns the order ID.
+    *
+    *  Description:
+    *  Inserts a BID order into the order book and runs the matching engine.
+    *  The caller must already have taken the BID volume from the trader.
+    *
+    *  trader     - Traders account name.
+    *  price      - Price trader is will to accept in quote asset.
+    *  volume     - Amount to trade in base asset.
+    *  time_stamp - Time trade action was executed.
+    *  tx_id      - Provided trade ID, 0 to use the next number of the pair sequence.
+    *  expiration - (Optional) Time the order expires, time_point() for never.
+    *  stp_mode   - (Optional) Self-trade prevention mode.
+    *  display    - (Optional) Iceberg slice shown on the book, 0 to show the whole volume.
+    *                The rest of the volume is held in the orders hidden reserve.
+    *
+    *  return - ID of the inserted order.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::insert_bid_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id,
+                                                            time_point expiration, uint8_t stp_mode, int64_t display ) {
+      check( expiration == time_point() || expiration > time_stamp, "expiration must be in the future" );
+      check( stp_mode <= STP_DECREMENT_AND_CANCEL, "invalid self-trade prevention mode" );
+      check( display >= 0, "display volume must not be negative" );
+
+      name market_name = find_market_pair( volume, price );
+
+      //place bid order in order book
+      bids& bid_orders = get_bids( market_name );
+      uint64_t id = next_sequence( market_name, tx_id );
+      bid_orders.emplace( get_ram_payer(trader), [&]( auto& a ) {
+         a.id        = id;
+         a.trader    = trader;
+         a.timestamp = time_stamp;
+         a.price     = price;
+         a.volume     = volume;
+         a.expiration = expiration;
+         a.stp_mode   = stp_mode;
+         a.orig_qty   = volume.quantity.amount;
+
+         if( display > 0 && display < volume.quantity.amount ) {
+            a.volume.quantity.amount = display;
+            a.hidden  = volume.quantity.amount - display;
+            a.display = display;
+         }
+      });
+
+      adjust_balance( self, volume );  // add to exchanges balance
+
+      if( get_pair_config( market_name ).matching_mode != BATCH_AUCTION )
+         match_orders( market_name, time_stamp );
+      return id;
+   }
+
+   /**
+    *  Returns the order ID.
+    *
+    *  Description:
+    *  Inserts an ASK order into the order book and runs the matching engine.
+    *  The caller must already have taken the ASK volume from the trader.
+    *
+    *  trader     - Traders account name.
+    *  price      - Price trader is will to pay in quote asset.
+    *  volume     - Amount to trade in base asset.
+    *  time_stamp - Time trade action was executed.
+    *  tx_id      - Provided trade ID, 0 to use the next number of the pair sequence.
+    *  expiration - (Optional) Time the order expires, time_point() for never.
+    *  stp_mode   - (Optional) Self-trade prevention mode.
+    *  display    - (Optional) Iceberg slice shown on the book, 0 to show the whole volume.
+    *                The rest of the volume is held in the orders hidden reserve.
+    *
+    *  return - ID of the inserted order.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::insert_ask_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id,
+                                                            time_point expiration, uint8_t stp_mode, int64_t display ) {
+      check( expiration == time_point() || expiration > time_stamp, "expiration must be in the future" );
+      check( stp_mode <= STP_DECREMENT_AND_CANCEL, "invalid self-trade prevention mode" );
+      check( display >= 0, "display volume must not be negative" );
+
+      name market_name = find_market_pair( volume, price );
+
+      //place ask order in order book
+      asks& ask_orders = get_asks( market_name );
+      uint64_t id = next_sequence( market_name, tx_id );
+      ask_orders.emplace( get_ram_payer(trader), [&]( auto& a ) {
+         a.id        = id;
+         a.trader    = trader;
+         a.timestamp = time_stamp;
+         a.price     = price;
+         a.volume     = volume;
+         a.expiration = expiration;
+         a.stp_mode   = stp_mode;
+         a.orig_qty   = volume.quantity.amount;
+
+         if( display > 0 && display < volume.quantity.amount ) {
+            a.volume.quantity.amount = display;
+            a.hidden  = volume.quantity.amount - display;
+            a.display = display;
+         }
+      });
+
+      adjust_balance( self, calculate_volume( price, volume ) );  // add to exchanges balance
+
+      if( get_pair_config( market_name ).matching_mode != BATCH_AUCTION )
+         match_orders( market_name, time_stamp );
+      return id;
+   }
+
+   /**
+    *  Returns the stop order ID.
+    *
+    *  Description:
+    *  Places a stop or stop-limit order funded from the traders exchange
+    *  balance.  The order waits in the pairs stop table, indexed by trigger
+    *  price, and only becomes a live order once the last trade price reaches
+    *  the trigger: at or below it for BID (sell) stops, at or above it for
+    *  ASK (buy) stops.  The funds are escrowed when the stop is placed.
+    *  Before the pairs first trade any trigger is accepted.  Batch auction
+    *  pairs only take stop-limit orders, as they do not match on arrival.
+    *
+    *  trader        - Traders account name.
+    *  order_type    - BID or ASK.
+    *  trigger_price - Last trade price that triggers the order.
+    *  price         - Limit price of the triggered order.
+    *  volume        - Amount to trade in base asset.
+    *  limit         - True for a stop-limit order that rests on the book once
+    *                  triggered, false for a stop order that is immediate or
+    *                  cancel once triggered.
+    *  time_stamp    - Time trade action was executed.
+    *  tx_id         - (Optional) Provided stop order ID, used for testing.
+    *
+    *  return - ID of the placed stop order.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::place_stop_order( name trader, bool order_type, extended_asset trigger_price, extended_asset price,
+                                                            extended_asset volume, bool limit, time_point time_stamp, uint64_t tx_id ) {
+      name market_name = find_market_pair( volume, price );
+      check( price.quantity.amount > 0, "price must be positive" );
+      check( volume.quantity.amount > 0, "volume must be positive" );
+      check( trigger_price.quantity.amount > 0, "stop price must be positive" );
+      check( limit || get_pair_config( market_name ).matching_mode != BATCH_AUCTION,
+             "immediate or cancel orders are not accepted in batch auction mode" );
+      check_min_volume( market_name, volume );
+      check_price_band( market_name, price );
+
+      // before the first trade there is no last price to be on the wrong side of
+      auto market_stats = exchange_market_stats.find( market_name.value );
+      int64_t last_price = market_stats == exchange_market_stats.end() ? 0 : normalize_precision( market_stats->price ).quantity.amount;
+
+      if( last_price > 0 && order_type == BID )
+         check( trigger_price.quantity.amount < last_price, "stop price must be below the last price" );
+      else if( last_price > 0 )
+         check( trigger_price.quantity.amount > last_price, "stop price must be above the last price" );
+
+      extended_asset escrow = order_type == BID ? volume : calculate_volume( price, volume );
+      check_sufficient_funds( trader, escrow );
+      adjust_balance( trader, -escrow );
+      adjust_balance( self, escrow );
+
+      auto write_stop = [&]( auto& s ) {
+         s.trader        = trader;
+         s.timestamp     = time_stamp;
+         s.trigger_price = trigger_price;
+         s.price         = price;
+         s.volume        = volume;
+         s.limit         = limit;
+      };
+
+      uint64_t id = next_sequence( market_name, tx_id );
+      if( order_type == BID ) {
+         stop_bids& stop_orders = get_stop_bids( market_name );
+         stop_orders.emplace( get_ram_payer(trader), [&]( auto& s ) { s.id = id; write_stop( s ); });
+      } else {
+         stop_asks& stop_orders = get_stop_asks( market_name );
+         stop_orders.emplace( get_ram_payer(trader), [&]( auto& s ) { s.id = id; write_stop( s ); });
+      }
+
+      return id;
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Cancels a stop order that has not triggered yet and refunds its escrow.
+    *
+    *  base       - Base asset in market pair.
+    *  quote      - Quote asset in market pair.
+    *  trader     - Traders account name.
+    *  order_type - BID or ASK.
+    *  id         - Stop order ID.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::cancel_stop_order( extended_asset base, extended_asset quote, name trader, bool order_type, uint64_t id ) {
+      name market_name = find_market_pair( base, quote );
+
+      extended_asset refund;
+      if( order_type == BID ) {
+         stop_bids& stop_orders = get_stop_bids( market_name );
+         auto stop = stop_orders.find( id );
+         check( stop != stop_orders.end(), "stop order does not exist" );
+         check( stop->trader == trader, "stop order belongs to another trader" );
+
+         refund = stop->volume;
+         stop_orders.erase( stop );
+      } else {
+         stop_asks& stop_orders = get_stop_asks( market_name );
+         auto stop = stop_orders.find( id );
+         check( stop != stop_orders.end(), "stop order does not exist" );
+         check( stop->trader == trader, "stop order belongs to another trader" );
+
+         refund = calculate_volume( stop->price, stop->volume );
+         stop_orders.erase( stop );
+      }
+
+      adjust_balance( self, -refund );
+      credit_proceeds( trader, refund );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Converts the stop orders triggered by a new last price into live
+    *  orders.  Only the triggered slice of each trigger index is read: BID
+    *  stops from the last price up, ASK stops from the bottom up to the last
+    *  price.  Triggered orders are placed in trigger order, and may trade
+    *  and trigger further stops themselves.
+    *
+    *  market_name - Market pair name.
+    *  last_price  - Last trade price, normalized to 8 decimals.
+    *  time_stamp  - Time of the trade that moved the price.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::trigger_stop_orders( name market_name, extended_asset last_price, time_point time_stamp ) {
+      stop_bids& stop_sells = get_stop_bids( market_name );
+      stop_asks& stop_buys  = get_stop_asks( market_name );
+      auto sells_by_trigger = stop_sells.template get_index<"bytrigger"_n>();
+      auto buys_by_trigger  = stop_buys.template get_index<"bytrigger"_n>();
+
+      vector<stoporder> triggered_sells;
+      vector<stoporder> triggered_buys;
+
+      for( auto stop = sells_by_trigger.lower_bound( last_price.quantity.amount ); stop != sells_by_trigger.end(); ) {
+         triggered_sells.push_back( *stop );
+         stop = sells_by_trigger.erase( stop );
+      }
+
+      for( auto stop = buys_by_trigger.begin();
+           stop != buys_by_trigger.end() && stop->trigger_price.quantity.amount <= last_price.quantity.amount; ) {
+         triggered_buys.push_back( *stop );
+         stop = buys_by_trigger.erase( stop );
+      }
+
+      if( triggered_sells.empty() && triggered_buys.empty() )
+         return;
+
+      // the escrow moves into the order book, which takes it back into the exchanges balance
+      balance_batch released;
+      for( const auto& stop : triggered_sells )
+         released.add( self, stop.volume );
+      for( const auto& stop : triggered_buys )
+         released.add( self, calculate_volume( stop.price, stop.volume ) );
+      for( const auto& [ key, total ] : released.balances )
+         adjust_balance( self, -total );
+
+      // highest BID trigger first, the price falls through it first
+      std::reverse( triggered_sells.begin(), triggered_sells.end() );
+
+      for( const auto& stop : triggered_sells ) {
+         uint64_t id = insert_bid_order( stop.trader, stop.price, stop.volume, time_stamp, 0 );
+
+         bids& bid_orders = get_bids( market_name );
+         if( !stop.limit && bid_orders.find( id ) != bid_orders.end() )
+            cancel_order( stop.volume, stop.price, stop.trader, BID, id );
+      }
+
+      for( const auto& stop : triggered_buys ) {
+         uint64_t id = insert_ask_order( stop.trader, stop.price, stop.volume, time_stamp, 0 );
+
+         asks& ask_orders = get_asks( market_name );
+         if( !stop.limit && ask_orders.find( id ) != ask_orders.end() )
+            cancel_order( stop.volume, stop.price, stop.trader, ASK, id );
+      }
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Places an order directly from a deposit transfer.  The deposit goes
+    *  straight into the order escrow instead of through the traders exchange
+    *  balance.  BID orders sell the whole deposit, ASK orders buy as much
+    *  base as the deposit pays for and credit the leftover quote to the
+    *  trader.  Immediate-or-cancel orders are removed from the book and
+    *  refunded once matching is done.  When withdraw is set, the trader is
+    *  added to the auto withdraw accounts so that everything the deposit
+    *  returns is paid out by collect_payouts.
+    *
+    *  trader      - Traders account name.
+    *  deposit     - Transferred tokens, normalized to 8 decimals.
+    *  instruction - Trade instruction parsed from the transfer memo.
+    *  time_stamp  - Time trade action was executed.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::deposit_and_trade( name trader, extended_asset deposit, const trade_instruction& instruction, time_point time_stamp ) {
+      auto [ base, quote ] = find_pair_tokens( instruction.market_name );
+
+      extended_asset price = normalize_precision( extended_asset( asset( 0, quote.quantity.symbol ), quote.contract ) );
+      price.quantity.amount = instruction.price;
+      check( price.quantity.amount > 0, "price must be positive" );
+      check_price_band( instruction.market_name, price );
+
+      extended_symbol spent = instruction.order_type == BID ? base.get_extended_symbol() : quote.get_extended_symbol();
+      check( deposit.contract == spent.get_contract() && deposit.quantity.symbol.code() == spent.get_symbol().code(),
+             "transfer does not match the market pair" );
+
+      check( !instruction.immediate_or_cancel || get_pair_config( instruction.market_name ).matching_mode != BATCH_AUCTION,
+             "immediate or cancel orders are not accepted in batch auction mode" );
+
+      if( instruction.withdraw )
+         auto_withdraw_accounts.insert( trader );
+
+      uint64_t id;
+
+      if( instruction.order_type == BID ) {
+         check_min_volume( instruction.market_name, deposit );
+         id = insert_bid_order( trader, price, deposit, time_stamp, 0 );
+      } else {
+         // largest volume of base the deposit can pay for at this price
+         extended_asset volume = normalize_precision( extended_asset( asset( 0, base.quantity.symbol ), base.contract ) );
+         volume.quantity.amount = base_volume<EXCHANGE_PRECISION>( qty_t<>( deposit.quantity.amount ), price_t<>( price.quantity.amount ) ).value;
+         check( volume.quantity.amount > 0, "transfer quantity too small for price" );
+         check_min_volume( instruction.market_name, volume );
+
+         credit_proceeds( trader, deposit - calculate_volume( price, volume ) );
+
+         id = insert_ask_order( trader, price, volume, time_stamp, 0 );
+      }
+
+      if( instruction.immediate_or_cancel ) {
+         bool resting;
+         if( instruction.order_type == BID ) {
+            bids& bid_orders = get_bids( instruction.market_name );
+            resting = bid_orders.find( id ) != bid_orders.end();
+         } else {
+            asks& ask_orders = get_asks( instruction.market_name );
+            resting = ask_orders.find( id ) != ask_orders.end();
+         }
+
+         if( resting )
+            cancel_order( base, quote, trader, instruction.order_type, id );
+      }
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Removes expired orders from the book and refunds their escrow.  Refunds
+    *  are summed per trader and token, and the exchanges escrow is debited
+    *  once per token.
+    *
+    *  market_name - Market pair name.
+    *  order_type  - BID or ASK.
+    *  expired     - Copies of the expired order rows.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::expire_orders( name market_name, bool order_type, const vector<order>& expired ) {
+      if( expired.empty() )
+         return;
+
+      bids& bid_orders = get_bids( market_name );
+      asks& ask_orders = get_asks( market_name );
+      balance_batch refunds;
+      balance_batch released;
+
+      for( const auto& o : expired ) {
+         extended_asset refund = order_type == BID ? o.total_volume() : calculate_volume( o.price, o.total_volume() );
+         refunds.add( o.trader, refund );
+         released.add( self, refund );
+
+         if( order_type == BID )
+            bid_orders.erase( bid_orders.find( o.id ) );
+         else
+            ask_orders.erase( ask_orders.find( o.id ) );
+      }
+
+      for( const auto& [ key, total ] : released.balances )
+         adjust_balance( self, -total );
+      credit_proceeds( refunds );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Takes base volume off an order row.  Volume beyond the shown slice of
+    *  an iceberg order comes out of its hidden reserve, and an emptied slice
+    *  is refilled in place from the reserve, so a large order keeps one row
+    *  and its place in the book however many slices trade.  The row is
+    *  erased once nothing is left.
+    *
+    *  A remainder below the pairs minimum volume is dust that could never be
+    *  matched economically, so it is cancelled and refunded straight away.
+    *
+    *  A trade also adds the volume to the orders filled_qty and folds its
+    *  price into avg_fill_price, so the status of an order is one row read.
+    *  An order a trade takes off the book keeps that status in the pairs
+    *  filledorders ring.
+    *
+    *  market_name - Market pair name.
+    *  order_type  - BID or ASK side of the row.
+    *  orders      - Order table or index holding the row.
+    *  row         - Iterator to the order row.
+    *  amount      - Base volume to take off.
+    *  fill_price  - (Optional) Price the volume traded at, 0 if it was taken off without trading.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   template <typename T, typename I>
+   void basic_exchange_base<Storage>::fill_order( name market_name, bool order_type, T& orders, I row, qty_t<> amount, price_t<> fill_price ) {
+      int64_t visible = row->volume.quantity.amount - amount.value;
+      int64_t hidden  = row->hidden;
+
+      if( visible < 0 ) {
+         hidden += visible;
+         visible = 0;
+      }
+      if( visible + hidden > 0 && visible + hidden < get_pair_config( market_name ).min_volume ) {
+         extended_asset dust = row->volume;
+         dust.quantity.amount = visible + hidden;
+         extended_asset refund = order_type == BID ? dust : calculate_volume( row->price, dust );
+         name trader = row->trader;
+
+         if( fill_price > price_t<>() )
+            record_filled_order( market_name, order_type, *row, amount, fill_price );
+         orders.erase( row );
+         adjust_balance( self, -refund );
+         credit_proceeds( trader, refund );
+         return;
+      }
+      if( visible == 0 && hidden == 0 ) {
+         if( fill_price > price_t<>() )
+            record_filled_order( market_name, order_type, *row, amount, fill_price );
+         orders.erase( row );
+         return;
+      }
+      if( visible == 0 ) {
+         visible = std::min( row->display, hidden );
+         hidden -= visible;
+      }
+
+      orders.modify( row, same_payer, [&]( auto& o ) {
+         o.volume.quantity.amount = visible;
+         o.hidden = hidden;
+
+         if( fill_price > price_t<>() ) {
+            o.avg_fill_price = average_price( price_t<>( o.avg_fill_price ), qty_t<>( o.filled_qty ), fill_price, amount ).value;
+            o.filled_qty    += amount.value;
+         }
+      });
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Takes volume off an order without trading it and refunds the escrow it
+    *  held.  The order is removed once nothing is left.
+    *
+    *  market_name - Market pair name.
+    *  order_type  - BID or ASK.
+    *  o           - Copy of the order row.
+    *  amount      - Base volume to take off.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::reduce_order( name market_name, bool order_type, const order& o, int64_t amount ) {
+      extended_asset reduced = o.volume;
+      reduced.quantity.amount = amount;
+      extended_asset refund = order_type == BID ? reduced : calculate_volume( o.price, reduced );
+
+      if( order_type == BID ) {
+         bids& bid_orders = get_bids( market_name );
+         fill_order( market_name, BID, bid_orders, bid_orders.find( o.id ), qty_t<>( amount ) );
+      } else {
+         asks& ask_orders = get_asks( market_name );
+         fill_order( market_name, ASK, ask_orders, ask_orders.find( o.id ), qty_t<>( amount ) );
+      }
+
+      adjust_balance( self, -refund );
+      credit_proceeds( o.trader, refund );
+   }
+
+   /**
+    *  Returns true if the orders were changed.
+    *
+    *  Description:
+    *  Applies the takers self-trade prevention mode when it crosses an order
+    *  from the same trader.  Runs before any fill, so a prevented self-trade
+    *  moves no balances between accounts and leaves the market stats alone:
+    *
+    *    STP_NONE                 - the orders trade as usual, returns false
+    *    STP_CANCEL_NEWEST        - the taker is cancelled
+    *    STP_CANCEL_OLDEST        - the maker is cancelled
+    *    STP_DECREMENT_AND_CANCEL - both are reduced by the smaller volume, so
+    *                               the smaller order is cancelled
+    *
+    *  market_name - Market pair name.
+    *  taker       - Copy of the newer order.
+    *  taker_type  - BID or ASK side of the taker.
+    *  maker       - Copy of the resting order from the same trader.
+    *
+    *  return - True if the orders were changed.
+    */
+   template <typename Storage>
+   bool basic_exchange_base<Storage>::prevent_self_trade( name market_name, const order& taker, bool taker_type, const order& maker ) {
+      switch( taker.stp_mode ) {
+         case STP_CANCEL_NEWEST:
+            reduce_order( market_name, taker_type, taker, taker.total_volume().quantity.amount );
+            return true;
+         case STP_CANCEL_OLDEST:
+            reduce_order( market_name, !taker_type, maker, maker.total_volume().quantity.amount );
+            return true;
+         case STP_DECREMENT_AND_CANCEL: {
+            int64_t amount = std::min( taker.volume.quantity.amount, maker.volume.quantity.amount );
+            reduce_order( market_name, taker_type, taker, amount );
+            reduce_order( market_name, !taker_type, maker, amount );
+            return true;
+         }
+         default:
+            return false;
+      }
+   }
+
+   /**
+    *  Returns the number of orders purged.
+    *
+    *  Description:
+    *  Sweeps expired orders of a market pair, oldest expiry first, by walking
+    *  the byexpiry index of each side up to the current time.
+    *
+    *  base       - Base asset.
+    *  quote      - Quote asset.
+    *  time_stamp - Time purge action was executed.
+    *  max_orders - Maximum number of orders to purge.
+    *
+    *  return - Number of orders purged.
+    */
+   template <typename Storage>
+   uint32_t basic_exchange_base<Storage>::purge_expired_orders( extended_asset base, extended_asset quote, time_point time_stamp, uint32_t max_orders ) {
+      name market_name = find_market_pair( base, quote );
+      uint64_t now = time_stamp.time_since_epoch().count();
+
+      bids& bid_orders = get_bids( market_name );
+      asks& ask_orders = get_asks( market_name );
+      auto bids_by_expiry = bid_orders.template get_index<"byexpiry"_n>();
+      auto asks_by_expiry = ask_orders.template get_index<"byexpiry"_n>();
+
+      vector<order> expired_bids;
+      vector<order> expired_asks;
+
+      for( auto itr = bids_by_expiry.begin(); itr != bids_by_expiry.end() && itr->by_expiry() <= now && expired_bids.size() < max_orders; ++itr )
+         expired_bids.push_back( *itr );
+      for( auto itr = asks_by_expiry.begin(); itr != asks_by_expiry.end() && itr->by_expiry() <= now && expired_bids.size() + expired_asks.size() < max_orders; ++itr )
+         expired_asks.push_back( *itr );
+
+      check( !expired_bids.empty() || !expired_asks.empty(), "no expired orders to purge" );
+
+      expire_orders( market_name, BID, expired_bids );
+      expire_orders( market_name, ASK, expired_asks );
+
+      return expired_bids.size() + expired_asks.size();
+   }
+
+   /**
+    *  Returns the number of orders removed.
+    *
+    *  Description:
+    *  Removes resting orders whose remaining base volume, including any
+    *  iceberg reserve, is below the pairs minimum volume and refunds them.
+    *  The sweep is bounded: it reads at most max_orders rows of each side,
+    *  from order id from_id up, so large books can be swept in windows.
+    *
+    *  base       - Base asset.
+    *  quote      - Quote asset.
+    *  from_id    - First order id to read.
+    *  max_orders - Maximum number of rows to read per side.
+    *
+    *  return - Number of orders removed.
+    */
+   template <typename Storage>
+   uint32_t basic_exchange_base<Storage>::sweep_dust_orders( extended_asset base, extended_asset quote, uint64_t from_id, uint32_t max_orders ) {
+      name market_name = find_market_pair( base, quote );
+      int64_t min_volume = get_pair_config( market_name ).min_volume;
+      check( min_volume > 0, "market pair has no minimum volume" );
+
+      bids& bid_orders = get_bids( market_name );
+      asks& ask_orders = get_asks( market_name );
+
+      vector<order> dust_bids;
+      vector<order> dust_asks;
+      uint32_t read = 0;
+
+      for( auto itr = bid_orders.lower_bound( from_id ); itr != bid_orders.end() && read < max_orders; ++itr, ++read )
+         if( itr->total_volume().quantity.amount < min_volume )
+            dust_bids.push_back( *itr );
+
+      read = 0;
+      for( auto itr = ask_orders.lower_bound( from_id ); itr != ask_orders.end() && read < max_orders; ++itr, ++read )
+         if( itr->total_volume().quantity.amount < min_volume )
+            dust_asks.push_back( *itr );
+
+      // removing and refunding is the same as for expired orders
+      expire_orders( market_name, BID, dust_bids );
+      expire_orders( market_name, ASK, dust_asks );
+
+      return dust_bids.size() + dust_asks.size();
+   }
+
+   /**
+    *  Returns the amount of the output token received.
+    *
+    *  Description:
+    *  Swaps one base asset of a quote market for another in a single pass:
+    *  input -> quote on the input pair, then quote -> output on the output
+    *  pair.  The first leg sells the input into the input pairs ASKs from the
+    *  highest price down, the second leg spends the quote on the output pairs
+    *  BIDs from the lowest price up.  Both legs take the makers price and are
+    *  planned before anything is written, so the swap leaves no resting
+    *  orders and never writes the intermediate quote to the traders
+    *  balance.  The trader is debited the input and credited the output
+    *  once.  Whatever input or quote could not be used is refunded.
+    *
+    *  Each leg stops at the edge of its pairs price band or sweep level
+    *  limit, a swap has no order row and is counted as order id 0.
+    *  Expired orders and the traders own orders are passed over.  Makers are
+    *  settled like any other fill, the trader pays the taker fee on both
+    *  legs.  Batch auction pairs cannot be swapped through.
+    *
+    *  trader     - Traders account name.
+    *  input      - Base asset sold, normalized to 8 decimals.
+    *  quote      - Quote asset of the market both pairs belong to.
+    *  min_output - Least amount of the output base asset to accept, normalized
+    *               to 8 decimals.
+    *  time_stamp - Time swap action was executed.
+    *
+    *  return - Output received, net of fees.
+    */
+   template <typename Storage>
+   extended_asset basic_exchange_base<Storage>::swap_tokens( name trader, extended_asset input, extended_asset quote, extended_asset min_output, time_point time_stamp ) {
+      check( input.quantity.amount > 0, "swap input must be positive" );
+      check( min_output.quantity.amount >= 0, "minimum output must not be negative" );
+      check( input.get_extended_symbol() != min_output.get_extended_symbol(), "cannot swap a token for itself" );
+
+      name input_market  = find_market_pair( input, quote );
+      name output_market = find_market_pair( min_output, quote );
+      pairconfig input_config  = get_pair_config( input_market );
+      pairconfig output_config = get_pair_config( output_market );
+      check( input_config.matching_mode != BATCH_AUCTION && output_config.matching_mode != BATCH_AUCTION,
+             "cannot swap through a batch auction pair" );
+
+      struct swap_fill {
+         order   maker;
+         qty_t<> volume;
+      };
+
+      // leg 1: sell the input to the highest ASKs
+      asks& input_asks = get_asks( input_market );
+      auto buys = input_asks.template get_index<"byprice"_n>();
+
+      vector<swap_fill> input_fills;
+      vector<order> expired_asks;
+      int64_t input_left = input.quantity.amount;
+      extended_asset quote_received = normalize_precision( extended_asset( asset( 0, quote.quantity.symbol ), quote.contract ) );
+
+      for( auto buy = buys.rbegin(); buy != buys.rend() && input_left > 0; ++buy ) {
+         if( buy->expired( time_stamp ) ) {
+            expired_asks.push_back( *buy );
+            continue;
+         }
+         if( buy->trader == trader )
+            continue;
+         if( !in_price_band( input_market, buy->price.quantity.amount ) || !sweep_level( input_market, 0, buy->price.quantity.amount ) )
+            break;
+
+         int64_t volume = std::min( buy->total_volume().quantity.amount, input_left );
+         input_fills.push_back( swap_fill{ *buy, qty_t<>( volume ) } );
+         input_left -= volume;
+
+         extended_asset base_volume = input;
+         base_volume.quantity.amount = volume;
+         quote_received += calculate_volume( buy->price, base_volume );
+      }
+
+      extended_asset quote_fee = charge_fee( input_market, quote_received, input_config.taker_fee_bps );
+      int64_t quote_left = ( quote_received - quote_fee ).quantity.amount;
+
+      // leg 2: spend the quote on the lowest BIDs
+      bids& output_bids = get_bids( output_market );
+      auto sells = output_bids.template get_index<"byprice"_n>();
+
+      vector<swap_fill> output_fills;
+      vector<order> expired_bids;
+      extended_asset output_received = min_output;
+      output_received.quantity.amount = 0;
+
+      for( auto sell = sells.begin(); sell != sells.end() && quote_left > 0; ++sell ) {
+         if( sell->expired( time_stamp ) ) {
+            expired_bids.push_back( *sell );
+            continue;
+         }
+         if( sell->trader == trader )
+            continue;
+         if( !in_price_band( output_market, sell->price.quantity.amount ) || !sweep_level( output_market, 0, sell->price.quantity.amount ) )
+            break;
+
+         int64_t affordable = base_volume<EXCHANGE_PRECISION>( qty_t<>( quote_left ), price_t<>( sell->price.quantity.amount ) ).value;
+         int64_t volume = std::min( sell->total_volume().quantity.amount, affordable );
+         if( volume == 0 )
+            break;
+
+         extended_asset base_volume = sell->volume;
+         base_volume.quantity.amount = volume;
+         output_fills.push_back( swap_fill{ *sell, qty_t<>( volume ) } );
+         quote_left -= calculate_volume( sell->price, base_volume ).quantity.amount;
+         output_received += base_volume;
+      }
+
+      extended_asset output_fee = charge_fee( output_market, output_received, output_config.taker_fee_bps );
+      extended_asset output = output_received - output_fee;
+      check( output.quantity.amount >= min_output.quantity.amount, "swap output is below the minimum" );
+
+      // settle: the trader once per token, the exchanges escrow once per token, the makers in a batch
+      check_sufficient_funds( trader, input );
+      adjust_balance( trader, -input );
+
+      balance_batch settlement;
+      balance_batch escrow;
+      escrow.add( self, input );
+
+      for( const auto& fill : input_fills ) {
+         extended_asset base_volume = input;
+         base_volume.quantity.amount = fill.volume.value;
+         extended_asset proceeds = base_volume - charge_fee( input_market, base_volume, input_config.maker_fee_bps );
+
+         if( !queue_fill_event( input_market, fill.maker.trader, proceeds ) ) {
+            settlement.add( fill.maker.trader, proceeds );
+            escrow.add( self, -proceeds );
+         }
+
+         fill_order( input_market, ASK, input_asks, input_asks.find( fill.maker.id ), fill.volume, fill.maker.limit_price() );
+         record_trade( input_market, fill.maker.price, base_volume, BID, time_stamp );
+      }
+
+      for( const auto& fill : output_fills ) {
+         extended_asset base_volume = fill.maker.volume;
+         base_volume.quantity.amount = fill.volume.value;
+         extended_asset quote_volume = calculate_volume( fill.maker.price, base_volume );
+         extended_asset proceeds = quote_volume - charge_fee( output_market, quote_volume, output_config.maker_fee_bps );
+
+         if( !queue_fill_event( output_market, fill.maker.trader, proceeds ) ) {
+            settlement.add( fill.maker.trader, proceeds );
+            escrow.add( self, -proceeds );
+         }
+
+         fill_order( output_market, BID, output_bids, output_bids.find( fill.maker.id ), fill.volume, fill.maker.limit_price() );
+         record_trade( output_market, fill.maker.price, base_volume, ASK, time_stamp );
+      }
+
+      extended_asset input_refund = input;
+      input_refund.quantity.amount = input_left;
+      extended_asset quote_refund = quote_received;
+      quote_refund.quantity.amount = quote_left;
+
+      for( const auto& payout : { output, input_refund, quote_refund } ) {
+         settlement.add( trader, payout );
+         escrow.add( self, -payout );
+      }
+
+      for( const auto& [ key, delta ] : escrow.balances )
+         if( delta.quantity.amount != 0 )
+            adjust_balance( self, delta );
+      credit_proceeds( settlement );
+
+      expire_orders( input_market, ASK, expired_asks );
+      expire_orders( output_market, BID, expired_bids );
+
+      if( !input_fills.empty() ) {
+         update_market_price( input_market, input_fills.back().maker.price, time_stamp );
+         trigger_stop_orders( input_market, input_fills.back().maker.price, time_stamp );
+      }
+      if( !output_fills.empty() ) {
+         update_market_price( output_market, output_fills.back().maker.price, time_stamp );
+         trigger_stop_orders( output_market, output_fills.back().maker.price, time_stamp );
+      }
+
+      return output;
+   }
+
+   /**
+    *  Returns the pool shares issued.
+    *
+    *  Description:
+    *  Moves base and quote from the owners exchange balance into the market
+    *  pairs liquidity pool.  The first provider creates the pool, sets its
+    *  price and receives one share per base unit.  Later providers add at
+    *  the pools price: the token they offer the least of, relative to the
+    *  reserves, sets the shares issued, and only the matching amount of the
+    *  other token is taken, rounded up in favour of the pool.
+    *
+    *  owner - Liquidity providers account name.
+    *  base  - Most base asset to add, normalized to 8 decimals.
+    *  quote - Most quote asset to add, normalized to 8 decimals.
+    *
+    *  return - Shares issued.
+    */
+   template <typename Storage>
+   uint64_t basic_exchange_base<Storage>::add_liquidity( name owner, extended_asset base, extended_asset quote ) {
+      check( base.quantity.amount > 0 && quote.quantity.amount > 0, "liquidity must be positive" );
+      name market_name = find_market_pair( base, quote );
+
+      extended_asset base_added  = base;
+      extended_asset quote_added = quote;
+      uint64_t issued;
+
+      auto liquidity_pool = exchange_pools.find( market_name.value );
+      if( liquidity_pool == exchange_pools.end() ) {
+         issued = base.quantity.amount;
+      } else {
+         const int64_t base_reserve  = liquidity_pool->base_reserve.quantity.amount;
+         const int64_t quote_reserve = liquidity_pool->quote_reserve.quantity.amount;
+         const uint64_t shares       = liquidity_pool->shares;
+
+         // quote the base offered would take at the pools price, rounded up in favour of the pool
+         qty_t<> quote_needed = scale_by_ceil( qty_t<>( base.quantity.amount ), quote_reserve, base_reserve );
+
+         if( quote_needed.value <= quote.quantity.amount ) {
+            issued = scale_by( qty_t<>( base.quantity.amount ), shares, base_reserve ).value;
+            quote_added.quantity.amount = quote_needed.value;
+         } else {
+            issued = scale_by( qty_t<>( quote.quantity.amount ), shares, quote_reserve ).value;
+            base_added.quantity.amount = scale_by_ceil( qty_t<>( quote.quantity.amount ), base_reserve, quote_reserve ).value;
+         }
+      }
+      check( issued > 0, "liquidity is too small for one share" );
+
+      check_sufficient_funds( owner, base_added );
+      check_sufficient_funds( owner, quote_added );
+      adjust_balance( owner, -base_added );
+      adjust_balance( owner, -quote_added );
+
+      if( liquidity_pool == exchange_pools.end() ) {
+         exchange_pools.emplace( get_ram_payer(owner), [&]( auto& p ) {
+            p.market_name   = market_name;
+            p.base_reserve  = base_added;
+            p.quote_reserve = quote_added;
+            p.shares        = issued;
+         });
+      } else {
+         exchange_pools.modify( liquidity_pool, same_payer, [&]( auto& p ) {
+            p.base_reserve  += base_added;
+            p.quote_reserve += quote_added;
+            p.shares        += issued;
+         });
+      }
+
+      lpshares provider_shares( self, market_name.value );
+      auto provider = provider_shares.find( owner.value );
+      if( provider == provider_shares.end() ) {
+         provider_shares.emplace( get_ram_payer(owner), [&]( auto& s ) {
+            s.owner  = owner;
+            s.shares = issued;
+         });
+      } else {
+         provider_shares.modify( provider, same_payer, [&]( auto& s ) {
+            s.shares += issued;
+         });
+      }
+
+      return issued;
+   }
+
+   /**
+    *  Returns the base and quote paid out.
+    *
+    *  Description:
+    *  Redeems pool shares for their part of both reserves, rounded down in
+    *  favour of the pool, and credits them to the owners exchange balance.
+    *  The pool is removed once its last share is redeemed.
+    *
+    *  owner  - Liquidity providers account name.
+    *  base   - Base asset of the market pair.
+    *  quote  - Quote asset of the market pair.
+    *  shares - Shares to redeem.
+    *
+    *  return - Base and quote paid out, normalized to 8 decimals.
+    */
+   template <typename Storage>
+   pair<extended_asset, extended_asset> basic_exchange_base<Storage>::remove_liquidity( name owner, extended_asset base, extended_asset quote, uint64_t shares ) {
+      check( shares > 0, "shares must be positive" );
+      name market_name = find_market_pair( base, quote );
+
+      auto liquidity_pool = exchange_pools.find( market_name.value );
+      check( liquidity_pool != exchange_pools.end(), "market pair has no liquidity pool" );
+
+      lpshares provider_shares( self, market_name.value );
+      auto provider = provider_shares.find( owner.value );
+      check( provider != provider_shares.end() && provider->shares >= shares, "not enough pool shares" );
+
+      extended_asset base_out  = liquidity_pool->base_reserve;
+      extended_asset quote_out = liquidity_pool->quote_reserve;
+      base_out.quantity.amount  = scale_by( qty_t<>( base_out.quantity.amount ), shares, liquidity_pool->shares ).value;
+      quote_out.quantity.amount = scale_by( qty_t<>( quote_out.quantity.amount ), shares, liquidity_pool->shares ).value;
+
+      if( liquidity_pool->shares == shares ) {
+         exchange_pools.erase( liquidity_pool );
+      } else {
+         exchange_pools.modify( liquidity_pool, same_payer, [&]( auto& p ) {
+            p.base_reserve  -= base_out;
+            p.quote_reserve -= quote_out;
+            p.shares        -= shares;
+         });
+      }
 
-         // delete order
-         ask_orders.erase( order );
+      if( provider->shares == shares ) {
+         provider_shares.erase( provider );
+      } else {
+         provider_shares.modify( provider, same_payer, [&]( auto& s ) {
+            s.shares -= shares;
+         });
       }
+
+      adjust_balance( owner, base_out );
+      adjust_balance( owner, quote_out );
+
+      return { base_out, quote_out };
    }
 
    /**
-    *  No return value.
+    *  Returns the amount of the output token received.
     *
     *  Description:
-    *  Places a BID order.
+    *  Swaps base for quote, or quote for base, against the market pairs
+    *  liquidity pool.  The output keeps the product of the reserves from
+    *  falling after POOL_FEE_BPS of the input is set aside for the providers:
+    *
+    *    output = output_reserve * input_after_fee / ( input_reserve + input_after_fee )
+    *
+    *  The whole input, fee included, joins the input reserve.  The cost is
+    *  the same however deep the order book is: one pool row and the traders
+    *  two balances are written.
     *
     *  trader     - Traders account name.
-    *  price      - Price trader is will to accept in quote asset.
-    *  volume     - Amount to trade in base asset.
-    *  time_stamp - Time trade action was executed.
-    *  tx_id      - (Optional) Provided trade ID, used for testing.
+    *  base       - Base asset of the market pair.
+    *  quote      - Quote asset of the market pair.
+    *  input      - Base or quote asset sold, normalized to 8 decimals.
+    *  min_output - Least amount of the other asset to accept, normalized to 8 decimals.
     *
-    *  return - None.
+    *  return - Output received.
     */
-   void exchange_base::place_bid_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id = 0 ) {
-      extended_asset bid_volume = volume;
-
-      check_sufficient_funds( trader, bid_volume );
-
-      auto market = exchange_markets.find( create_market_name( price ).value );
-      auto market_pair = market->bases.find( create_market_pair_name( volume, price ) );
-      check( market_pair != market->bases.end(), "market pair does not exist" );
-
-      //place ask order in order book
-      bids bid_orders( self, market_pair->first.value );
-      bid_orders.emplace( get_ram_payer(trader), [&]( auto& a ) {
-         a.id        = tx_id != 0 ? tx_id : bid_orders.available_primary_key();
-         a.trader    = trader;
-         a.timestamp = time_stamp;
-         a.price     = price;
-         a.volume    = volume;
+   template <typename Storage>
+   extended_asset basic_exchange_base<Storage>::swap_pool( name trader, extended_asset base, extended_asset quote, extended_asset input, extended_asset min_output ) {
+      check( input.quantity.amount > 0, "swap input must be positive" );
+      check( min_output.quantity.amount >= 0, "minimum output must not be negative" );
+      name market_name = find_market_pair( base, quote );
+
+      auto liquidity_pool = exchange_pools.find( market_name.value );
+      check( liquidity_pool != exchange_pools.end(), "market pair has no liquidity pool" );
+
+      const bool sell_base = input.get_extended_symbol() == liquidity_pool->base_reserve.get_extended_symbol();
+      check( sell_base || input.get_extended_symbol() == liquidity_pool->quote_reserve.get_extended_symbol(), "input must be the base or quote token" );
+
+      const extended_asset& input_reserve = sell_base ? liquidity_pool->base_reserve : liquidity_pool->quote_reserve;
+      extended_asset output = sell_base ? liquidity_pool->quote_reserve : liquidity_pool->base_reserve;
+      check( min_output.get_extended_symbol() == output.get_extended_symbol(), "minimum output must be in the other token of the pair" );
+
+      qty_t<> input_after_fee = scale_by( qty_t<>( input.quantity.amount ), FEE_BPS_SCALE - POOL_FEE_BPS, FEE_BPS_SCALE );
+      output.quantity.amount = scale_by( qty_t<>( output.quantity.amount ), input_after_fee.value, input_reserve.quantity.amount + input_after_fee.value ).value;
+      check( output.quantity.amount > 0, "swap input is too small" );
+      check( output.quantity.amount >= min_output.quantity.amount, "swap output is below the minimum" );
+
+      check_sufficient_funds( trader, input );
+      adjust_balance( trader, -input );
+
+      exchange_pools.modify( liquidity_pool, same_payer, [&]( auto& p ) {
+         if( sell_base ) {
+            p.base_reserve  += input;
+            p.quote_reserve -= output;
+         } else {
+            p.quote_reserve += input;
+            p.base_reserve  -= output;
+         }
       });
 
-      adjust_balance( trader, -bid_volume );  // subtract from traders available balance
-      adjust_balance( self, bid_volume );     // add to exchanges balance
-
-      match_orders( market_pair->first );
+      credit_proceeds( trader, output );
+      return output;
    }
 
    /**
-    *  No return value.
+    *  Returns the amount of the output token received.
     *
     *  Description:
-    *  Places an ASK order.
+    *  Swaps base for quote, or quote for base, filled from whichever of the
+    *  order book and the liquidity pool is cheaper at each step.  The book is
+    *  walked from its best price.  Before each new book level, the pool
+    *  takes input for as long as its marginal price after POOL_FEE_BPS beats
+    *  the level.  With x the input reserve, y the output reserve, g = 1 - fee
+    *  and the level price p in output per input, the input a that brings the
+    *  pool to the level follows from the reserve update swap_pool makes,
+    *  x' = x + a and y' = x * y / ( x + g * a ), and g * y' / x' = p:
+    *
+    *    a = sqrt( x * y / p + ( x * fee / 2g )^2 ) - x * ( 1 + g ) / 2g
+    *
+    *  So routing costs one step per level touched.  Input left once the
+    *  book is used up goes to the pool.  Book fills settle like a swap leg,
+    *  with the trader paying the taker fee.  The pool row is written once.
+    *  The book walk stops at the pairs price band and sweep level limit.
     *
     *  trader     - Traders account name.
-    *  price      - Price trader is will to pay in quote asset.
-    *  volume     - Amount to trade in base asset.
-    *  time_stamp - Time trade action was executed.
-    *  tx_id      - (Optional) Provided trade ID, used for testing.
+    *  base       - Base asset of the market pair.
+    *  quote      - Quote asset of the market pair.
+    *  input      - Base or quote asset sold, normalized to 8 decimals.
+    *  min_output - Least amount of the other asset to accept, normalized to 8 decimals.
+    *  time_stamp - Time the swap was executed.
     *
-    *  return - None.
+    *  return - Output received, net of fees.
     */
-   void exchange_base::place_ask_order( name trader, extended_asset price, extended_asset volume, time_point time_stamp, uint64_t tx_id = 0 ) {
-      extended_asset ask_volume = calculate_volume( price, volume );
+   template <typename Storage>
+   extended_asset basic_exchange_base<Storage>::route_swap( name trader, extended_asset base, extended_asset quote, extended_asset input, extended_asset min_output, time_point time_stamp ) {
+      check( input.quantity.amount > 0, "swap input must be positive" );
+      check( min_output.quantity.amount >= 0, "minimum output must not be negative" );
+
+      name market_name = find_market_pair( base, quote );
+      pairconfig config = get_pair_config( market_name );
+      check( config.matching_mode != BATCH_AUCTION, "cannot swap through a batch auction pair" );
+
+      extended_asset base_token  = normalize_precision( extended_asset( asset( 0, base.quantity.symbol ), base.contract ) );
+      extended_asset quote_token = normalize_precision( extended_asset( asset( 0, quote.quantity.symbol ), quote.contract ) );
+
+      const bool sell_base = input.get_extended_symbol() == base_token.get_extended_symbol();
+      check( sell_base || input.get_extended_symbol() == quote_token.get_extended_symbol(), "input must be the base or quote token" );
+      check( min_output.get_extended_symbol() == ( sell_base ? quote_token : base_token ).get_extended_symbol(),
+             "minimum output must be in the other token of the pair" );
+
+      auto liquidity_pool = exchange_pools.find( market_name.value );
+      const bool has_pool = liquidity_pool != exchange_pools.end();
+      int128_t base_reserve  = has_pool ? liquidity_pool->base_reserve.quantity.amount : 0;
+      int128_t quote_reserve = has_pool ? liquidity_pool->quote_reserve.quantity.amount : 0;
+      int128_t& input_reserve  = sell_base ? base_reserve : quote_reserve;
+      int128_t& output_reserve = sell_base ? quote_reserve : base_reserve;
+
+      int64_t input_left = input.quantity.amount;
+      int64_t pool_input  = 0;
+      int64_t pool_output = 0;
+
+      // sends input to the pool until its marginal price after the fee meets level_price, or all of it for 0
+      auto take_from_pool = [&]( int64_t level_price ) {
+         // a drained pool is skipped rather than divided by
+         if( !has_pool || input_left == 0 || input_reserve == 0 || output_reserve == 0 )
+            return;
+
+         int128_t amount = input_left;
+         if( level_price > 0 ) {
+            // x * y over the level price in output per input, multiplied out before dividing
+            const int128_t numerator   = sell_base ? price_t<>::scale : level_price;
+            const int128_t denominator = sell_base ? level_price : price_t<>::scale;
+            check( input_reserve <= int128_max / output_reserve / numerator, "pool reserves are too large to route" );
+            int128_t reserve_product = input_reserve * output_reserve * numerator / denominator;
+
+            int128_t fee_term = input_reserve * POOL_FEE_BPS / ( 2 * ( FEE_BPS_SCALE - POOL_FEE_BPS ) );
+            check( reserve_product <= int128_max - fee_term * fee_term, "pool reserves are too large to route" );
+
+            int128_t target = isqrt( reserve_product + fee_term * fee_term )
+                            - input_reserve * ( 2 * FEE_BPS_SCALE - POOL_FEE_BPS ) / ( 2 * ( FEE_BPS_SCALE - POOL_FEE_BPS ) );
+            if( target <= 0 )
+               return;
+            amount = std::min( amount, target );
+         }
 
-      check_sufficient_funds( trader, ask_volume );
+         qty_t<> input_after_fee = scale_by( qty_t<>( amount ), FEE_BPS_SCALE - POOL_FEE_BPS, FEE_BPS_SCALE );
+         int128_t output = scale_by( qty_t<>( output_reserve ), input_after_fee.value, input_reserve + input_after_fee.value ).value;
+         if( output == 0 )
+            return;
+
+         input_reserve  += amount;
+         output_reserve -= output;
+         input_left  -= amount;
+         pool_input  += amount;
+         pool_output += output;
+      };
+
+      struct route_fill {
+         order   maker;
+         qty_t<> volume;
+      };
+
+      bids& bid_orders = get_bids( market_name );
+      asks& ask_orders = get_asks( market_name );
+      vector<route_fill> fills;
+      vector<order> expired;
+      extended_asset book_output = sell_base ? quote_token : base_token;
+
+      if( sell_base ) {
+         // sell to the highest ASKs
+         auto buys = ask_orders.template get_index<"byprice"_n>();
+         for( auto buy = buys.rbegin(); buy != buys.rend() && input_left > 0; ++buy ) {
+            if( buy->expired( time_stamp ) ) {
+               expired.push_back( *buy );
+               continue;
+            }
+            if( buy->trader == trader )
+               continue;
+            if( !in_price_band( market_name, buy->price.quantity.amount ) || !sweep_level( market_name, 0, buy->price.quantity.amount ) )
+               break;
+
+            take_from_pool( buy->price.quantity.amount );
+            if( input_left == 0 )
+               break;
+
+            int64_t volume = std::min( buy->total_volume().quantity.amount, input_left );
+            fills.push_back( route_fill{ *buy, qty_t<>( volume ) } );
+            input_left -= volume;
+
+            extended_asset base_volume = base_token;
+            base_volume.quantity.amount = volume;
+            book_output += calculate_volume( buy->price, base_volume );
+         }
+      } else {
+         // buy from the lowest BIDs
+         auto sells = bid_orders.template get_index<"byprice"_n>();
+         for( auto sell = sells.begin(); sell != sells.end() && input_left > 0; ++sell ) {
+            if( sell->expired( time_stamp ) ) {
+               expired.push_back( *sell );
+               continue;
+            }
+            if( sell->trader == trader || sell->price.quantity.amount <= 0 )
+               continue;
+            if( !in_price_band( market_name, sell->price.quantity.amount ) || !sweep_level( market_name, 0, sell->price.quantity.amount ) )
+               break;
+
+            take_from_pool( sell->price.quantity.amount );
+            if( input_left == 0 )
+               break;
+
+            int64_t affordable = base_volume<EXCHANGE_PRECISION>( qty_t<>( input_left ), price_t<>( sell->price.quantity.amount ) ).value;
+            int64_t volume = std::min( sell->total_volume().quantity.amount, affordable );
+            if( volume == 0 )
+               break;
+
+            extended_asset base_volume = base_token;
+            base_volume.quantity.amount = volume;
+            fills.push_back( route_fill{ *sell, qty_t<>( volume ) } );
+            input_left -= calculate_volume( sell->price, base_volume ).quantity.amount;
+            book_output += base_volume;
+         }
+      }
 
-      auto market = exchange_markets.find( create_market_name( price ).value );
-      auto market_pair = market->bases.find( create_market_pair_name( volume, price ) );
-      check( market_pair != market->bases.end(), "market pair does not exist" );
+      take_from_pool( 0 );
 
-      //place ask order in order book
-      asks ask_orders( self, market_pair->first.value );
-      ask_orders.emplace( get_ram_payer(trader), [&]( auto& a ) {
-         a.id        = tx_id != 0 ? tx_id : ask_orders.available_primary_key();
-         a.trader    = trader;
-         a.timestamp = time_stamp;
-         a.price     = price;
-         a.volume    = volume;
-      });
+      extended_asset pool_received = book_output;
+      pool_received.quantity.amount = pool_output;
+      extended_asset output = book_output - charge_fee( market_name, book_output, config.taker_fee_bps ) + pool_received;
+      check( output.quantity.amount >= min_output.quantity.amount, "swap output is below the minimum" );
 
-      adjust_balance( trader, -ask_volume );  // subtract from traders available balance
-      adjust_balance( self, ask_volume );     // add to exchanges balance
+      // settle: the trader once per token, the exchanges escrow once per token, the makers in a batch
+      check_sufficient_funds( trader, input );
+      adjust_balance( trader, -input );
+
+      balance_batch settlement;
+      balance_batch escrow;
+      escrow.add( self, input );
+
+      for( const auto& fill : fills ) {
+         extended_asset base_volume = base_token;
+         base_volume.quantity.amount = fill.volume.value;
+         extended_asset maker_received = sell_base ? base_volume : calculate_volume( fill.maker.price, base_volume );
+         extended_asset proceeds = maker_received - charge_fee( market_name, maker_received, config.maker_fee_bps );
+
+         if( !queue_fill_event( market_name, fill.maker.trader, proceeds ) ) {
+            settlement.add( fill.maker.trader, proceeds );
+            escrow.add( self, -proceeds );
+         }
+
+         if( sell_base )
+            fill_order( market_name, ASK, ask_orders, ask_orders.find( fill.maker.id ), fill.volume, fill.maker.limit_price() );
+         else
+            fill_order( market_name, BID, bid_orders, bid_orders.find( fill.maker.id ), fill.volume, fill.maker.limit_price() );
+         record_trade( market_name, fill.maker.price, base_volume, sell_base ? BID : ASK, time_stamp );
+      }
+
+      // the pool holds its own reserves, so its part of the input leaves the escrow and its output does not
+      extended_asset pool_paid = input;
+      pool_paid.quantity.amount = pool_input;
+      extended_asset input_refund = input;
+      input_refund.quantity.amount = input_left;
+
+      escrow.add( self, -pool_paid );
+      for( const auto& payout : { output - pool_received, input_refund } ) {
+         settlement.add( trader, payout );
+         escrow.add( self, -payout );
+      }
+      settlement.add( trader, pool_received );
+
+      for( const auto& [ key, delta ] : escrow.balances )
+         if( delta.quantity.amount != 0 )
+            adjust_balance( self, delta );
+      credit_proceeds( settlement );
+
+      if( pool_input > 0 ) {
+         exchange_pools.modify( liquidity_pool, same_payer, [&]( auto& p ) {
+            p.base_reserve.quantity.amount  = base_reserve;
+            p.quote_reserve.quantity.amount = quote_reserve;
+         });
+      }
+
+      expire_orders( market_name, sell_base ? ASK : BID, expired );
+
+      if( !fills.empty() ) {
+         update_market_price( market_name, fills.back().maker.price, time_stamp );
+         trigger_stop_orders( market_name, fills.back().maker.price, time_stamp );
+      }
 
-      match_orders( market_pair->first );
+      return output;
    }
 
    /**
@@ -492,15 +2810,16 @@ namespace tokenexchange {
     *
     *  return - An extended_asset defining the trade price.
     */
+   template <typename Storage>
    template <typename T, typename F>
-   extended_asset exchange_base::calculate_price( int64_t spread, T bid, F ask ) {
+   extended_asset basic_exchange_base<Storage>::calculate_price( int64_t spread, T bid, F ask ) {
 
       if( spread == 0 ) {
          // price = best ask price (same as best bid price)
          return bid->price;
       } else if( spread < 0 ) {  // spread is overlapping in the orderbook
          // price = price of the earlier order submitted
-         if( bid->timestamp < ask->timestamp )
+         if( bid->arrived_before( *ask ) )
             return bid->price;
          else
             return ask->price;
@@ -513,6 +2832,270 @@ namespace tokenexchange {
       }
    }
 
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Records the last trade price of a market pair in its stats, converted
+    *  to the quote assets native precision.  The price it replaces is first
+    *  added to price_cumulative for every second it stood, so the TWAP stays
+    *  up to date in constant time per fill.
+    *
+    *  market_name - Market pair name.
+    *  trade_price - Trade price normalized to 8 decimals.
+    *  time_stamp  - Time of the trade.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::update_market_price( name market_name, extended_asset trade_price, time_point time_stamp ) {
+      auto market_stats = exchange_market_stats.find( market_name.value );
+      exchange_market_stats.modify( market_stats, same_payer, [&]( auto& s ) {
+         if( s.last_update != time_point() && time_stamp > s.last_update )
+            s.price_cumulative += uint128_t( s.price.quantity.amount ) * ( time_stamp.sec_since_epoch() - s.last_update.sec_since_epoch() );
+         if( time_stamp > s.last_update )
+            s.last_update = time_stamp;
+
+         s.price = extended_asset(
+            asset(
+               price_t<>( trade_price.quantity.amount ).to_decimals( s.price.quantity.symbol.precision() ),
+               symbol(s.price.get_extended_symbol().get_symbol().code(), s.price.quantity.symbol.precision())
+            ),
+            trade_price.contract
+         );
+      });
+   }
+
+   /**
+    *  Returns true if the proceeds were queued.
+    *
+    *  Description:
+    *  Writes a makers proceeds to the pairs fill event ring buffer instead of
+    *  their exchange balance, when the pair has deferred settlement.  The
+    *  tokens stay in the exchanges balance until crank_events pays them out.
+    *  Returns false when the pair settles immediately or the queue is full,
+    *  and the caller then credits the maker itself.
+    *
+    *  market_name - Market pair name.
+    *  maker       - Account of the resting order.
+    *  proceeds    - Tokens owed to the maker, normalized to 8 decimals.
+    *
+    *  return - True if the proceeds were queued.
+    */
+   template <typename Storage>
+   bool basic_exchange_base<Storage>::queue_fill_event( name market_name, name maker, extended_asset proceeds ) {
+      if( !get_pair_config( market_name ).deferred_settlement )
+         return false;
+      if( proceeds.quantity.amount == 0 )
+         return true;
+
+      auto event_queue = exchange_event_queues.find( market_name.value );
+      if( event_queue == exchange_event_queues.end() ) {
+         event_queue = exchange_event_queues.emplace( self, [&]( auto& q ) {
+            q.market_name = market_name;
+         });
+      }
+
+      if( event_queue->tail - event_queue->head >= EVENT_QUEUE_SIZE )
+         return false;
+
+      // the tail numbers the event, and its slot row is reused in place once the ring wraps
+      uint64_t sequence_number = event_queue->tail;
+      uint64_t slot = sequence_number % EVENT_QUEUE_SIZE;
+      auto write_event = [&]( auto& e ) {
+         e.slot     = slot;
+         e.sequence = sequence_number;
+         e.maker    = maker;
+         e.token_id = find_token_id( proceeds.contract, proceeds.quantity.symbol );
+         e.amount   = proceeds.quantity.amount;
+      };
+
+      fillevents& events = get_fill_events( market_name );
+      auto event = events.find( slot );
+      if( event == events.end() )
+         events.emplace( self, write_event );
+      else
+         events.modify( event, same_payer, write_event );
+
+      exchange_event_queues.modify( event_queue, same_payer, [&]( auto& q ) {
+         q.tail++;
+      });
+      return true;
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Writes a fill to the market pairs recent trade history, overwriting
+    *  the oldest fill once TRADE_HISTORY_SIZE are kept.  Fills are numbered
+    *  on from the latest row of the ring itself, read once per action and
+    *  counted in memory after that, so recording a fill writes its slot row
+    *  only.  Clients read the whole history with one range query and order
+    *  it by sequence.
+    *
+    *  market_name - Market pair name.
+    *  price       - Trade price, normalized to 8 decimals.
+    *  volume      - Base volume traded, normalized to 8 decimals.
+    *  taker_side  - BID if the taker sold, ASK if it bought.
+    *  time_stamp  - Time of the fill.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::record_trade( name market_name, extended_asset price, extended_asset volume, bool taker_side, time_point time_stamp ) {
+      recenttrades& trades = get_recent_trades( market_name );
+
+      auto next_trade = ctx.next_trades.find( market_name );
+      if( next_trade == ctx.next_trades.end() ) {
+         auto by_sequence = trades.template get_index<"bysequence"_n>();
+         auto latest = by_sequence.rbegin();
+         next_trade = ctx.next_trades.emplace( market_name, latest == by_sequence.rend() ? 0 : latest->sequence + 1 ).first;
+      }
+
+      uint64_t sequence_number = next_trade->second++;
+      uint64_t slot = sequence_number % TRADE_HISTORY_SIZE;
+      auto write_trade = [&]( auto& t ) {
+         t.slot      = slot;
+         t.sequence  = sequence_number;
+         t.price     = price;
+         t.volume    = volume;
+         t.side      = taker_side;
+         t.timestamp = time_stamp;
+      };
+
+      auto trade = trades.find( slot );
+      if( trade == trades.end() )
+         trades.emplace( self, write_trade );
+      else
+         trades.modify( trade, same_payer, write_trade );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Keeps the final status of an order whose last fill takes it off the
+    *  book, overwriting the oldest once ORDER_HISTORY_SIZE are kept.  Orders
+    *  are numbered on from the latest row of the ring, like record_trade.
+    *
+    *  market_name - Market pair name.
+    *  order_type  - BID or ASK side of the order.
+    *  o           - Order row before its last fill.
+    *  amount      - Base volume of the last fill.
+    *  fill_price  - Price of the last fill.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::record_filled_order( name market_name, bool order_type, const order& o, qty_t<> amount, price_t<> fill_price ) {
+      filledorders& filled_orders = get_filled_orders( market_name );
+
+      auto next_filled = ctx.next_filled_orders.find( market_name );
+      if( next_filled == ctx.next_filled_orders.end() ) {
+         auto by_sequence = filled_orders.template get_index<"bysequence"_n>();
+         auto latest = by_sequence.rbegin();
+         next_filled = ctx.next_filled_orders.emplace( market_name, latest == by_sequence.rend() ? 0 : latest->sequence + 1 ).first;
+      }
+
+      uint64_t sequence_number = next_filled->second++;
+      uint64_t slot = sequence_number % ORDER_HISTORY_SIZE;
+      auto write_order = [&]( auto& f ) {
+         f.slot           = slot;
+         f.sequence       = sequence_number;
+         f.id             = o.id;
+         f.trader         = o.trader;
+         f.side           = order_type;
+         f.price          = o.price;
+         f.orig_qty       = o.orig_qty;
+         f.filled_qty     = o.filled_qty + amount.value;
+         f.avg_fill_price = average_price( price_t<>( o.avg_fill_price ), qty_t<>( o.filled_qty ), fill_price, amount ).value;
+      };
+
+      auto filled = filled_orders.find( slot );
+      if( filled == filled_orders.end() )
+         filled_orders.emplace( self, write_order );
+      else
+         filled_orders.modify( filled, same_payer, write_order );
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Releases a fill from the exchanges escrow to a trader.  Makers of pairs
+    *  with deferred settlement are queued for crank_events instead.
+    *
+    *  market_name - Market pair name.
+    *  trader      - Account receiving the proceeds.
+    *  proceeds    - Tokens received, normalized to 8 decimals.
+    *  maker       - True if the trader owned the resting order.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::settle_fill( name market_name, name trader, extended_asset proceeds, bool maker ) {
+      if( maker && queue_fill_event( market_name, trader, proceeds ) )
+         return;
+
+      adjust_balance( self, -proceeds );
+      credit_proceeds( trader, proceeds );
+   }
+
+   /**
+    *  Returns the number of fill events applied.
+    *
+    *  Description:
+    *  Pays out queued maker proceeds, oldest first.  Credits are summed per
+    *  maker and token, and the exchanges escrow is debited once per token.
+    *
+    *  base       - Base asset.
+    *  quote      - Quote asset.
+    *  max_events - Maximum number of events to apply.
+    *
+    *  return - Number of events applied.
+    */
+   template <typename Storage>
+   uint32_t basic_exchange_base<Storage>::crank_events( extended_asset base, extended_asset quote, uint32_t max_events ) {
+      name market_name = find_market_pair( base, quote );
+
+      auto event_queue = exchange_event_queues.find( market_name.value );
+      check( event_queue != exchange_event_queues.end() && event_queue->head != event_queue->tail, "no fill events to crank" );
+
+      fillevents& events = get_fill_events( market_name );
+      map<uint64_t, extended_symbol> token_symbols;
+      balance_batch settlement;
+      balance_batch released;
+
+      uint64_t head = event_queue->head;
+      uint32_t applied = 0;
+
+      for( ; head != event_queue->tail && applied < max_events; ++head, ++applied ) {
+         const auto& event = events.get( head % EVENT_QUEUE_SIZE, "fill event not found" );
+
+         auto token_symbol = token_symbols.find( event.token_id );
+         if( token_symbol == token_symbols.end() ) {
+            const auto& registered = exchange_tokens.get( event.token_id, "token not registered" );
+            token_symbol = token_symbols.emplace( event.token_id,
+               extended_symbol( symbol( registered.sym.code(), 8 ), registered.contract ) ).first;
+         }
+
+         extended_asset proceeds( event.amount, token_symbol->second );
+         settlement.add( event.maker, proceeds );
+         released.add( self, proceeds );
+      }
+
+      exchange_event_queues.modify( event_queue, same_payer, [&]( auto& q ) {
+         q.head = head;
+      });
+
+      for( const auto& [ key, total ] : released.balances )
+         adjust_balance( self, -total );
+      credit_proceeds( settlement );
+
+      return applied;
+   }
+
    /**
     *  No return value.
     *
@@ -532,20 +3115,31 @@ namespace tokenexchange {
     *       else:
     *         remove the order with the minimum volume (either best ASK or best BUY) from the orderbook, and update the volume of the other order
     *
+    *  Expired orders met at the top of the book are refunded and removed
+    *  instead of being matched, as is the rest of an incoming order that
+    *  has traded through the pairs max_sweep_levels.
+    *
     *  market_name  - Market where order book exists.
+    *  time_stamp   - Time of the action that triggered matching.
     *
     *  return - None.
     */
-   void exchange_base::match_orders( name market_name ) {
+   template <typename Storage>
+   void basic_exchange_base<Storage>::match_orders( name market_name, time_point time_stamp ) {
+      if( get_pair_config( market_name ).matching_mode == PRO_RATA ) {
+         match_pro_rata( market_name, time_stamp );
+         return;
+      }
+
       extended_asset trade_price;
       extended_asset bid_volume;
       extended_asset ask_volume;
       extended_asset volume_offset;
 
-      bids bid_orders( self, market_name.value );
-      auto best_bids = bid_orders.get_index<"byprice"_n>();
+      bids& bid_orders = get_bids( market_name );
+      auto best_bids = bid_orders.template get_index<"byprice"_n>();
 
-      asks best_asks( self, market_name.value );
+      asks& best_asks = get_asks( market_name );
 
       // Find Lowest Bid (Sell) Order
       auto bid = best_bids.lower_bound( 0 );
@@ -563,6 +3157,17 @@ namespace tokenexchange {
          ask_itr++;
       }
 
+      if( bid != best_bids.end() && bid->expired( time_stamp ) ) {
+         expire_orders( market_name, BID, { *bid } );
+         match_orders( market_name, time_stamp );
+         return;
+      }
+      if( ask != best_asks.end() && ask->expired( time_stamp ) ) {
+         expire_orders( market_name, ASK, { *ask } );
+         match_orders( market_name, time_stamp );
+         return;
+      }
+
       if( bid != best_bids.end() && ask != best_asks.end() ) {
          int64_t spread = ( bid->price.quantity.amount - ask->price.quantity.amount );
 
@@ -571,65 +3176,409 @@ namespace tokenexchange {
          //      volume traded = the minimum volume between both the best bid and best ask orders
          //      if spread = 0:
          if( spread <= 0 ) {
+            // copy the best orders, the iterators are invalidated once the rows are erased
+            const order best_bid = *bid;
+            const order best_ask = *ask;
+
+            // the earlier order was resting on the book
+            bool bid_is_maker = best_bid.arrived_before( best_ask );
+
+            if( best_bid.trader == best_ask.trader ) {
+               bool acted = bid_is_maker ? prevent_self_trade( market_name, best_ask, ASK, best_bid )
+                                         : prevent_self_trade( market_name, best_bid, BID, best_ask );
+               if( acted ) {
+                  match_orders( market_name, time_stamp );
+                  return;
+               }
+            }
+
+            // the rest of an order that has swept its level limit is cancelled
+            const order& taker = bid_is_maker ? best_ask : best_bid;
+            const order& maker = bid_is_maker ? best_bid : best_ask;
+            if( !sweep_level( market_name, taker.id, maker.price.quantity.amount ) ) {
+               expire_orders( market_name, bid_is_maker ? ASK : BID, { taker } );
+               match_orders( market_name, time_stamp );
+               return;
+            }
+
             trade_price = calculate_price( spread, bid, ask );
 
-            auto market_stats = exchange_market_stats.find( market_name.value );
-            exchange_market_stats.modify( market_stats, same_payer, [&]( auto& s ) {
-               s.price = extended_asset(
-                  asset(
-                     trade_price.quantity.amount / pow( 10, trade_price.quantity.symbol.precision() - s.price.quantity.symbol.precision() ),
-                     symbol(s.price.get_extended_symbol().get_symbol().code(), s.price.quantity.symbol.precision())
-                  ),
-                  trade_price.contract
-               );
-            });
+            update_market_price( market_name, trade_price, time_stamp );
 
             //  2. Update the orderbook:
             //      if best bid volume == best ask volume:
             //          remove best bid and best ask orders from order book
-            if( bid->volume == ask->volume ) {
-               best_asks.erase( ask );
-               best_bids.erase( bid );
-
-               bid_volume = bid->volume;
-               ask_volume = calculate_volume( trade_price, bid->volume);
-            } else {
-               // remove the order with the minimum volume (either best bid or best ask) from the orderbook
-               // update the volume of the other order
-               if( ask->volume < bid->volume ) { // bid is larger : update bid, remove ask
-                  best_bids.modify( bid, same_payer, [&]( auto& b ) {
-                     b.volume -= ask->volume;
-                  });
-                  best_asks.erase( ask );
-
-                  bid_volume = ask->volume;
-                  ask_volume = calculate_volume( trade_price, ask->volume );
-               } else { // ask is larger: update ask, remove bid
-                  best_asks.modify( ask, same_payer, [&]( auto& a ) {
-                     a.volume -= bid->volume;
-                  });
-                  best_bids.erase( bid );
-
-                  bid_volume = bid->volume;
-                  ask_volume = calculate_volume( trade_price, bid->volume );
-               }
-            }
-
-            if( trade_price < ask->price ) {
-               volume_offset = calculate_volume( ask->price, bid_volume ) - calculate_volume( trade_price, bid_volume );
+            //      else:
+            //          remove the order with the minimum volume (either best bid or best ask) from the orderbook
+            //          update the volume of the other order
+            //      an iceberg order whose shown volume is used up is refilled from its reserve instead
+            bid_volume = best_ask.volume < best_bid.volume ? best_ask.volume : best_bid.volume;
+            ask_volume = calculate_volume( trade_price, bid_volume );
+            record_trade( market_name, trade_price, bid_volume, bid_is_maker ? ASK : BID, time_stamp );
+
+            const qty_t<> traded = std::min( best_bid.visible_qty(), best_ask.visible_qty() );
+            const price_t<> fill_price( trade_price.quantity.amount );
+            fill_order( market_name, BID, best_bids, bid, traded, fill_price );
+            fill_order( market_name, ASK, best_asks, ask, traded, fill_price );
+
+            if( trade_price < best_ask.price ) {
+               volume_offset = calculate_volume( best_ask.price, bid_volume ) - calculate_volume( trade_price, bid_volume );
                // refund difference
-               adjust_balance( self, -volume_offset );adjust_balance( ask->trader, volume_offset );
+               settle_fill( market_name, best_ask.trader, volume_offset, !bid_is_maker );
             }
 
+            // fees are taken from what each side receives
+            pairconfig config = get_pair_config( market_name );
+            extended_asset ask_fee = charge_fee( market_name, bid_volume, bid_is_maker ? config.taker_fee_bps : config.maker_fee_bps );
+            extended_asset bid_fee = charge_fee( market_name, ask_volume, bid_is_maker ? config.maker_fee_bps : config.taker_fee_bps );
+
             // send BID to ASK trader
-            adjust_balance( self, -bid_volume );adjust_balance( ask->trader, bid_volume );
+            settle_fill( market_name, best_ask.trader, bid_volume - ask_fee, !bid_is_maker );
             // send ASK to BID trader
-            adjust_balance( self, -ask_volume );adjust_balance( bid->trader, ask_volume );
+            settle_fill( market_name, best_bid.trader, ask_volume - bid_fee, bid_is_maker );
+
+            trigger_stop_orders( market_name, trade_price, time_stamp );
+
+            match_orders( market_name, time_stamp );
+         }
+      }
+   }
+
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Pro-rata order matching algorithm for pairs in PRO_RATA mode.
+    *
+    *  The later of the best bid and best ask is the taker.  Instead of
+    *  filling the makers at the best price one row at a time, the taker is
+    *  split across the whole price level in one pass over its index range:
+    *
+    *    maker fill = taker fill * maker volume / level volume
+    *
+    *  Only the shown slice of an iceberg order counts toward the level.
+    *  Units lost to rounding go to the earliest makers.  The level trades
+    *  at the makers price, and its balance changes are summed per trader and
+    *  token before they are written.  Repeats for the next level while the
+    *  taker still crosses.  Expired orders at the top of the book or in the
+    *  level are refunded and removed instead of being filled.
+    *
+    *  market_name - Market pair name.
+    *  time_stamp  - Time of the action that triggered matching.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::match_pro_rata( name market_name, time_point time_stamp ) {
+      bids& bid_orders = get_bids( market_name );
+      asks& ask_orders = get_asks( market_name );
+      auto best_bids = bid_orders.template get_index<"byprice"_n>();
+      auto best_asks = ask_orders.template get_index<"byprice"_n>();
+
+      auto bid = best_bids.begin();
+      auto ask = best_asks.rbegin();
+
+      if( bid != best_bids.end() && bid->expired( time_stamp ) ) {
+         expire_orders( market_name, BID, { *bid } );
+         match_pro_rata( market_name, time_stamp );
+         return;
+      }
+      if( ask != best_asks.rend() && ask->expired( time_stamp ) ) {
+         expire_orders( market_name, ASK, { *ask } );
+         match_pro_rata( market_name, time_stamp );
+         return;
+      }
 
-            match_orders( market_name );
+      if( bid == best_bids.end() || ask == best_asks.rend() || bid->price.quantity.amount > ask->price.quantity.amount )
+         return;
+
+      const order best_bid = *bid;
+      const order best_ask = *ask;
+
+      // the earlier order is resting on the book, the later one takes its price level
+      const bool taker_type = best_bid.arrived_before( best_ask ) ? ASK : BID;
+      const order& taker    = taker_type == ASK ? best_ask : best_bid;
+      const order& maker    = taker_type == ASK ? best_bid : best_ask;
+
+      // the rest of a taker that has swept its level limit is cancelled
+      if( !sweep_level( market_name, taker.id, maker.price.quantity.amount ) ) {
+         expire_orders( market_name, taker_type, { taker } );
+         match_pro_rata( market_name, time_stamp );
+         return;
+      }
+
+      vector<order> level;
+      vector<order> expired;
+      qty_t<> level_volume;
+
+      auto add_to_level = [&]( const order& o ) {
+         if( o.expired( time_stamp ) ) {
+            expired.push_back( o );
+         } else {
+            level.push_back( o );
+            level_volume += o.visible_qty();
+         }
+      };
+
+      if( taker_type == ASK ) {
+         for( auto itr = best_bids.lower_bound( maker.price.quantity.amount );
+              itr != best_bids.end() && itr->price.quantity.amount == maker.price.quantity.amount; ++itr )
+            add_to_level( *itr );
+      } else {
+         for( auto itr = best_asks.lower_bound( maker.price.quantity.amount );
+              itr != best_asks.end() && itr->price.quantity.amount == maker.price.quantity.amount; ++itr )
+            add_to_level( *itr );
+      }
+
+      expire_orders( market_name, !taker_type, expired );
+
+      std::sort( level.begin(), level.end(), []( const order& a, const order& b ) { return a.arrived_before( b ); });
+
+      // the taker meets its own earliest order in the level before any fill
+      if( taker.stp_mode != STP_NONE ) {
+         auto own = std::find_if( level.begin(), level.end(), [&]( const order& o ) { return o.trader == taker.trader; });
+         if( own != level.end() ) {
+            prevent_self_trade( market_name, taker, taker_type, *own );
+            match_pro_rata( market_name, time_stamp );
+            return;
+         }
+      }
+
+      // allocate the taker across the level
+      qty_t<> taker_fill = std::min( taker.visible_qty(), level_volume );
+      qty_t<> allocated;
+      vector<qty_t<>> fills( level.size() );
+
+      for( size_t i = 0; i < level.size(); ++i ) {
+         fills[i] = scale_by( taker_fill, level[i].volume.quantity.amount, level_volume.value );
+         allocated += fills[i];
+      }
+      for( size_t i = 0; i < level.size() && allocated < taker_fill; ++i ) {
+         qty_t<> extra = std::min( taker_fill - allocated, level[i].visible_qty() - fills[i] );
+         fills[i]  += extra;
+         allocated += extra;
+      }
+
+      // settle the level, fees are taken from what each side receives
+      pairconfig config = get_pair_config( market_name );
+      const extended_asset& trade_price = maker.price;
+      const price_t<> fill_price = maker.limit_price();
+      balance_batch settlement;
+      extended_asset base_released  = taker.volume;
+      extended_asset quote_released = trade_price;
+      base_released.quantity.amount  = 0;
+      quote_released.quantity.amount = 0;
+
+      for( size_t i = 0; i < level.size(); ++i ) {
+         if( fills[i] == qty_t<>() )
+            continue;
+
+         extended_asset base_volume = taker.volume;
+         base_volume.quantity.amount = fills[i].value;
+         extended_asset quote_volume = calculate_volume( trade_price, base_volume );
+
+         if( taker_type == ASK ) {
+            extended_asset taker_proceeds = base_volume - charge_fee( market_name, base_volume, config.taker_fee_bps );
+            extended_asset maker_proceeds = quote_volume - charge_fee( market_name, quote_volume, config.maker_fee_bps );
+            extended_asset refund = calculate_volume( taker.price, base_volume ) - quote_volume;
+            settlement.add( taker.trader, taker_proceeds );
+            settlement.add( taker.trader, refund );
+            base_released  += taker_proceeds;
+            quote_released += refund;
+
+            if( !queue_fill_event( market_name, level[i].trader, maker_proceeds ) ) {
+               settlement.add( level[i].trader, maker_proceeds );
+               quote_released += maker_proceeds;
+            }
+         } else {
+            extended_asset taker_proceeds = quote_volume - charge_fee( market_name, quote_volume, config.taker_fee_bps );
+            extended_asset maker_proceeds = base_volume - charge_fee( market_name, base_volume, config.maker_fee_bps );
+            settlement.add( taker.trader, taker_proceeds );
+            quote_released += taker_proceeds;
+
+            if( !queue_fill_event( market_name, level[i].trader, maker_proceeds ) ) {
+               settlement.add( level[i].trader, maker_proceeds );
+               base_released += maker_proceeds;
+            }
          }
+
+         if( taker_type == ASK )
+            fill_order( market_name, BID, bid_orders, bid_orders.find( level[i].id ), fills[i], fill_price );
+         else
+            fill_order( market_name, ASK, ask_orders, ask_orders.find( level[i].id ), fills[i], fill_price );
+         record_trade( market_name, trade_price, base_volume, taker_type, time_stamp );
       }
+
+      if( taker_type == ASK )
+         fill_order( market_name, ASK, ask_orders, ask_orders.find( taker.id ), taker_fill, fill_price );
+      else
+         fill_order( market_name, BID, bid_orders, bid_orders.find( taker.id ), taker_fill, fill_price );
+
+      adjust_balance( self, -base_released );
+      adjust_balance( self, -quote_released );
+      credit_proceeds( settlement );
+
+      update_market_price( market_name, trade_price, time_stamp );
+      trigger_stop_orders( market_name, trade_price, time_stamp );
+
+      match_pro_rata( market_name, time_stamp );
    }
 
+   /**
+    *  No return value.
+    *
+    *  Description:
+    *  Batch auction clearing for pairs in BATCH_AUCTION mode.
+    *
+    *  Collects the crossing part of the book, then walks BIDs (sells) from
+    *  the lowest price and ASKs (buys) from the highest price in price-time
+    *  order.  That walk traces the aggregated supply and demand curves and
+    *  stops where they intersect.  The result is the executable volume and
+    *  the marginal sell and buy prices.  Every fill then settles at one
+    *  uniform clearing price, halfway between the marginal prices:
+    *
+    *    sellers receive  clearing price * volume
+    *    buyers receive   volume, plus a refund of (order price - clearing price) * volume
+    *
+    *  Balances are settled in bulk: one write per trader and token, one per
+    *  token for the exchanges escrow, and one per order row.
+    *
+    *  base       - Base asset.
+    *  quote      - Quote asset.
+    *  time_stamp - Time clear action was executed, given to triggered stop orders.
+    *
+    *  return - None.
+    */
+   template <typename Storage>
+   void basic_exchange_base<Storage>::clear_auction( extended_asset base, extended_asset quote, time_point time_stamp ) {
+      name market_name = find_market_pair( base, quote );
+      check( get_pair_config( market_name ).matching_mode == BATCH_AUCTION, "market pair is not in batch auction mode" );
+
+      bids& bid_orders = get_bids( market_name );
+      asks& ask_orders = get_asks( market_name );
+      auto sells = bid_orders.template get_index<"byprice"_n>();
+      auto buys  = ask_orders.template get_index<"byprice"_n>();
+
+      // expired orders are refunded instead of taking part
+      vector<order> expired_sells;
+      vector<order> expired_buys;
+
+      auto sell = sells.begin();
+      auto buy  = buys.rbegin();
+      for( ; sell != sells.end() && sell->expired( time_stamp ); ++sell )
+         expired_sells.push_back( *sell );
+      for( ; buy != buys.rend() && buy->expired( time_stamp ); ++buy )
+         expired_buys.push_back( *buy );
+
+      check( sell != sells.end() && buy != buys.rend() && sell->price.quantity.amount <= buy->price.quantity.amount,
+             "no crossing orders to clear" );
+
+      // crossing part of the book, sells lowest price first and buys highest price first
+      vector<order> sell_orders;
+      vector<order> buy_orders;
+      int64_t best_buy_price  = buy->price.quantity.amount;
+      int64_t best_sell_price = sell->price.quantity.amount;
+
+      for( ; sell != sells.end() && sell->price.quantity.amount <= best_buy_price; ++sell )
+         ( sell->expired( time_stamp ) ? expired_sells : sell_orders ).push_back( *sell );
+      for( ; buy != buys.rend() && buy->price.quantity.amount >= best_sell_price; ++buy )
+         ( buy->expired( time_stamp ) ? expired_buys : buy_orders ).push_back( *buy );
+
+      std::sort( buy_orders.begin(), buy_orders.end(), []( const order& a, const order& b ) {
+         if( a.price.quantity.amount != b.price.quantity.amount )
+            return a.price.quantity.amount > b.price.quantity.amount;
+         return a.arrived_before( b );
+      });
+
+      // walk the curves to their intersection
+      struct auction_fill {
+         size_t  sell;
+         size_t  buy;
+         qty_t<> volume;
+      };
+
+      vector<auction_fill> fills;
+      vector<qty_t<>> sell_remaining( sell_orders.size() );
+      vector<qty_t<>> buy_remaining( buy_orders.size() );
+      for( size_t i = 0; i < sell_orders.size(); ++i ) sell_remaining[i] = sell_orders[i].visible_qty();
+      for( size_t j = 0; j < buy_orders.size(); ++j ) buy_remaining[j] = buy_orders[j].visible_qty();
+
+      price_t<> marginal_sell_price;
+      price_t<> marginal_buy_price;
+
+      for( size_t i = 0, j = 0; i < sell_orders.size() && j < buy_orders.size()
+           && sell_orders[i].limit_price() <= buy_orders[j].limit_price(); ) {
+         qty_t<> volume = std::min( sell_remaining[i], buy_remaining[j] );
+         fills.push_back( auction_fill{ i, j, volume } );
+
+         marginal_sell_price = sell_orders[i].limit_price();
+         marginal_buy_price  = buy_orders[j].limit_price();
+
+         sell_remaining[i] -= volume;
+         buy_remaining[j]  -= volume;
+         if( sell_remaining[i] == qty_t<>() ) ++i;
+         if( buy_remaining[j] == qty_t<>() ) ++j;
+      }
+
+      extended_asset clearing_price = sell_orders.front().price;
+      price_t<> clearing = marginal_sell_price + scale_by( marginal_buy_price - marginal_sell_price, 1, 2 );
+      clearing_price.quantity.amount = clearing.value;
+
+      // settle every fill at the clearing price, both sides rest on the book so both pay the maker fee
+      uint16_t fee_bps = get_pair_config( market_name ).maker_fee_bps;
+      balance_batch settlement;
+      extended_asset base_released  = sell_orders.front().volume;
+      extended_asset quote_released = clearing_price;
+      base_released.quantity.amount  = 0;
+      quote_released.quantity.amount = 0;
+
+      for( const auto& fill : fills ) {
+         const order& sell_order = sell_orders[fill.sell];
+         const order& buy_order  = buy_orders[fill.buy];
+
+         extended_asset base_volume = sell_order.volume;
+         base_volume.quantity.amount = fill.volume.value;
+
+         extended_asset quote_volume = calculate_volume( clearing_price, base_volume );
+         extended_asset refund       = calculate_volume( buy_order.price, base_volume ) - quote_volume;
+
+         extended_asset seller_proceeds = quote_volume - charge_fee( market_name, quote_volume, fee_bps );
+         extended_asset buyer_proceeds  = base_volume - charge_fee( market_name, base_volume, fee_bps );
+
+         settlement.add( sell_order.trader, seller_proceeds );
+         settlement.add( buy_order.trader, buyer_proceeds );
+         settlement.add( buy_order.trader, refund );
+
+         base_released  += buyer_proceeds;
+         quote_released += seller_proceeds + refund;
+
+         // the order that arrived last crossed the book
+         record_trade( market_name, clearing_price, base_volume, buy_order.arrived_before( sell_order ) ? BID : ASK, time_stamp );
+      }
+
+      for( size_t i = 0; i < sell_orders.size(); ++i ) {
+         if( sell_remaining[i] == sell_orders[i].visible_qty() )
+            continue;
+
+         fill_order( market_name, BID, bid_orders, bid_orders.find( sell_orders[i].id ), sell_orders[i].visible_qty() - sell_remaining[i], clearing );
+      }
+
+      for( size_t j = 0; j < buy_orders.size(); ++j ) {
+         if( buy_remaining[j] == buy_orders[j].visible_qty() )
+            continue;
+
+         fill_order( market_name, ASK, ask_orders, ask_orders.find( buy_orders[j].id ), buy_orders[j].visible_qty() - buy_remaining[j], clearing );
+      }
+
+      adjust_balance( self, -base_released );
+      adjust_balance( self, -quote_released );
+      credit_proceeds( settlement );
+
+      expire_orders( market_name, BID, expired_sells );
+      expire_orders( market_name, ASK, expired_buys );
+
+      update_market_price( market_name, clearing_price, time_stamp );
+      trigger_stop_orders( market_name, clearing_price, time_stamp );
+   }
 
 } // namespace tokenexchange
@@ -156,7 +156,7 @@ namespace eosio {
          unset_next_primary_key = static_cast<uint64_t>(-1)
       };
 
-      mutable uint64_t _next_primary_key;
+      mutable uint64_t _next_primary_key = unset_next_primary_key;
 
       uint64_t available_primary_key()const {
          if( _next_primary_key == unset_next_primary_key ) {
@@ -212,9 +212,13 @@ namespace eosio {
       const_iterator emplace(eosio::name, Lambda&& lambda) {
          T value;
          lambda(value);
+         auto pk = value.primary_key();
          auto r = get_impl().insert(std::move(value));
-         if (r.second)
+         if (r.second) {
+            if( pk >= _next_primary_key )
+               _next_primary_key = (pk >= no_available_primary_key) ? no_available_primary_key : (pk + 1);
             return get_impl().template get<0>().iterator_to(*r.first);
+         }
          throw std::runtime_error("duplicated key");
       }
 
@@ -306,7 +310,7 @@ namespace eosio {
          lambda(*itr);
       }
 
-      void erase(const_iterator itr) { get_impl().erase(itr.base); }
+      const_iterator erase(const_iterator itr) { return const_iterator{get_impl().erase(itr.base)}; }
 
       eosio::name get_code() const { return code; }
       eosio::name code;
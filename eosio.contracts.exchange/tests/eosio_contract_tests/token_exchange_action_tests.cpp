@@ -218,6 +218,11 @@ namespace eosio_system {
                                mutable_variant_object()("from", from)("token", token));
       }
 
+      action_result withdrawmany(name actor, name from, std::vector<extended_asset> tokens) {
+         return push_action_ex(actor, exchange, name("withdrawmany"),
+                               mutable_variant_object()("from", from)("tokens", tokens));
+      }
+
       action_result createmarket(name actor, name owner, extended_asset quote ) {
          return push_action_ex(actor, exchange, name("createmarket"),
                                mutable_variant_object()
@@ -302,6 +307,22 @@ namespace eosio_system {
             get_serializer(CONTRACT_ACCOUNT).binary_to_variant("exaccount", data, abi_serializer_max_time)["balance"].as<extended_asset>();
       }
 
+      // id of the first order of a pair, or 0 if the pair has none
+      uint64_t get_first_order_id(name market_name, name table) {
+         const auto& db = control->db();
+         const auto* t_id = db.find<table_id_object, by_code_scope_table>( boost::make_tuple( CONTRACT_ACCOUNT, market_name, table ) );
+         if ( !t_id ) {
+            return 0;
+         }
+
+         const auto& idx = db.get_index<key_value_index, by_scope_primary>();
+         auto itr = idx.lower_bound( boost::make_tuple( t_id->id, 0 ) );
+         if ( itr == idx.end() || itr->t_id != t_id->id ) {
+            return 0;
+         }
+         return itr->primary_key;
+      }
+
    };
 
    name exchange_tester::exchange     = CONTRACT_ACCOUNT;
@@ -541,6 +562,60 @@ TEST_CASE_FIXTURE(eosio_system::exchange_tester, "withdraw") try {
 } FC_LOG_AND_RETHROW()
 
 
+TEST_CASE_FIXTURE(eosio_system::exchange_tester, "withdrawmany") try {
+
+   GIVEN("alice has 100 EOS and 100 BTC in her exchange account") {
+      name alice            = name("alice");
+      name bob              = name("bob");
+      name eosio_token      = name("eosio.token");
+      name btc_token        = name("btc.token");
+      asset alice_EOS       = asset(    1000000, symbol(4,"EOS"));  // 100.0000 EOS
+      asset alice_BTC       = asset(10000000000, symbol(8,"BTC"));  // 100.00000000 BTC
+
+      REQUIRE(init(exchange, false) == success());
+
+      transfer(eosio_token, eosio_token, alice, alice_EOS, "initial balance");
+      transfer(btc_token,     btc_token, alice, alice_BTC, "initial balance");
+      REQUIRE(transfer(eosio_token, alice, exchange, alice_EOS, "deposit") == success());
+      REQUIRE(transfer(btc_token,   alice, exchange, alice_BTC, "deposit") == success());
+
+      WHEN("alice withdraws 5 EOS, 5 BTC and 5 more EOS in one action") {
+         auto r = withdrawmany(alice, alice, {
+            extended_asset(asset(  50000, symbol(4,"EOS")), eosio_token),
+            extended_asset(asset(500000000, symbol(8,"BTC")), btc_token),
+            extended_asset(asset(  50000, symbol(4,"EOS")), eosio_token)
+         });
+
+         THEN("alice receives 10 EOS and 5 BTC") {
+            CHECK(r == success());
+            CHECK(get_account_balance(eosio_token, alice, "4,EOS") == asset(100000, symbol(4,"EOS")));
+            CHECK(get_account_balance(btc_token,   alice, "8,BTC") == asset(500000000, symbol(8,"BTC")));
+         }
+      }
+
+      WHEN("alice withdraws more EOS than she has across two entries") {
+         auto r = withdrawmany(alice, alice, {
+            extended_asset(asset(600000, symbol(4,"EOS")), eosio_token),
+            extended_asset(asset(600000, symbol(4,"EOS")), eosio_token)
+         });
+
+         THEN("the withdraw fails") {
+            CHECK(r == "assertion failure with message: exchange balance overdrawn");
+         }
+      }
+
+      WHEN("bob withdraws from alices exchange account") {
+         auto r = withdrawmany(bob, alice, { extended_asset(asset(50000, symbol(4,"EOS")), eosio_token) });
+
+         THEN("the transanction will fail because bob does not have permission to withdraw alices funds") {
+            CHECK(r == "missing authority of alice");
+         }
+      }
+   }
+
+} FC_LOG_AND_RETHROW()
+
+
 TEST_CASE_FIXTURE(eosio_system::exchange_tester, "createmarket") try {
 
    GIVEN("no markets exist") {
@@ -742,15 +817,19 @@ TEST_CASE_FIXTURE(eosio_system::exchange_tester, "cancel") try {
 
                CHECK(trade(alice, alice, 0, price, volume, 0) == success());
 
+               // ids are issued by the pairs sequence, starting at 1
+               uint64_t id = get_first_order_id(name("eosbtc"), name("bidorders"));
+               REQUIRE(id == 1);
+
                AND_WHEN("alice cancels the order") {
-                  auto r = cancel(alice, EOS, BTC, alice, 0, 0, 0);
+                  auto r = cancel(alice, EOS, BTC, alice, 0, id, 0);
 
                   THEN("the cancel will succeed") {
                      CHECK(r == success());
                   }
                }
                AND_WHEN("bob cancels the order") {
-                  auto r = cancel(bob, EOS, BTC, alice, 0, 0, 0);
+                  auto r = cancel(bob, EOS, BTC, alice, 0, id, 0);
 
                   THEN("the cancel will fail due to missing alices authority") {
                      CHECK(r == "missing authority of alice");
@@ -7,6 +7,7 @@
 
 #include "mock_eosiolib.hpp"
 #include <token.exchange_base.cpp>
+#include <token.exchange/memory_book.hpp>
 #include <numeric>
 
 using namespace tokenexchange;
@@ -19,21 +20,96 @@ struct exchange_base_mock : eosio::enable_multi_index, tokenexchange::exchange_b
 
 };
 
+// storage policy keeping balances in a separate table, to check the engine only reaches storage through its policy
+struct scratch_storage : tokenexchange::eosio_storage {
+   typedef eosio::multi_index<"scratchaccts"_n, exaccount> exaccounts;
+};
+
+struct scratch_exchange_mock : eosio::enable_multi_index, tokenexchange::basic_exchange_base<scratch_storage> {
+
+   scratch_exchange_mock(eosio::name code)
+   : eosio::enable_multi_index(code)
+   , tokenexchange::basic_exchange_base<scratch_storage>(code) {}
+
+};
+
+struct memory_exchange_mock : eosio::enable_multi_index, tokenexchange::basic_exchange_base<memory_book_storage> {
+
+   memory_exchange_mock(eosio::name code)
+   : eosio::enable_multi_index(code)
+   , tokenexchange::basic_exchange_base<memory_book_storage>(code) {}
+
+   ~memory_exchange_mock() {
+      memory_book_storage::bids::drop(code);
+      memory_book_storage::asks::drop(code);
+   }
+
+};
+
+// storage policy keeping the pre-registry layouts in tables of their own, so old and new rows can be checked side by side
+struct legacy_storage : tokenexchange::eosio_storage {
+   typedef eosio::multi_index<"oldaccounts"_n, exaccount_v1,
+   indexed_by<"bybalance"_n, const_mem_fun<exaccount_v1, uint128_t, &exaccount_v1::by_balance>>
+   > exaccounts_v1;
+   typedef eosio::multi_index<"oldstats"_n, stat_v1> stats_v1;
+   typedef eosio::multi_index<"oldbids"_n, order_v1,
+   indexed_by<"byprice"_n, const_mem_fun<order_v1, uint64_t, &order_v1::by_price>>
+   > bids_v1;
+   typedef eosio::multi_index<"oldasks"_n, order_v1,
+   indexed_by<"byprice"_n, const_mem_fun<order_v1, uint64_t, &order_v1::by_price>>
+   > asks_v1;
+};
+
+struct legacy_exchange_mock : eosio::enable_multi_index, tokenexchange::basic_exchange_base<legacy_storage> {
+
+   legacy_exchange_mock(eosio::name code)
+   : eosio::enable_multi_index(code)
+   , tokenexchange::basic_exchange_base<legacy_storage>(code) {}
+
+};
+
+// EOS/USD pair shared by the engine tests, and its tokens normalized to 8 decimals
+const extended_asset USD = extended_asset(asset(0, symbol("USD",2)), name("usd.token"));
+const extended_asset EOS = extended_asset(asset(0, symbol("EOS",4)), name("eosio.token"));
+const extended_symbol USD_8 = extended_symbol(symbol("USD",8), name("usd.token"));
+const extended_symbol EOS_8 = extended_symbol(symbol("EOS",8), name("eosio.token"));
+
+// price in USD cents, normalized to 8 decimals
+extended_asset price(int64_t cents) {
+   return extended_asset(asset(cents * 1000000, symbol("USD",8)), name("usd.token"));
+}
+
+// volume in whole EOS, normalized to 8 decimals
+extended_asset volume(int64_t eos) {
+   return extended_asset(asset(eos * 100000000, symbol("EOS",8)), name("eosio.token"));
+}
+
+// registers EOS and USD, and creates the USD market with its EOS/USD pair
+template <typename Exchange>
+name create_eos_usd_pair(Exchange& exchange) {
+   exchange.register_token(name("exchange"), name("eosio.token"), symbol("EOS",4));
+   exchange.register_token(name("exchange"), name("usd.token"), symbol("USD",2));
+   exchange.create_market(name("exchange"), USD);
+   exchange.add_market_pair(name("exchange"), exchange.create_market_name(USD), EOS);
+   return exchange.find_market_pair(EOS, USD);
+}
+
 TEST_CASE("test") {
    exchange_base_mock exchange{name("exchange")};
+   exchange.init_contract(false);
 
    // create exchange balance for alice
    exaccounts exchange_accounts( name("exchange"), name("alice").value );
 
-    auto exchange_accounts_by_balance = exchange_accounts.get_index<"bybalance"_n>();
+   uint64_t token_id = exchange.register_token(name("alice"), name("eosio.token"), symbol("EOS",4));
 
    exchange_accounts.emplace(name("exchange"), [&](auto& ex) {
-       ex.account_id = exchange_accounts.available_primary_key();
+       ex.token_id = token_id;
        ex.balance = extended_asset( asset(100000, symbol("EOS",4)), name("eosio.token") );
    });
 
-   auto useraccount = exchange_accounts_by_balance.find( get_token_key(name("eosio.token"), symbol("EOS",4)) );
-   CHECK(useraccount != exchange_accounts_by_balance.end());
+   auto useraccount = exchange_accounts.find( exchange.find_token_id(name("eosio.token"), symbol("EOS",4)) );
+   CHECK(useraccount != exchange_accounts.end());
    CHECK(useraccount->balance.quantity.amount == 100000);
 }
 
@@ -82,6 +158,7 @@ TEST_CASE("adjust_balance") {
    GIVEN("alice does not have an exchange balance") {
       exchange_base_mock exchange{name("exchange")};
       exchange.init_contract(false);
+      exchange.register_token(name("alice"), name("eosio.token"), symbol("EOS",4));
 
       WHEN("adjust_balance is called for alice with a positive delta") {
          name owner = name("alice");
@@ -91,8 +168,7 @@ TEST_CASE("adjust_balance") {
 
          THEN("alice will have a positive exchange balance") {
             exaccounts exchange_accounts( name("exchange"), owner.value );
-            auto exchange_accounts_by_balance = exchange_accounts.get_index<"bybalance"_n>();
-            auto alice_ex_balance = exchange_accounts_by_balance.find( get_token_key(name("eosio.token"), symbol("EOS",4)) );
+            auto alice_ex_balance = exchange_accounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",4)) );
 
             CHECK(alice_ex_balance->balance.quantity.amount == delta.quantity.amount);
 
@@ -100,7 +176,7 @@ TEST_CASE("adjust_balance") {
                exchange.adjust_balance(owner, delta);
 
                THEN("alices' exchange balance will increase") {
-                  auto alice_ex_balance = exchange_accounts_by_balance.find( get_token_key(name("eosio.token"), symbol("EOS",4)) );
+                  auto alice_ex_balance = exchange_accounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",4)) );
 
                   CHECK(alice_ex_balance->balance.quantity.amount == delta.quantity.amount * 2);
 
@@ -108,7 +184,7 @@ TEST_CASE("adjust_balance") {
                      exchange.adjust_balance(owner, -delta);
 
                      THEN("alices' balance will be decreased") {
-                        auto alice_ex_balance = exchange_accounts_by_balance.find( get_token_key(name("eosio.token"), symbol("EOS",4)) );
+                        auto alice_ex_balance = exchange_accounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",4)) );
 
                         CHECK(alice_ex_balance->balance.quantity.amount == delta.quantity.amount);
 
@@ -130,16 +206,75 @@ TEST_CASE("adjust_balance") {
 
          CHECK_THROWS_WITH(exchange.adjust_balance(owner, delta), "exchange balance overdrawn");
       }
+
+      WHEN("adjust_balance is called for a token no deposit has registered") {
+         extended_asset delta = extended_asset( asset(100000000, symbol("ABC",8)), name("abc.token") );
+
+         THEN("no balance or registry entry is written at the normalized precision") {
+            CHECK_THROWS_WITH(exchange.adjust_balance(name("alice"), delta), "token is not registered");
+            CHECK(exchange.find_token_id(name("abc.token"), symbol("ABC",8)) == NO_TOKEN_ID);
+         }
+      }
    }
 
 }
 
+TEST_CASE("register_token") {
+   exchange_base_mock exchange{name("exchange")};
+   exchange.init_contract(false);
+
+   GIVEN("no tokens have been registered") {
+      tokens exchange_tokens( name("exchange"), name("exchange").value );
+
+      CHECK(exchange.find_token_id(name("eosio.token"), symbol("EOS",4)) == NO_TOKEN_ID);
+
+      WHEN("EOS and USD are registered") {
+         uint64_t eos_id = exchange.register_token(name("alice"), name("eosio.token"), symbol("EOS",4));
+         uint64_t usd_id = exchange.register_token(name("bob"), name("usd.token"), symbol("USD",2));
+
+         THEN("each token receives a dense id and keeps its native precision") {
+            CHECK(eos_id == 0);
+            CHECK(usd_id == 1);
+            CHECK(exchange_tokens.find(usd_id)->sym.precision() == 2);
+
+            AND_THEN("registering EOS again returns the same id regardless of precision") {
+               CHECK(exchange.register_token(name("bob"), name("eosio.token"), symbol("EOS",8)) == eos_id);
+               CHECK(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)) == eos_id);
+            }
+            AND_THEN("EOS issued by another contract is a different token") {
+               CHECK(exchange.register_token(name("bob"), name("eosio2.token"), symbol("EOS",4)) == 2);
+            }
+         }
+      }
+
+      WHEN("alice and bob deposit EOS") {
+         exchange.register_token(name("alice"), name("eosio.token"), symbol("EOS",4));
+         extended_asset deposit_EOS = exchange.normalize_precision(extended_asset(asset(10000, symbol("EOS",4)), name("eosio.token")));
+         exchange.adjust_balance(name("alice"), deposit_EOS);
+         exchange.adjust_balance(name("bob"), deposit_EOS);
+
+         THEN("both balances are keyed by the same token id") {
+            uint64_t eos_id = exchange.find_token_id(name("eosio.token"), symbol("EOS",8));
+
+            CHECK(exaccounts(name("exchange"), name("alice").value).find(eos_id)->balance.quantity.amount == deposit_EOS.quantity.amount);
+            CHECK(exaccounts(name("exchange"), name("bob").value).find(eos_id)->balance.quantity.amount == deposit_EOS.quantity.amount);
+         }
+         AND_THEN("the registry keeps the native precision of the deposit") {
+            CHECK(exchange_tokens.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)))->sym.precision() == 4);
+         }
+      }
+   }
+}
+
 TEST_CASE("close_account") {
    exchange_base_mock exchange{name("exchange")};
    name alice = name("alice");
    name bob   = name("bob");
 
    exchange.init_contract(false);
+   // deposits register the tokens at their native precision
+   exchange.register_token(name("exchange"), name("eosio.token"), symbol("EOS",4));
+   exchange.register_token(name("exchange"), name("usd.token"), symbol("USD",2));
 
    GIVEN("alice has 0 USD in her exchange balance") {
       extended_asset deposit_USD = exchange.normalize_precision(extended_asset(asset(0, symbol("USD",2)), name("usd.token")));
@@ -169,6 +304,128 @@ TEST_CASE("close_account") {
 
 }
 
+TEST_CASE("migrate_scope") {
+   legacy_exchange_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name eosusd = name("eosusd");
+
+   exchange.init_contract(false);
+
+   GIVEN("an older deployment left balances, a stats row and orders in the old layouts") {
+      legacy_storage::exaccounts_v1 old_accounts(name("exchange"), alice.value);
+      old_accounts.emplace(alice, [&](auto& exa) { exa.account_id = 0; exa.balance = price(100000); });
+      old_accounts.emplace(alice, [&](auto& exa) { exa.account_id = 1; exa.balance = volume(50); });
+
+      legacy_storage::stats_v1 old_stats(name("exchange"), name("exchange").value);
+      old_stats.emplace(name("exchange"), [&](auto& s) { s.market_name = eosusd; s.price = price(132); });
+
+      legacy_storage::bids_v1 old_bids(name("exchange"), eosusd.value);
+      old_bids.emplace(alice, [&](auto& o) {
+         o.id = 0;
+         o.trader = alice;
+         o.timestamp = "2019-05-26T10:10:00"_tp;
+         o.price = price(140);
+         o.volume = volume(2);
+      });
+
+      WHEN("the tokens are registered at their native precision and each scope is migrated") {
+         exchange.register_token(name("exchange"), name("eosio.token"), symbol("EOS",4));
+         exchange.register_token(name("exchange"), name("usd.token"), symbol("USD",2));
+         exchange.migrate_scope(alice);
+         exchange.migrate_scope(eosusd);
+         exchange.migrate_scope(name("exchange"));
+
+         THEN("balances are keyed by token id and the old rows are gone") {
+            CHECK(exchange.get_balance(alice, USD_8) == price(100000).quantity.amount);
+            CHECK(exchange.get_balance(alice, EOS_8) == volume(50).quantity.amount);
+            CHECK(old_accounts.begin() == old_accounts.end());
+         }
+         AND_THEN("the last price carries over") {
+            stats exchange_stats(name("exchange"), name("exchange").value);
+            CHECK(exchange_stats.get(eosusd.value).price.quantity.amount == price(132).quantity.amount);
+            CHECK(old_stats.begin() == old_stats.end());
+         }
+         AND_THEN("orders keep their id and place, with the new fields at their defaults") {
+            bids bid_orders(name("exchange"), eosusd.value);
+            const order& o = bid_orders.get(0);
+            CHECK(o.trader == alice);
+            CHECK(o.volume.quantity.amount == volume(2).quantity.amount);
+            CHECK(o.orig_qty == volume(2).quantity.amount);
+            CHECK(o.filled_qty == 0);
+            CHECK(o.hidden == 0);
+            CHECK(o.expiration == time_point());
+            CHECK(old_bids.begin() == old_bids.end());
+         }
+         AND_THEN("a scope cannot be migrated twice") {
+            CHECK_THROWS_WITH(exchange.migrate_scope(alice), "scope is already migrated");
+         }
+      }
+
+      WHEN("a balance is migrated before its token is registered") {
+         THEN("the migration is refused") {
+            CHECK_THROWS_WITH(exchange.migrate_scope(alice), "token is not registered");
+         }
+      }
+   }
+}
+
+TEST_CASE("withdraw_balances") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+
+   exchange.init_contract(false);
+
+   GIVEN("alice has 10 EOS and 5 BTC in her exchange account") {
+      exchange.register_token(alice, name("eosio.token"), symbol("EOS",4));
+      exchange.register_token(alice, name("btc.token"), symbol("BTC",8));
+      exchange.adjust_balance(alice, exchange.normalize_precision(extended_asset(asset(100000, symbol("EOS",4)), name("eosio.token"))));
+      exchange.adjust_balance(alice, extended_asset(asset(500000000, symbol("BTC",8)), name("btc.token")));
+
+      extended_symbol BTC_8 = extended_symbol(symbol("BTC",8), name("btc.token"));
+
+      WHEN("alice withdraws 2 EOS, 1 BTC and 3 more EOS in one request") {
+         auto transfers = exchange.withdraw_balances(alice, {
+            extended_asset(asset(20000, symbol("EOS",4)), name("eosio.token")),
+            extended_asset(asset(100000000, symbol("BTC",8)), name("btc.token")),
+            extended_asset(asset(30000, symbol("EOS",4)), name("eosio.token"))
+         });
+
+         THEN("both EOS amounts are coalesced into a single transfer") {
+            REQUIRE(transfers.size() == 2);
+            CHECK(transfers[0].contract == name("btc.token"));
+            CHECK(transfers[0].quantity.amount == 100000000);
+            CHECK(transfers[1].contract == name("eosio.token"));
+            CHECK(transfers[1].quantity.amount == 50000);
+            CHECK(transfers[1].quantity.symbol.precision() == 4);
+
+            AND_THEN("each balance is debited by the total requested") {
+               CHECK(exchange.get_balance(alice, EOS_8) == 500000000);
+               CHECK(exchange.get_balance(alice, BTC_8) == 400000000);
+            }
+         }
+      }
+
+      WHEN("alice withdraws 6 EOS twice in one request") {
+         CHECK_THROWS_WITH(exchange.withdraw_balances(alice, {
+            extended_asset(asset(60000, symbol("EOS",4)), name("eosio.token")),
+            extended_asset(asset(60000, symbol("EOS",4)), name("eosio.token"))
+         }), "exchange balance overdrawn");
+      }
+
+      WHEN("alice withdraws a token she never deposited") {
+         CHECK_THROWS_WITH(exchange.withdraw_balances(alice, {
+            extended_asset(asset(100, symbol("USD",2)), name("usd.token"))
+         }), "exchange balance overdrawn");
+      }
+
+      WHEN("alice withdraws a negative amount") {
+         CHECK_THROWS_WITH(exchange.withdraw_balances(alice, {
+            extended_asset(asset(-1, symbol("EOS",4)), name("eosio.token"))
+         }), "cannot withdraw negative balance");
+      }
+   }
+}
+
 TEST_CASE("normalize_precision") {
    exchange_base_mock exchange{name("exchange")};
 
@@ -447,11 +704,50 @@ TEST_CASE("calculate_volume") {
 
 }
 
+TEST_CASE("fixed_point") {
+   static_assert( !std::is_same_v<price_t<8>, qty_t<8>>, "prices and quantities are different types" );
+   static_assert( !std::is_invocable_v<std::plus<>, qty_t<8>, qty_t<4>>, "precisions do not mix" );
+   static_assert( qty_t<8>::scale == 100000000 );
+
+   GIVEN("a price of 1.32 and a volume of 1.5") {
+      price_t<> price( 132000000 );
+      qty_t<4>  volume( 15000 );
+
+      THEN("the quote quantity is 1.98 in the price precision") {
+         CHECK((price * volume).value == 198000000);
+         CHECK((price * volume.rescale<8>()).value == 198000000);
+      }
+      AND_THEN("1.98 quote pays for 1.5 base") {
+         CHECK(base_volume<4>(qty_t<>(198000000), price).value == 15000);
+         CHECK(base_volume<8>(qty_t<>(100000000), price).value == 75757575);   // truncated
+      }
+      AND_THEN("rescaling truncates extra decimals") {
+         CHECK(qty_t<8>(123456789).rescale<4>() == qty_t<4>(12345));
+         CHECK(qty_t<8>(123456789).to_decimals(4) == 12345);
+         CHECK(qty_t<8>::from_decimals(15000, 4) == qty_t<8>(150000000));
+      }
+      AND_THEN("ratios and averages multiply before dividing") {
+         CHECK(scale_by(qty_t<>(198000000), 30, 10000).value == 594000);
+         CHECK(scale_by_ceil(qty_t<>(1), 1, 3).value == 1);
+         CHECK(average_price(price_t<>(130000000), qty_t<>(2), price_t<>(140000000), qty_t<>(3)).value == 136000000);
+      }
+      AND_THEN("running totals accumulate in place") {
+         qty_t<4> total = volume;
+         total += volume;
+         total -= qty_t<4>(5000);
+         CHECK(total == qty_t<4>(25000));
+      }
+   }
+}
+
 TEST_CASE("place_bid_order") {
    exchange_base_mock exchange{name("exchange")};
    name bob = name("bob");
 
    exchange.init_contract(false);
+   // deposits register the tokens at their native precision
+   exchange.register_token(name("exchange"), name("eosio.token"), symbol("EOS",4));
+   exchange.register_token(name("exchange"), name("usd.token"), symbol("USD",2));
 
    GIVEN("bob has 50 EOS in his exchange account and the EOS/USD market is created") {
       extended_asset USD = extended_asset(asset(0,symbol("USD",2)), name("usd.token"));
@@ -480,14 +776,14 @@ TEST_CASE("place_bid_order") {
             CHECK(order->volume.quantity.amount == volume.quantity.amount);
 
             AND_THEN("the exchanges' EOS balance increases by the BID volume") {
-               auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value).get_index<"bybalance"_n>();
-               auto exchange_ex_balance = exchange_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+               auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value);
+               auto exchange_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
 
                CHECK(exchange_ex_balance->balance.quantity.amount == volume.quantity.amount);
 
                AND_THEN("bobs' exchange EOS balance decreases by the BID volume") {
-                  auto bob_exaccounts = exaccounts(name("exchange"), bob.value).get_index<"bybalance"_n>();
-                  auto bob_ex_balance = bob_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+                  auto bob_exaccounts = exaccounts(name("exchange"), bob.value);
+                  auto bob_ex_balance = bob_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
 
                   CHECK(bob_ex_balance->balance.quantity.amount == (deposit_EOS - volume).quantity.amount);
                }
@@ -502,6 +798,9 @@ TEST_CASE("place_ask_order") {
    name alice = name("alice");
 
    exchange.init_contract(false);
+   // deposits register the tokens at their native precision
+   exchange.register_token(name("exchange"), name("eosio.token"), symbol("EOS",4));
+   exchange.register_token(name("exchange"), name("usd.token"), symbol("USD",2));
 
    GIVEN("alice has 500 USD in her exchange account and the EOS/USD market exists") {
       extended_asset USD = extended_asset(asset(0,symbol("USD",2)), name("usd.token"));
@@ -531,14 +830,14 @@ TEST_CASE("place_ask_order") {
             CHECK(order->volume.quantity.amount == volume.quantity.amount);
 
             AND_THEN("the exchanges' USD balance increases by the ASK volume") {
-               auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value).get_index<"bybalance"_n>();
-               auto exchange_ex_balance = exchange_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+               auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value);
+               auto exchange_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                CHECK(exchange_ex_balance->balance.quantity.amount == exchange.calculate_volume(price, volume).quantity.amount);
 
                AND_THEN("alices' exchange USD balance decreases by the ASK volume") {
-                  auto alice_exaccounts = exaccounts(name("exchange"), alice.value).get_index<"bybalance"_n>();
-                  auto alice_ex_balance = alice_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+                  auto alice_exaccounts = exaccounts(name("exchange"), alice.value);
+                  auto alice_ex_balance = alice_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                   CHECK(alice_ex_balance->balance.quantity.amount == (deposit_USD - exchange.calculate_volume(price, volume)).quantity.amount);
                }
@@ -665,6 +964,9 @@ TEST_CASE("match_orders") {
    name bob   = name("bob");
 
    exchange.init_contract(false);
+   // deposits register the tokens at their native precision
+   exchange.register_token(name("exchange"), name("eosio.token"), symbol("EOS",4));
+   exchange.register_token(name("exchange"), name("usd.token"), symbol("USD",2));
 
    GIVEN("bob has 50 EOS deposited, alice has 500 USD deposited, and the EOS/USD market is created") {
       extended_asset USD = extended_asset(asset(0,symbol("USD",2)), name("usd.token"));
@@ -683,9 +985,9 @@ TEST_CASE("match_orders") {
       exchange.adjust_balance(bob, deposit_EOS);
 
       // Tables
-      auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value).get_index<"bybalance"_n>();
-      auto alice_exaccounts = exaccounts(name("exchange"), alice.value).get_index<"bybalance"_n>();
-      auto bob_exaccounts = exaccounts(name("exchange"), bob.value).get_index<"bybalance"_n>();
+      auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value);
+      auto alice_exaccounts = exaccounts(name("exchange"), alice.value);
+      auto bob_exaccounts = exaccounts(name("exchange"), bob.value);
 
       /*
       Scenerio 1 Partial Fill
@@ -737,7 +1039,7 @@ TEST_CASE("match_orders") {
                                                                       exchange.calculate_volume(bid_price, bid_volume)
                                                                       -
                                                                       (exchange.calculate_volume(ask_price, bid_volume) - exchange.calculate_volume(bid_price, bid_volume));
-                  auto exchange_USD_ex_balance = exchange_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+                  auto exchange_USD_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                   CHECK(exchange_USD_ex_balance->balance.quantity.amount == exchanges_remaining_USD_ex_balance.quantity.amount);  // 792000000
                   CHECK(exchange_USD_ex_balance->balance.get_extended_symbol().get_symbol().code() == exchanges_remaining_USD_ex_balance.get_extended_symbol().get_symbol().code());
@@ -751,7 +1053,7 @@ TEST_CASE("match_orders") {
                                                                       exchange.calculate_volume(bid_price, bid_volume)
                                                                       -
                                                                       exchange.calculate_volume(ask_price, ask_volume - bid_volume);
-                     auto alice_USD_ex_balance = alice_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+                     auto alice_USD_ex_balance = alice_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                      CHECK(alice_USD_ex_balance->balance.quantity.amount == alices_remaining_USD_ex_balance.quantity.amount); // 48684000000
                      CHECK(alice_USD_ex_balance->balance.get_extended_symbol().get_symbol().code() == alices_remaining_USD_ex_balance.get_extended_symbol().get_symbol().code());
@@ -759,7 +1061,7 @@ TEST_CASE("match_orders") {
                      // 1.31 USD/EOS * 4 EOS = 5.24 USD
                      AND_THEN("bobs' USD balance will increase by 5.24 USD") {
                         extended_asset bobs_payout_USD_ex_balance = exchange.calculate_volume(bid_price, bid_volume);
-                        auto bob_USD_ex_balance = bob_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+                        auto bob_USD_ex_balance = bob_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                         CHECK(bob_USD_ex_balance->balance.quantity.amount == bobs_payout_USD_ex_balance.quantity.amount);  // 524000000
                         CHECK(bob_USD_ex_balance->balance.get_extended_symbol().get_symbol().code() == bobs_payout_USD_ex_balance.get_extended_symbol().get_symbol().code());
@@ -767,13 +1069,13 @@ TEST_CASE("match_orders") {
                         // CHECK EOS BALANCES //
 
                         AND_THEN("the exchanges EOS balance will be zero") {
-                           auto exchanges_remaining_EOS_ex_balance = exchange_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+                           auto exchanges_remaining_EOS_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
 
                            CHECK(exchanges_remaining_EOS_ex_balance->balance.quantity.amount == 0);
                            CHECK(exchanges_remaining_EOS_ex_balance->balance.get_extended_symbol().get_symbol().code() == bid_volume.get_extended_symbol().get_symbol().code());
 
                            AND_THEN("alices' EOS balance will increase by 4 EOS") {
-                              auto alice_EOS_ex_balance = alice_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+                              auto alice_EOS_ex_balance = alice_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
 
                               CHECK(alice_EOS_ex_balance->balance.quantity.amount == bid_volume.quantity.amount); // 400000000
                               CHECK(alice_EOS_ex_balance->balance.get_extended_symbol().get_symbol().code() == bid_volume.get_extended_symbol().get_symbol().code());
@@ -849,7 +1151,7 @@ TEST_CASE("match_orders") {
                                                                       exchange.calculate_volume(bid_price_1, ask_volume)
                                                                       -
                                                                       (exchange.calculate_volume(ask_price, ask_volume) - exchange.calculate_volume(bid_price_1, ask_volume));
-                  auto exchange_USD_ex_balance = exchange_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+                  auto exchange_USD_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                   CHECK(exchange_USD_ex_balance->balance.quantity.amount == exchanges_remaining_USD_ex_balance.quantity.amount);  // 0.00000000 USD
                   CHECK(exchange_USD_ex_balance->balance.get_extended_symbol().get_symbol().code() == exchanges_remaining_USD_ex_balance.get_extended_symbol().get_symbol().code());
@@ -861,7 +1163,7 @@ TEST_CASE("match_orders") {
                      extended_asset alices_remaining_USD_ex_balance = deposit_USD
                                                                       -
                                                                       exchange.calculate_volume(bid_price_1, ask_volume);
-                     auto alice_USD_ex_balance = alice_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+                     auto alice_USD_ex_balance = alice_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                      CHECK(alice_USD_ex_balance->balance.quantity.amount == alices_remaining_USD_ex_balance.quantity.amount); // 48690000000 USD
                      CHECK(alice_USD_ex_balance->balance.get_extended_symbol().get_symbol().code() == alices_remaining_USD_ex_balance.get_extended_symbol().get_symbol().code());
@@ -869,7 +1171,7 @@ TEST_CASE("match_orders") {
                      // 1.31 USD/EOS * 10 EOS = 13.10 USD
                      AND_THEN("bobs' USD balance will increase by 13.10 USD") {
                         extended_asset bobs_payout_USD_ex_balance = exchange.calculate_volume(bid_price_1, ask_volume);
-                        auto bob_USD_ex_balance = bob_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+                        auto bob_USD_ex_balance = bob_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                         CHECK(bob_USD_ex_balance->balance.quantity.amount == bobs_payout_USD_ex_balance.quantity.amount);  // 1310000000 USD
                         CHECK(bob_USD_ex_balance->balance.get_extended_symbol().get_symbol().code() == bobs_payout_USD_ex_balance.get_extended_symbol().get_symbol().code());
@@ -877,13 +1179,13 @@ TEST_CASE("match_orders") {
                         // CHECK EOS BALANCES //
 
                         AND_THEN("the exchanges EOS balance will be 1 EOS") {
-                           auto exchanges_remaining_EOS_ex_balance = exchange_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+                           auto exchanges_remaining_EOS_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
 
                            CHECK(exchanges_remaining_EOS_ex_balance->balance.quantity.amount == bid->volume.quantity.amount); // 100000000 USD
                            CHECK(exchanges_remaining_EOS_ex_balance->balance.get_extended_symbol().get_symbol().code() == bid->volume.get_extended_symbol().get_symbol().code());
 
                            AND_THEN("alices' EOS balance will increase by 10 EOS") {
-                              auto alice_EOS_ex_balance = alice_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+                              auto alice_EOS_ex_balance = alice_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
 
                               CHECK(alice_EOS_ex_balance->balance.quantity.amount == ask_volume.quantity.amount); // 1000000000 EOS
                               CHECK(alice_EOS_ex_balance->balance.get_extended_symbol().get_symbol().code() == ask_volume.get_extended_symbol().get_symbol().code());
@@ -905,6 +1207,9 @@ TEST_CASE("cancel_order") {
    name bob   = name("bob");
 
    exchange.init_contract(false);
+   // deposits register the tokens at their native precision
+   exchange.register_token(name("exchange"), name("eosio.token"), symbol("EOS",4));
+   exchange.register_token(name("exchange"), name("usd.token"), symbol("USD",2));
 
    GIVEN("The EOS/USD market does not exists, and alice has USD and bob has EOS deposited") {
       extended_asset USD = extended_asset(asset(0,symbol("USD",2)), name("usd.token"));
@@ -943,13 +1248,13 @@ TEST_CASE("cancel_order") {
          exchange.place_bid_order(bob, price, volume, "2019-05-26T10:10:00"_tp, 1);
 
          // bob exchange balance EOS
-         auto bob_exaccounts = exaccounts(name("exchange"), bob.value).get_index<"bybalance"_n>();
-         auto bob_ex_balance = bob_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+         auto bob_exaccounts = exaccounts(name("exchange"), bob.value);
+         auto bob_ex_balance = bob_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
          CHECK(bob_ex_balance->balance.quantity.amount == (deposit_EOS.quantity.amount - volume.quantity.amount));
 
          // exchanges exchange balance = 100 EOS
-         auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value).get_index<"bybalance"_n>();
-         auto exchange_ex_balance = exchange_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+         auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value);
+         auto exchange_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
          CHECK(exchange_ex_balance->balance.quantity.amount == volume.quantity.amount);
 
          AND_WHEN("bob cancels the order") {
@@ -957,12 +1262,12 @@ TEST_CASE("cancel_order") {
 
             THEN("the exchange balance is returned to bob") {
                // alices exchange balance = 500 USD
-               exchange_ex_balance = bob_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+               exchange_ex_balance = bob_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
 
                CHECK(bob_ex_balance->balance.quantity.amount == deposit_EOS.quantity.amount);
 
                // exchanges exchange balance
-               exchange_ex_balance = exchange_exaccounts.find(get_token_key(name("eosio.token"), symbol("EOS",8)));
+               exchange_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("eosio.token"), symbol("EOS",8)));
                CHECK(exchange_ex_balance->balance.quantity.amount == 0);
             }
          }
@@ -976,13 +1281,13 @@ TEST_CASE("cancel_order") {
          exchange.place_ask_order(alice, price, volume, "2019-05-26T10:10:00"_tp, 1);
 
          // alices exchange balance USD
-         auto alice_exaccounts = exaccounts(name("exchange"), alice.value).get_index<"bybalance"_n>();
-         auto alice_ex_balance = alice_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+         auto alice_exaccounts = exaccounts(name("exchange"), alice.value);
+         auto alice_ex_balance = alice_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
          CHECK(alice_ex_balance->balance.quantity.amount == (deposit_USD.quantity.amount - exchange.calculate_volume(price, volume).quantity.amount));
 
          // exchanges exchange balance = 350 USD
-         auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value).get_index<"bybalance"_n>();
-         auto exchange_ex_balance = exchange_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+         auto exchange_exaccounts = exaccounts(name("exchange"), name("exchange").value);
+         auto exchange_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
          CHECK(exchange_ex_balance->balance.quantity.amount == exchange.calculate_volume(price, volume).quantity.amount);
 
          AND_WHEN("alice cancels the order") {
@@ -990,15 +1295,1674 @@ TEST_CASE("cancel_order") {
 
             THEN("the exchange balance is returned to alice") {
                // alices exchange balance = 500 USD
-               alice_ex_balance = alice_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+               alice_ex_balance = alice_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
 
                CHECK(alice_ex_balance->balance.quantity.amount == 50000000000);
 
                // exchanges exchange balance
-               exchange_ex_balance = exchange_exaccounts.find(get_token_key(name("usd.token"), symbol("USD",8)));
+               exchange_ex_balance = exchange_exaccounts.find(exchange.find_token_id(name("usd.token"), symbol("USD",8)));
                CHECK(exchange_ex_balance->balance.quantity.amount == 0);
             }
          }
       }
    }
 }
+
+TEST_CASE("parse_trade_memo") {
+   trade_instruction instruction;
+
+   GIVEN("a memo that is not a trade instruction") {
+      CHECK(parse_trade_memo("deposit", instruction) == false);
+      CHECK(parse_trade_memo("", instruction) == false);
+      CHECK(parse_trade_memo("trade", instruction) == false);
+   }
+
+   GIVEN("a trade memo with only the required fields") {
+      CHECK(parse_trade_memo("trade:eosusd:0:1.31", instruction) == true);
+
+      CHECK(instruction.market_name == name("eosusd"));
+      CHECK(instruction.order_type == BID);
+      CHECK(instruction.price == 131000000);
+      CHECK(instruction.immediate_or_cancel == false);
+      CHECK(instruction.withdraw == false);
+   }
+
+   GIVEN("a trade memo with ioc and withdraw flags") {
+      CHECK(parse_trade_memo("trade:eosusd:1:2:1:1", instruction) == true);
+
+      CHECK(instruction.order_type == ASK);
+      CHECK(instruction.price == 200000000);
+      CHECK(instruction.immediate_or_cancel == true);
+      CHECK(instruction.withdraw == true);
+   }
+
+   GIVEN("malformed trade memos") {
+      CHECK_THROWS_WITH(parse_trade_memo("trade:eosusd:2:1.31", instruction), "invalid trade memo: order type must be 0 or 1");
+      CHECK_THROWS_WITH(parse_trade_memo("trade:eosusd:0:1.3.1", instruction), "invalid trade memo: malformed price");
+      CHECK_THROWS_WITH(parse_trade_memo("trade:eosusd:0:", instruction), "invalid trade memo: missing price");
+      CHECK_THROWS_WITH(parse_trade_memo("trade:eosusd:0:0.123456789", instruction), "only supports precision up to 8 decimals");
+      CHECK_THROWS_WITH(parse_trade_memo("trade:eosusd:0:1:yes", instruction), "invalid trade memo: flags must be 0 or 1");
+      CHECK_THROWS_WITH(parse_trade_memo("trade:eosusd:0:1:0:0:0", instruction), "invalid trade memo: too many fields");
+   }
+}
+
+TEST_CASE("deposit_and_trade") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("the EOS/USD market exists and bob has a BID to sell 4 EOS @ 1.31 USD") {
+      create_eos_usd_pair(exchange);
+
+      extended_asset bid_price  = exchange.normalize_precision(extended_asset(asset(  131, symbol("USD",2)), name("usd.token")));
+      extended_asset bid_volume = exchange.normalize_precision(extended_asset(asset(40000, symbol("EOS",4)), name("eosio.token")));
+      exchange.adjust_balance(bob, bid_volume);
+      exchange.place_bid_order(bob, bid_price, bid_volume, "2019-05-26T10:10:00"_tp, 0);
+
+      WHEN("alice transfers 10.00 USD with memo trade:eosusd:1:1.32") {
+         extended_asset deposit = exchange.normalize_precision(extended_asset(asset(1000, symbol("USD",2)), name("usd.token")));
+         trade_instruction instruction;
+         parse_trade_memo("trade:eosusd:1:1.32", instruction);
+
+         exchange.deposit_and_trade(alice, deposit, instruction, "2019-05-26T10:10:01"_tp);
+         auto payouts = exchange.collect_payouts();
+
+         THEN("alice buys 4 EOS and the rest of her order rests on the book") {
+            // 10.00 USD / 1.32 = 7.57575757 EOS, costing 9.99999999 USD
+            CHECK(payouts.empty());
+            CHECK(exchange.get_balance(alice, EOS_8) == 400000000);
+
+            asks ask_orders(name("exchange"), name("eosusd").value);
+            CHECK(ask_orders.begin()->volume.quantity.amount == 757575757 - 400000000);
+
+            AND_THEN("alice keeps the refund from the better price and the unspendable change") {
+               // (1.32 - 1.31) * 4 EOS + 0.00000001 USD change
+               CHECK(exchange.get_balance(alice, USD_8) == 4000000 + 1);
+            }
+         }
+      }
+
+      WHEN("alice transfers 10.00 USD with memo trade:eosusd:1:1.32:1:1") {
+         extended_asset deposit = exchange.normalize_precision(extended_asset(asset(1000, symbol("USD",2)), name("usd.token")));
+         trade_instruction instruction;
+         parse_trade_memo("trade:eosusd:1:1.32:1:1", instruction);
+
+         exchange.deposit_and_trade(alice, deposit, instruction, "2019-05-26T10:10:01"_tp);
+         auto payouts = exchange.collect_payouts();
+
+         THEN("the unfilled remainder is cancelled and everything is sent back to alice") {
+            asks ask_orders(name("exchange"), name("eosusd").value);
+            CHECK(ask_orders.begin() == ask_orders.end());
+
+            REQUIRE(payouts.size() == 2);
+            CHECK(payouts[0].first == alice);
+            CHECK(payouts[0].second.contract == name("eosio.token"));
+            CHECK(payouts[0].second.quantity.amount == 40000);   // 4.0000 EOS
+            CHECK(payouts[0].second.quantity.symbol.precision() == 4);
+            CHECK(payouts[1].first == alice);
+            CHECK(payouts[1].second.contract == name("usd.token"));
+            CHECK(payouts[1].second.quantity.amount == 476);     // 10.00 - 5.24 USD
+            CHECK(payouts[1].second.quantity.symbol.precision() == 2);
+
+            AND_THEN("alice only keeps sub-cent dust on the exchange") {
+               CHECK(exchange.get_balance(alice, EOS_8) == 0);
+               CHECK(exchange.get_balance(alice, USD_8) < 1000000);
+            }
+         }
+      }
+
+      WHEN("alice transfers EOS with a memo to buy EOS") {
+         extended_asset deposit = exchange.normalize_precision(extended_asset(asset(10000, symbol("EOS",4)), name("eosio.token")));
+         trade_instruction instruction;
+         parse_trade_memo("trade:eosusd:1:1.32", instruction);
+
+         CHECK_THROWS_WITH(exchange.deposit_and_trade(alice, deposit, instruction, "2019-05-26T10:10:01"_tp), "transfer does not match the market pair");
+      }
+   }
+}
+
+TEST_CASE("collect_payouts") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name carol = name("carol");
+
+   exchange.init_contract(false);
+
+   GIVEN("bob and carol each have a BID to sell EOS for USD") {
+      create_eos_usd_pair(exchange);
+
+      extended_asset price      = exchange.normalize_precision(extended_asset(asset(  131, symbol("USD",2)), name("usd.token")));
+      extended_asset bob_EOS    = exchange.normalize_precision(extended_asset(asset(40000, symbol("EOS",4)), name("eosio.token")));
+      extended_asset carol_EOS  = exchange.normalize_precision(extended_asset(asset(30000, symbol("EOS",4)), name("eosio.token")));
+      exchange.adjust_balance(bob, bob_EOS);
+      exchange.adjust_balance(carol, carol_EOS);
+      exchange.place_bid_order(bob, price, bob_EOS, "2019-05-26T10:10:00"_tp, 0);
+      exchange.place_bid_order(carol, price, carol_EOS, "2019-05-26T10:10:01"_tp, 0);
+
+      WHEN("alice auto withdraws an ASK for 7 EOS @ 1.32 USD that fills against both BIDs") {
+         extended_asset ask_price  = exchange.normalize_precision(extended_asset(asset(  132, symbol("USD",2)), name("usd.token")));
+         extended_asset ask_volume = exchange.normalize_precision(extended_asset(asset(70000, symbol("EOS",4)), name("eosio.token")));
+         exchange.adjust_balance(alice, exchange.calculate_volume(ask_price, ask_volume));
+
+         exchange.auto_withdraw_accounts.insert(alice);
+         exchange.place_ask_order(alice, ask_price, ask_volume, "2019-05-26T10:10:02"_tp, 0);
+         auto payouts = exchange.collect_payouts();
+
+         THEN("alice receives one transfer per token for what actually filled") {
+            REQUIRE(payouts.size() == 2);
+            CHECK(payouts[0].first == alice);
+            CHECK(payouts[0].second.quantity.amount == 70000);   // 7.0000 EOS from both fills
+            CHECK(payouts[1].first == alice);
+            CHECK(payouts[1].second.quantity.amount == 7);       // (1.32 - 1.31) * 7 EOS price improvement
+
+            AND_THEN("alices' exchange balances are never credited") {
+               CHECK(exchange.get_balance(alice, EOS_8) == 0);
+               CHECK(exchange.get_balance(alice, USD_8) == 0);
+            }
+            AND_THEN("the makers are credited on the exchange as usual") {
+               CHECK(exchange.get_balance(bob, USD_8) == 524000000);
+               CHECK(exchange.get_balance(carol, USD_8) == 393000000);
+            }
+            AND_THEN("nothing is left to pay out") {
+               CHECK(exchange.collect_payouts().empty());
+            }
+         }
+      }
+   }
+}
+
+TEST_CASE("clear_auction") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name carol = name("carol");
+   name dave  = name("dave");
+
+   exchange.init_contract(false);
+
+   GIVEN("the EOS/USD market pair is in batch auction mode") {
+      create_eos_usd_pair(exchange);
+
+      CHECK_THROWS_WITH(exchange.clear_auction(EOS, USD, "2019-05-26T10:11:00"_tp), "market pair is not in batch auction mode");
+      CHECK_THROWS_WITH(exchange.set_matching_mode(EOS, USD, 3, "2019-05-26T10:09:00"_tp), "invalid matching mode");
+      exchange.set_matching_mode(EOS, USD, BATCH_AUCTION, "2019-05-26T10:09:00"_tp);
+
+      exchange.adjust_balance(bob, volume(4));
+      exchange.adjust_balance(carol, volume(4));
+      exchange.adjust_balance(alice, exchange.calculate_volume(price(136), volume(6)));
+      exchange.adjust_balance(dave, exchange.calculate_volume(price(131), volume(4)));
+
+      /*
+      | Buy/Sell | Trader | Price (USD) | Volume (EOS) |
+      |----------|--------|-------------|--------------|
+      | Sell     | bob    | 1.30        | 4            |
+      | Sell     | carol  | 1.34        | 4            |
+      | Buy      | alice  | 1.36        | 6            |
+      | Buy      | dave   | 1.31        | 4            |
+
+      Supply and demand intersect after 6 EOS, between carol @ 1.34 and alice @ 1.36.
+      */
+      exchange.place_bid_order(bob, price(130), volume(4), "2019-05-26T10:10:00"_tp, 1);
+      exchange.place_bid_order(carol, price(134), volume(4), "2019-05-26T10:10:01"_tp, 2);
+      exchange.place_ask_order(alice, price(136), volume(6), "2019-05-26T10:10:02"_tp, 3);
+      exchange.place_ask_order(dave, price(131), volume(4), "2019-05-26T10:10:03"_tp, 4);
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+
+      THEN("crossing orders rest until the auction is cleared") {
+         CHECK(bid_orders.find(1) != bid_orders.end());
+         CHECK(ask_orders.find(3) != ask_orders.end());
+      }
+
+      WHEN("anyone clears the auction") {
+         exchange.clear_auction(EOS, USD, "2019-05-26T10:11:00"_tp);
+
+         THEN("6 EOS trade at the uniform clearing price of 1.35 USD") {
+            CHECK(exchange.get_balance(bob, USD_8) == 540000000);     // 4 * 1.35
+            CHECK(exchange.get_balance(carol, USD_8) == 270000000);   // 2 * 1.35
+            CHECK(exchange.get_balance(alice, EOS_8) == 600000000);
+            CHECK(exchange.get_balance(alice, USD_8) == 6000000);     // (1.36 - 1.35) * 6 refund
+            CHECK(exchange.get_balance(dave, EOS_8) == 0);
+
+            auto market_stats = stats(name("exchange"), name("exchange").value).find(name("eosusd").value);
+            CHECK(market_stats->price.quantity.amount == 135);
+         }
+         AND_THEN("filled orders are removed and the rest stay on the book") {
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(bid_orders.find(2)->volume.quantity.amount == volume(2).quantity.amount);
+            CHECK(ask_orders.find(3) == ask_orders.end());
+            CHECK(ask_orders.find(4)->volume.quantity.amount == volume(4).quantity.amount);
+         }
+         AND_THEN("the exchange only escrows the resting orders") {
+            CHECK(exchange.get_balance(name("exchange"), EOS_8) == 200000000);
+            CHECK(exchange.get_balance(name("exchange"), USD_8) == 524000000);   // 4 * 1.31
+         }
+         AND_THEN("there is nothing left to clear") {
+            CHECK_THROWS_WITH(exchange.clear_auction(EOS, USD, "2019-05-26T10:11:00"_tp), "no crossing orders to clear");
+         }
+      }
+   }
+}
+
+TEST_CASE("match_pro_rata") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name carol = name("carol");
+
+   exchange.init_contract(false);
+
+   GIVEN("the EOS/USD market pair is in pro-rata mode with 8 EOS resting @ 1.30 USD") {
+      create_eos_usd_pair(exchange);
+      exchange.set_matching_mode(EOS, USD, PRO_RATA, "2019-05-26T10:09:00"_tp);
+
+      exchange.adjust_balance(bob, volume(6));
+      exchange.adjust_balance(carol, volume(2));
+      exchange.place_bid_order(bob, price(130), volume(6), "2019-05-26T10:10:00"_tp, 1);
+      exchange.place_bid_order(carol, price(130), volume(2), "2019-05-26T10:10:01"_tp, 2);
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+
+      WHEN("alice places an ASK for 4 EOS @ 1.31 USD") {
+         exchange.adjust_balance(alice, exchange.calculate_volume(price(131), volume(4)));
+         exchange.place_ask_order(alice, price(131), volume(4), "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("the fill is split across the level in proportion to each order") {
+            CHECK(bid_orders.find(1)->volume.quantity.amount == volume(3).quantity.amount);
+            CHECK(bid_orders.find(2)->volume.quantity.amount == volume(1).quantity.amount);
+            CHECK(ask_orders.find(3) == ask_orders.end());
+
+            CHECK(exchange.get_balance(bob, USD_8) == 390000000);     // 3 * 1.30
+            CHECK(exchange.get_balance(carol, USD_8) == 130000000);   // 1 * 1.30
+            CHECK(exchange.get_balance(alice, EOS_8) == 400000000);
+            CHECK(exchange.get_balance(alice, USD_8) == 4000000);     // (1.31 - 1.30) * 4 refund
+         }
+         AND_THEN("each maker fill is recorded as its own trade") {
+            recenttrades trades(name("exchange"), name("eosusd").value);
+            auto by_sequence = trades.get_index<"bysequence"_n>();
+            auto trade = by_sequence.rbegin();
+            REQUIRE(trade != by_sequence.rend());
+            CHECK(trade->volume.quantity.amount == volume(1).quantity.amount);
+            ++trade;
+            REQUIRE(trade != by_sequence.rend());
+            CHECK(trade->volume.quantity.amount == volume(3).quantity.amount);
+            CHECK(++trade == by_sequence.rend());
+         }
+         AND_THEN("the exchange only escrows the resting volume") {
+            CHECK(exchange.get_balance(name("exchange"), EOS_8) == 400000000);
+            CHECK(exchange.get_balance(name("exchange"), USD_8) == 0);
+         }
+      }
+
+      WHEN("alice places an ASK for 10 EOS @ 1.30 USD") {
+         exchange.adjust_balance(alice, exchange.calculate_volume(price(130), volume(10)));
+         exchange.place_ask_order(alice, price(130), volume(10), "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("the whole level fills and the rest of the ASK rests") {
+            CHECK(bid_orders.begin() == bid_orders.end());
+            CHECK(ask_orders.find(3)->volume.quantity.amount == volume(2).quantity.amount);
+            CHECK(exchange.get_balance(alice, EOS_8) == 800000000);
+         }
+      }
+
+      WHEN("rounding leaves units over") {
+         exchange.adjust_balance(alice, exchange.calculate_volume(price(130), volume(1)));
+         extended_asset odd_volume = volume(0);
+         odd_volume.quantity.amount = 7;
+         exchange.place_ask_order(alice, price(130), odd_volume, "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("they go to the earliest order") {
+            CHECK(bid_orders.find(1)->volume.quantity.amount == volume(6).quantity.amount - 6);   // 5 pro-rata + 1 leftover
+            CHECK(bid_orders.find(2)->volume.quantity.amount == volume(2).quantity.amount - 1);
+         }
+      }
+   }
+}
+
+TEST_CASE("crank_events") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name carol = name("carol");
+
+   exchange.init_contract(false);
+
+   GIVEN("the EOS/USD market pair defers maker settlement") {
+      create_eos_usd_pair(exchange);
+      exchange.set_deferred_settlement(EOS, USD, true);
+
+      CHECK_THROWS_WITH(exchange.crank_events(EOS, USD, 10), "no fill events to crank");
+
+      exchange.adjust_balance(bob, volume(4));
+      exchange.adjust_balance(carol, volume(3));
+      exchange.place_bid_order(bob, price(130), volume(2), "2019-05-26T10:10:00"_tp, 0);
+      exchange.place_bid_order(carol, price(130), volume(3), "2019-05-26T10:10:01"_tp, 0);
+      exchange.place_bid_order(bob, price(131), volume(2), "2019-05-26T10:10:02"_tp, 0);
+
+      WHEN("alice buys 7 EOS from three makers") {
+         exchange.adjust_balance(alice, exchange.calculate_volume(price(131), volume(7)));
+         exchange.place_ask_order(alice, price(131), volume(7), "2019-05-26T10:10:03"_tp, 0);
+
+         THEN("alice is settled straight away") {
+            CHECK(exchange.get_balance(alice, EOS_8) == 700000000);
+            CHECK(exchange.get_balance(alice, USD_8) == 5000000);   // (1.31 - 1.30) * 5 refund
+         }
+         AND_THEN("the makers proceeds wait in the event queue") {
+            CHECK(exchange.get_balance(bob, USD_8) == 0);
+            CHECK(exchange.get_balance(carol, USD_8) == 0);
+            CHECK(exchange.get_balance(name("exchange"), USD_8) == 912000000);   // 2 * 1.30 + 3 * 1.30 + 2 * 1.31
+
+            auto event_queue = exchange.exchange_event_queues.find(name("eosusd").value);
+            CHECK(event_queue->tail - event_queue->head == 3);
+            CHECK_THROWS_WITH(exchange.remove_market_pair(EOS, USD), "fill events must be cranked before removing the market pair");
+         }
+
+         AND_WHEN("a keeper cranks two events") {
+            CHECK(exchange.crank_events(EOS, USD, 2) == 2);
+
+            THEN("the two oldest fills are paid") {
+               CHECK(exchange.get_balance(bob, USD_8) == 260000000);
+               CHECK(exchange.get_balance(carol, USD_8) == 390000000);
+               CHECK(exchange.get_balance(name("exchange"), USD_8) == 262000000);
+            }
+
+            AND_WHEN("the rest is cranked") {
+               CHECK(exchange.crank_events(EOS, USD, 10) == 1);
+
+               THEN("every maker is paid and the queue is empty") {
+                  CHECK(exchange.get_balance(bob, USD_8) == 522000000);
+                  CHECK(exchange.get_balance(name("exchange"), USD_8) == 0);
+                  CHECK_THROWS_WITH(exchange.crank_events(EOS, USD, 10), "no fill events to crank");
+                  exchange.remove_market_pair(EOS, USD);
+                  CHECK(exchange.exchange_event_queues.find(name("eosusd").value) == exchange.exchange_event_queues.end());
+               }
+            }
+         }
+      }
+   }
+}
+
+TEST_CASE("stop_orders") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name carol = name("carol");
+   name dave  = name("dave");
+
+   exchange.init_contract(false);
+
+   GIVEN("EOS/USD last traded at 1.30 USD") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, price(10000));
+      exchange.adjust_balance(bob, volume(10));
+      exchange.adjust_balance(carol, volume(2));
+      exchange.adjust_balance(dave, price(140));
+
+      exchange.place_bid_order(bob, price(130), volume(1), "2019-05-26T10:10:00"_tp, 0);
+      exchange.place_ask_order(alice, price(130), volume(1), "2019-05-26T10:10:01"_tp, 0);
+
+      stop_bids stop_sells(name("exchange"), name("eosusd").value);
+      stop_asks stop_buys(name("exchange"), name("eosusd").value);
+
+      THEN("stops that would trigger straight away are rejected") {
+         CHECK_THROWS_WITH(exchange.place_stop_order(carol, BID, price(130), price(129), volume(2), true, "2019-05-26T10:10:02"_tp, 0),
+                           "stop price must be below the last price");
+         CHECK_THROWS_WITH(exchange.place_stop_order(dave, ASK, price(130), price(140), volume(1), false, "2019-05-26T10:10:02"_tp, 0),
+                           "stop price must be above the last price");
+      }
+
+      WHEN("carol places a stop-limit to sell 2 EOS @ 1.24 USD if the price falls to 1.25 USD") {
+         exchange.place_stop_order(carol, BID, price(125), price(124), volume(2), true, "2019-05-26T10:10:02"_tp, 1);
+
+         THEN("her EOS is escrowed but nothing is on the book") {
+            CHECK(exchange.get_balance(carol, EOS_8) == 0);
+            CHECK(stop_sells.find(1) != stop_sells.end());
+            CHECK(bids(name("exchange"), name("eosusd").value).begin() == bids(name("exchange"), name("eosusd").value).end());
+         }
+
+         AND_WHEN("a trade at 1.24 USD reaches the trigger") {
+            exchange.place_ask_order(alice, price(124), volume(3), "2019-05-26T10:10:03"_tp, 0);
+            exchange.place_bid_order(bob, price(120), volume(1), "2019-05-26T10:10:04"_tp, 0);
+
+            THEN("the stop becomes a live order and fills against the rest of alices ASK") {
+               CHECK(stop_sells.begin() == stop_sells.end());
+               CHECK(exchange.get_balance(carol, USD_8) == 248000000);   // 2 * 1.24
+               CHECK(exchange.get_balance(alice, EOS_8) == 400000000);
+               CHECK(asks(name("exchange"), name("eosusd").value).begin() == asks(name("exchange"), name("eosusd").value).end());
+            }
+         }
+
+         AND_WHEN("carol cancels the stop") {
+            CHECK_THROWS_WITH(exchange.cancel_stop_order(EOS, USD, bob, BID, 1), "stop order belongs to another trader");
+            exchange.cancel_stop_order(EOS, USD, carol, BID, 1);
+
+            THEN("her EOS is refunded") {
+               CHECK(exchange.get_balance(carol, EOS_8) == 200000000);
+               CHECK(stop_sells.find(1) == stop_sells.end());
+            }
+         }
+      }
+
+      WHEN("dave places a stop to buy 1 EOS up to 1.40 USD if the price rises to 1.35 USD") {
+         exchange.place_stop_order(dave, ASK, price(135), price(140), volume(1), false, "2019-05-26T10:10:02"_tp, 1);
+         CHECK(exchange.get_balance(dave, USD_8) == 0);
+
+         AND_WHEN("the last trade at 1.36 USD takes the only EOS for sale") {
+            exchange.place_bid_order(bob, price(136), volume(1), "2019-05-26T10:10:03"_tp, 0);
+            exchange.place_ask_order(alice, price(136), volume(1), "2019-05-26T10:10:04"_tp, 0);
+
+            THEN("the triggered stop finds nothing to buy and is cancelled and refunded") {
+               CHECK(stop_buys.begin() == stop_buys.end());
+               CHECK(asks(name("exchange"), name("eosusd").value).begin() == asks(name("exchange"), name("eosusd").value).end());
+               CHECK(exchange.get_balance(dave, USD_8) == 140000000);
+            }
+         }
+      }
+   }
+
+   GIVEN("EOS/USD has not traded yet") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, price(10000));
+      exchange.adjust_balance(bob, volume(10));
+      exchange.adjust_balance(carol, volume(2));
+
+      stop_bids stop_sells(name("exchange"), name("eosusd").value);
+
+      WHEN("carol places a stop to sell 2 EOS @ 1.24 USD if the price falls to 1.25 USD") {
+         exchange.place_stop_order(carol, BID, price(125), price(124), volume(2), true, "2019-05-26T10:10:00"_tp, 1);
+
+         THEN("it is accepted, there is no last price to be above") {
+            CHECK(stop_sells.find(1) != stop_sells.end());
+            CHECK(exchange.get_balance(carol, EOS_8) == 0);
+         }
+
+         AND_WHEN("the first trade is at 1.20 USD") {
+            exchange.place_bid_order(bob, price(120), volume(1), "2019-05-26T10:10:01"_tp, 0);
+            exchange.place_ask_order(alice, price(120), volume(1), "2019-05-26T10:10:02"_tp, 0);
+
+            THEN("the stop triggers and rests on the book at its limit") {
+               CHECK(stop_sells.begin() == stop_sells.end());
+               auto by_price = bids(name("exchange"), name("eosusd").value).get_index<"byprice"_n>();
+               REQUIRE(by_price.begin() != by_price.end());
+               CHECK(by_price.begin()->trader == carol);
+               CHECK(by_price.begin()->price.quantity.amount == price(124).quantity.amount);
+            }
+         }
+      }
+   }
+
+   GIVEN("EOS/USD is in batch auction mode") {
+      create_eos_usd_pair(exchange);
+      exchange.set_matching_mode(EOS, USD, BATCH_AUCTION, "2019-05-26T10:09:00"_tp);
+
+      exchange.adjust_balance(carol, volume(2));
+
+      THEN("a stop that would be immediate or cancel is rejected when placed") {
+         CHECK_THROWS_WITH(exchange.place_stop_order(carol, BID, price(125), price(124), volume(2), false, "2019-05-26T10:10:00"_tp, 1),
+                           "immediate or cancel orders are not accepted in batch auction mode");
+         CHECK(exchange.get_balance(carol, EOS_8) == volume(2).quantity.amount);
+      }
+      AND_THEN("a stop-limit is accepted") {
+         exchange.place_stop_order(carol, BID, price(125), price(124), volume(2), true, "2019-05-26T10:10:00"_tp, 1);
+         CHECK(exchange.get_balance(carol, EOS_8) == 0);
+      }
+   }
+}
+
+TEST_CASE("expire_orders") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name carol = name("carol");
+   name dave  = name("dave");
+
+   exchange.init_contract(false);
+
+   GIVEN("good till time orders on the EOS/USD market") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(1));
+      exchange.adjust_balance(bob, volume(1));
+      exchange.adjust_balance(carol, price(131));
+      exchange.adjust_balance(dave, price(200));
+
+      // alice's BID is the best price but expires at 10:10:05
+      exchange.place_bid_order(alice, price(130), volume(1), "2019-05-26T10:10:00"_tp, 1, "2019-05-26T10:10:05"_tp);
+      exchange.place_bid_order(bob, price(131), volume(1), "2019-05-26T10:10:01"_tp, 2);
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+
+      THEN("orders cannot be placed already expired") {
+         CHECK_THROWS_WITH(exchange.insert_bid_order(bob, price(130), volume(1), "2019-05-26T10:10:02"_tp, 3, "2019-05-26T10:10:02"_tp),
+                           "expiration must be in the future");
+      }
+
+      WHEN("carol buys 1 EOS @ 1.31 USD after alices BID expired") {
+         exchange.place_ask_order(carol, price(131), volume(1), "2019-05-26T10:10:10"_tp, 3);
+
+         THEN("the expired BID is skipped and refunded") {
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(exchange.get_balance(alice, EOS_8) == 100000000);
+            CHECK(exchange.get_balance(alice, USD_8) == 0);
+         }
+         AND_THEN("carol fills against bobs BID") {
+            CHECK(bid_orders.find(2) == bid_orders.end());
+            CHECK(exchange.get_balance(carol, EOS_8) == 100000000);
+            CHECK(exchange.get_balance(bob, USD_8) == 131000000);
+         }
+      }
+
+      WHEN("orders expire without being met during matching") {
+         exchange.place_ask_order(dave, price(100), volume(1), "2019-05-26T10:10:02"_tp, 4, "2019-05-26T10:10:20"_tp);
+         exchange.place_ask_order(dave, price(100), volume(1), "2019-05-26T10:10:03"_tp, 5, "2019-05-26T10:10:30"_tp);
+
+         CHECK_THROWS_WITH(exchange.purge_expired_orders(EOS, USD, "2019-05-26T10:10:04"_tp, 10), "no expired orders to purge");
+
+         AND_WHEN("anyone purges them") {
+            CHECK(exchange.purge_expired_orders(EOS, USD, "2019-05-26T10:10:25"_tp, 10) == 2);   // alices BID and daves first ASK
+
+            THEN("only expired rows are removed and refunded") {
+               CHECK(bid_orders.find(1) == bid_orders.end());
+               CHECK(bid_orders.find(2) != bid_orders.end());
+               CHECK(ask_orders.find(4) == ask_orders.end());
+               CHECK(ask_orders.find(5) != ask_orders.end());
+               CHECK(exchange.get_balance(alice, EOS_8) == 100000000);
+               CHECK(exchange.get_balance(dave, USD_8) == 100000000);
+            }
+         }
+         AND_WHEN("a purge is bounded") {
+            CHECK(exchange.purge_expired_orders(EOS, USD, "2019-05-26T10:10:40"_tp, 1) == 1);
+
+            THEN("the rest is left for the next purge") {
+               CHECK(bid_orders.find(1) == bid_orders.end());
+               CHECK(ask_orders.find(4) != ask_orders.end());
+            }
+         }
+      }
+   }
+}
+
+TEST_CASE("prevent_self_trade") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("alice quotes both sides of the EOS/USD market and bob sells behind her") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(2));
+      exchange.adjust_balance(alice, price(1000));
+      exchange.adjust_balance(bob, volume(5));
+
+      exchange.place_bid_order(alice, price(130), volume(2), "2019-05-26T10:10:00"_tp, 1);
+      exchange.place_bid_order(bob, price(131), volume(5), "2019-05-26T10:10:01"_tp, 2);
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+      auto market_stats = stats(name("exchange"), name("exchange").value).find(name("eosusd").value);
+
+      CHECK_THROWS_WITH(exchange.insert_ask_order(alice, price(131), volume(3), "2019-05-26T10:10:02"_tp, 3, time_point(), 4),
+                        "invalid self-trade prevention mode");
+
+      WHEN("alice buys 3 EOS @ 1.31 USD with cancel newest") {
+         exchange.place_ask_order(alice, price(131), volume(3), "2019-05-26T10:10:02"_tp, 3, time_point(), STP_CANCEL_NEWEST);
+
+         THEN("her ASK is cancelled before it trades with her own BID") {
+            CHECK(ask_orders.find(3) == ask_orders.end());
+            CHECK(bid_orders.find(1)->volume.quantity.amount == volume(2).quantity.amount);
+            CHECK(exchange.get_balance(alice, USD_8) == 1000000000);
+            CHECK(exchange.get_balance(bob, USD_8) == 0);
+            CHECK(market_stats->price.quantity.amount == 0);
+         }
+      }
+
+      WHEN("alice buys 3 EOS @ 1.31 USD with cancel oldest") {
+         exchange.place_ask_order(alice, price(131), volume(3), "2019-05-26T10:10:02"_tp, 3, time_point(), STP_CANCEL_OLDEST);
+
+         THEN("her BID is cancelled and the ASK fills against bob") {
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(ask_orders.find(3) == ask_orders.end());
+            CHECK(bid_orders.find(2)->volume.quantity.amount == volume(2).quantity.amount);
+            CHECK(exchange.get_balance(alice, EOS_8) == 500000000);   // 2 refunded + 3 bought
+            CHECK(exchange.get_balance(bob, USD_8) == 393000000);     // 3 * 1.31
+         }
+      }
+
+      WHEN("alice buys 3 EOS @ 1.31 USD with decrement and cancel") {
+         exchange.place_ask_order(alice, price(131), volume(3), "2019-05-26T10:10:02"_tp, 3, time_point(), STP_DECREMENT_AND_CANCEL);
+
+         THEN("both orders lose 2 EOS, which cancels her BID, and the last EOS fills against bob") {
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(ask_orders.find(3) == ask_orders.end());
+            CHECK(exchange.get_balance(alice, EOS_8) == 300000000);   // 2 refunded + 1 bought
+            CHECK(exchange.get_balance(alice, USD_8) == 869000000);   // 10.00 - 1.31
+            CHECK(exchange.get_balance(bob, USD_8) == 131000000);
+         }
+      }
+
+      WHEN("alice buys 3 EOS @ 1.31 USD without self-trade prevention") {
+         exchange.place_ask_order(alice, price(131), volume(3), "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("she trades with herself first") {
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(bid_orders.find(2)->volume.quantity.amount == volume(4).quantity.amount);
+         }
+      }
+
+      WHEN("the pair uses pro-rata matching and alice buys 3 EOS @ 1.30 USD with cancel oldest") {
+         exchange.adjust_balance(bob, volume(2));
+         exchange.place_bid_order(bob, price(130), volume(2), "2019-05-26T10:10:02"_tp, 4);
+         exchange.set_matching_mode(EOS, USD, PRO_RATA, "2019-05-26T10:10:03"_tp);
+         exchange.place_ask_order(alice, price(130), volume(3), "2019-05-26T10:10:04"_tp, 3, time_point(), STP_CANCEL_OLDEST);
+
+         THEN("her BID leaves the level and bob fills the whole ASK") {
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(bid_orders.find(4) == bid_orders.end());
+            CHECK(ask_orders.find(3)->volume.quantity.amount == volume(1).quantity.amount);
+            CHECK(exchange.get_balance(bob, USD_8) == 260000000);
+         }
+      }
+   }
+}
+
+TEST_CASE("maker_taker_fees") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name fees  = name("fees");
+
+   exchange.init_contract(false);
+
+   GIVEN("the EOS/USD market pair charges makers 0.1% and takers 0.2%") {
+      create_eos_usd_pair(exchange);
+
+      CHECK_THROWS_WITH(exchange.set_fees(EOS, USD, 10, 1001), "fee is too high");
+      exchange.set_fees(EOS, USD, 10, 20);
+
+      exchange.adjust_balance(bob, volume(10));
+      exchange.adjust_balance(alice, price(1000));
+
+      WHEN("alice takes bobs BID for 10 EOS @ 1.00 USD in two fills") {
+         exchange.place_bid_order(bob, price(100), volume(10), "2019-05-26T10:10:00"_tp, 1);
+         exchange.place_ask_order(alice, price(100), volume(4), "2019-05-26T10:10:01"_tp, 2);
+         exchange.place_ask_order(alice, price(100), volume(6), "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("each side receives its proceeds less its fee") {
+            CHECK(exchange.get_balance(bob, USD_8) == 999000000);     // 10.00 - 0.1%
+            CHECK(exchange.get_balance(alice, EOS_8) == 998000000);   // 10 - 0.2%
+         }
+         AND_THEN("the fees wait in the exchanges balance until they are flushed") {
+            CHECK(exchange.get_balance(name("exchange"), USD_8) == 1000000);
+            CHECK(exchange.get_balance(name("exchange"), EOS_8) == 2000000);
+            CHECK(exchange.pending_fees.balances.size() == 2);
+         }
+
+         AND_WHEN("the action flushes its fees") {
+            exchange.flush_fees();
+
+            THEN("one fee row per token holds both fills") {
+               feeshards usd_fees(name("exchange"), exchange.find_token_id(name("usd.token"), symbol("USD",8)));
+               CHECK(usd_fees.find(name("eosusd").value)->balance.quantity.amount == 1000000);
+               CHECK(exchange.get_balance(name("exchange"), USD_8) == 0);
+               CHECK(exchange.get_balance(name("exchange"), EOS_8) == 0);
+               CHECK(exchange.pending_fees.balances.empty());
+            }
+
+            AND_WHEN("the fees are claimed") {
+               exchange.adjust_balance(fees, exchange.claim_fees(USD_8));
+
+               THEN("the fee rows are summed and removed") {
+                  CHECK(exchange.get_balance(fees, USD_8) == 1000000);
+                  CHECK_THROWS_WITH(exchange.claim_fees(USD_8), "no fees to claim");
+               }
+            }
+         }
+      }
+   }
+}
+
+TEST_CASE("swap_tokens") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name carol = name("carol");
+   name dave  = name("dave");
+   name erin  = name("erin");
+   name frank = name("frank");
+
+   exchange.init_contract(false);
+
+   GIVEN("EOS/USD buyers and BTC/USD sellers on the USD market") {
+      extended_asset BTC = extended_asset(asset(0, symbol("BTC",8)), name("btc.token"));
+
+      exchange.register_token(alice, name("btc.token"), symbol("BTC",8));
+      create_eos_usd_pair(exchange);
+      exchange.add_market_pair(name("exchange"), exchange.create_market_name(USD), BTC);
+
+      auto btc = [&](int64_t sats)  { return extended_asset(asset(sats, symbol("BTC",8)), name("btc.token")); };
+
+      extended_symbol BTC_8 = extended_symbol(symbol("BTC",8), name("btc.token"));
+
+      exchange.adjust_balance(alice, volume(6));
+      exchange.adjust_balance(carol, price(1000));
+      exchange.adjust_balance(dave, price(950));
+      exchange.adjust_balance(erin, btc(100000));
+      exchange.adjust_balance(frank, btc(1000000));
+
+      exchange.place_ask_order(carol, price(200), volume(5), "2019-05-26T10:10:00"_tp, 1);
+      exchange.place_ask_order(dave, price(190), volume(5), "2019-05-26T10:10:01"_tp, 2);
+      exchange.place_bid_order(erin, price(500000), btc(100000), "2019-05-26T10:10:02"_tp, 1);
+      exchange.place_bid_order(frank, price(600000), btc(1000000), "2019-05-26T10:10:03"_tp, 2);
+
+      asks eos_asks(name("exchange"), name("eosusd").value);
+      bids btc_bids(name("exchange"), name("btcusd").value);
+
+      THEN("a swap below the minimum output is rejected") {
+         CHECK_THROWS_WITH(exchange.swap_tokens(alice, volume(6), USD, btc(300000), "2019-05-26T10:10:04"_tp), "swap output is below the minimum");
+         CHECK_THROWS_WITH(exchange.swap_tokens(alice, volume(6), USD, volume(1), "2019-05-26T10:10:04"_tp), "cannot swap a token for itself");
+      }
+
+      THEN("a zero priced order cannot rest on a book the swap walks") {
+         CHECK_THROWS_WITH(exchange.place_bid_order(erin, price(0), btc(1000), "2019-05-26T10:10:04"_tp), "price must be positive");
+         CHECK_THROWS_WITH(exchange.place_ask_order(carol, price(0), volume(1), "2019-05-26T10:10:04"_tp), "price must be positive");
+      }
+
+      WHEN("alice swaps 6 EOS for at least 0.002 BTC") {
+         extended_asset output = exchange.swap_tokens(alice, volume(6), USD, btc(200000), "2019-05-26T10:10:04"_tp);
+
+         // 5 EOS @ 2.00 + 1 EOS @ 1.90 = 11.90 USD
+         // 0.001 BTC @ 5000 = 5.00 USD, then 6.90 USD / 6000 = 0.00115 BTC
+         THEN("she receives 0.00215 BTC and no USD") {
+            CHECK(output.quantity.amount == 215000);
+            CHECK(exchange.get_balance(alice, BTC_8) == 215000);
+            CHECK(exchange.get_balance(alice, EOS_8) == 0);
+            CHECK(exchange.get_balance(alice, USD_8) == 0);
+         }
+         AND_THEN("the makers on both books are paid at their prices") {
+            CHECK(exchange.get_balance(carol, EOS_8) == 500000000);
+            CHECK(exchange.get_balance(dave, EOS_8) == 100000000);
+            CHECK(exchange.get_balance(erin, USD_8) == 500000000);
+            CHECK(exchange.get_balance(frank, USD_8) == 690000000);
+            CHECK(eos_asks.find(1) == eos_asks.end());
+            CHECK(eos_asks.find(2)->volume.quantity.amount == volume(4).quantity.amount);
+            CHECK(btc_bids.find(1) == btc_bids.end());
+            CHECK(btc_bids.find(2)->volume.quantity.amount == 885000);
+         }
+         AND_THEN("the exchange only escrows the resting orders") {
+            CHECK(exchange.get_balance(name("exchange"), USD_8) == 760000000);   // 4 EOS @ 1.90
+            CHECK(exchange.get_balance(name("exchange"), EOS_8) == 0);
+            CHECK(exchange.get_balance(name("exchange"), BTC_8) == 885000);
+         }
+      }
+
+      WHEN("the books cannot absorb the whole input") {
+         exchange.adjust_balance(alice, volume(10));
+         extended_asset output = exchange.swap_tokens(alice, volume(16), USD, btc(0), "2019-05-26T10:10:04"_tp);
+
+         THEN("the unused EOS is refunded") {
+            CHECK(exchange.get_balance(alice, EOS_8) == 600000000);
+            CHECK(eos_asks.begin() == eos_asks.end());
+            CHECK(output.quantity.amount == 100000 + 241666);   // 19.50 USD: 5.00 USD, then 14.50 USD / 6000 = 0.00241666 BTC
+         }
+      }
+   }
+}
+
+TEST_CASE("iceberg_orders") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("alice sells 10 EOS @ 1.30 USD showing 2 EOS at a time") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(10));
+      exchange.adjust_balance(bob, price(2000));
+
+      exchange.place_bid_order(alice, price(130), volume(10), "2019-05-26T10:10:00"_tp, 1, time_point(), STP_NONE, volume(2).quantity.amount);
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+
+      THEN("only the slice is shown and the rest is escrowed in reserve") {
+         CHECK(bid_orders.find(1)->volume.quantity.amount == volume(2).quantity.amount);
+         CHECK(bid_orders.find(1)->hidden == volume(8).quantity.amount);
+         CHECK(exchange.get_balance(name("exchange"), EOS_8) == 1000000000);
+         CHECK_THROWS_WITH(exchange.insert_bid_order(alice, price(130), volume(1), "2019-05-26T10:10:01"_tp, 9, time_point(), STP_NONE, -1),
+                           "display volume must not be negative");
+      }
+
+      WHEN("bob buys 5 EOS @ 1.30 USD") {
+         exchange.place_ask_order(bob, price(130), volume(5), "2019-05-26T10:10:01"_tp, 2);
+
+         THEN("the slice is refilled in place and the order keeps its row") {
+            auto row = bid_orders.find(1);
+            REQUIRE(row != bid_orders.end());
+            CHECK(row->volume.quantity.amount == volume(1).quantity.amount);
+            CHECK(row->hidden == volume(4).quantity.amount);
+            CHECK(std::distance(bid_orders.begin(), bid_orders.end()) == 1);
+            CHECK(ask_orders.find(2) == ask_orders.end());
+         }
+         AND_THEN("bob receives all 5 EOS and alice is paid for them") {
+            CHECK(exchange.get_balance(bob, EOS_8) == 500000000);
+            CHECK(exchange.get_balance(alice, USD_8) == 650000000);
+         }
+         AND_THEN("cancelling refunds the slice and the reserve") {
+            exchange.cancel_order(EOS, USD, alice, BID, 1);
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(exchange.get_balance(alice, EOS_8) == 500000000);
+            CHECK(exchange.get_balance(name("exchange"), EOS_8) == 0);
+         }
+      }
+
+      WHEN("bob buys 12 EOS @ 1.30 USD") {
+         exchange.place_ask_order(bob, price(130), volume(12), "2019-05-26T10:10:01"_tp, 2);
+
+         THEN("the whole iceberg trades and bob rests with the rest") {
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(ask_orders.find(2)->volume.quantity.amount == volume(2).quantity.amount);
+            CHECK(exchange.get_balance(bob, EOS_8) == 1000000000);
+            CHECK(exchange.get_balance(alice, USD_8) == 1300000000);
+         }
+      }
+   }
+}
+
+TEST_CASE("next_sequence") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("an EOS/USD market pair") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(20));
+      exchange.adjust_balance(bob, price(2000));
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+
+      WHEN("orders of both sides arrive in the same block") {
+         exchange.set_deferred_settlement(EOS, USD, true);
+         uint64_t bid_id = exchange.place_bid_order(alice, price(130), volume(5), "2019-05-26T10:10:00"_tp);
+         uint64_t ask_id = exchange.place_ask_order(bob, price(135), volume(5), "2019-05-26T10:10:00"_tp);
+         uint64_t stop_id = exchange.place_stop_order(alice, BID, price(120), price(119), volume(1), true, "2019-05-26T10:10:00"_tp);
+
+         THEN("ids are issued for both sides in arrival order") {
+            CHECK(bid_id == 1);
+            CHECK(ask_id == 2);
+            CHECK(stop_id == 3);
+         }
+         AND_THEN("the earlier id is the maker and sets the trade price") {
+            CHECK(bid_orders.find(bid_id) == bid_orders.end());
+            CHECK(exchange.get_balance(bob, USD_8) == 1350000000);   // 20.00 - 5 * 1.30
+         }
+         AND_THEN("the makers fill event and the trade are numbered by their own counters") {
+            recenttrades trades(name("exchange"), name("eosusd").value);
+            fillevents events(name("exchange"), name("eosusd").value);
+            CHECK(trades.find(0)->sequence == 0);
+            CHECK(events.find(0)->sequence == 0);
+         }
+      }
+
+      WHEN("the pair has orders from before the sequence") {
+         bid_orders.emplace(name("exchange"), [&](auto& b) {
+            b.id        = 7;
+            b.trader    = alice;
+            b.timestamp = "2019-05-26T10:09:00"_tp;
+            b.price     = price(140);
+            b.volume    = volume(1);
+         });
+         exchange.adjust_balance(alice, -volume(1));
+         exchange.adjust_balance(name("exchange"), volume(1));
+
+         THEN("the sequence starts after them") {
+            CHECK(exchange.place_bid_order(alice, price(150), volume(1), "2019-05-26T10:10:00"_tp) == 8);
+            CHECK(exchange.place_bid_order(alice, price(150), volume(1), "2019-05-26T10:10:00"_tp) == 9);
+         }
+      }
+   }
+}
+
+TEST_CASE("exec_context") {
+   exchange_base_mock exchange{name("exchange")};
+   exchange.init_contract(true);
+
+   GIVEN("an EOS/USD market pair looked up during an action") {
+      create_eos_usd_pair(exchange);
+
+      name market_name = exchange.find_market_pair(EOS, USD);
+      CHECK(exchange.get_pair_config(market_name).taker_fee_bps == 0);
+      CHECK(exchange.get_ram_payer(name("alice")) == name("alice"));
+
+      THEN("lookups and table handles are reused") {
+         CHECK(exchange.ctx.market_pairs.size() == 1);
+         CHECK(exchange.ctx.pair_configs.count(market_name) == 1);
+         CHECK(exchange.ctx.contract_settings.has_value());
+         CHECK(&exchange.get_bids(market_name) == &exchange.get_bids(market_name));
+         CHECK(&exchange.get_accounts(name("alice")) == &exchange.get_accounts(name("alice")));
+         CHECK(&exchange.get_stop_bids(market_name) == &exchange.get_stop_bids(market_name));
+         CHECK(&exchange.get_sequences(market_name) == &exchange.get_sequences(market_name));
+         CHECK(&exchange.get_fill_events(market_name) == &exchange.get_fill_events(market_name));
+         CHECK(&exchange.get_recent_trades(market_name) == &exchange.get_recent_trades(market_name));
+      }
+
+      AND_THEN("the pair tokens are resolved once by name") {
+         auto [ base, quote ] = exchange.find_pair_tokens(market_name);
+         CHECK((base.get_extended_symbol() == EOS.get_extended_symbol()));
+         CHECK((quote.get_extended_symbol() == USD.get_extended_symbol()));
+         CHECK(exchange.ctx.pair_tokens.count(market_name) == 1);
+         CHECK(exchange.ctx.market_pairs.size() == 1);
+      }
+
+      WHEN("the pair settings change") {
+         exchange.set_fees(EOS, USD, 10, 20);
+
+         THEN("the cached settings are refreshed") {
+            CHECK(exchange.get_pair_config(market_name).taker_fee_bps == 20);
+         }
+      }
+
+      WHEN("the pair is removed") {
+         exchange.remove_market_pair(EOS, USD);
+
+         THEN("it is no longer found") {
+            CHECK_THROWS_WITH(exchange.find_market_pair(EOS, USD), "market pair does not exist");
+         CHECK_THROWS_WITH(exchange.find_pair_tokens(market_name), "market pair does not exist");
+            CHECK(exchange.get_pair_config(market_name).taker_fee_bps == 0);
+         }
+      }
+   }
+}
+
+TEST_CASE("storage_policy") {
+   scratch_exchange_mock exchange{name("exchange")};
+   exchange.init_contract(false);
+
+   GIVEN("an engine compiled against a storage policy with its own balance table") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(name("alice"), volume(5));
+      exchange.adjust_balance(name("bob"), price(1000));
+
+      WHEN("two orders match") {
+         exchange.place_bid_order(name("alice"), price(130), volume(5), "2019-05-26T10:10:00"_tp);
+         exchange.place_ask_order(name("bob"), price(130), volume(5), "2019-05-26T10:10:01"_tp);
+
+         THEN("balances are kept in the policy table only") {
+            CHECK(exchange.get_balance(name("bob"), extended_symbol(symbol("EOS",8), name("eosio.token"))) == 500000000);
+            CHECK(exchange.get_balance(name("alice"), extended_symbol(symbol("USD",8), name("usd.token"))) == 650000000);
+
+            scratch_storage::exaccounts scratch_accounts(name("exchange"), name("bob").value);
+            exaccounts default_accounts(name("exchange"), name("bob").value);
+            CHECK(scratch_accounts.begin() != scratch_accounts.end());
+            CHECK(default_accounts.begin() == default_accounts.end());
+         }
+      }
+   }
+}
+
+TEST_CASE("memory_book") {
+   memory_exchange_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("an engine whose order books are memory tables, with sells resting at 1.30 and 1.40 USD") {
+      name eosusd = create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(10));
+      exchange.adjust_balance(bob, price(10000));
+      exchange.place_bid_order(alice, price(140), volume(5), "2019-05-26T10:10:00"_tp, 1);
+      exchange.place_bid_order(alice, price(130), volume(5), "2019-05-26T10:10:01"_tp, 2);
+
+      memory_book_storage::bids bid_orders(name("exchange"), eosusd.value);
+      memory_book_storage::asks ask_orders(name("exchange"), eosusd.value);
+
+      WHEN("bob buys 7 EOS @ 1.40 USD") {
+         uint64_t ask_id = exchange.place_ask_order(bob, price(140), volume(7), "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("the cheaper level fills first and the rest of the book is kept in the memory table") {
+            CHECK(exchange.get_balance(bob, EOS_8) == volume(7).quantity.amount);
+            CHECK(exchange.get_balance(alice, USD_8) == 930000000);   // 5 * 1.30 + 2 * 1.40
+
+            auto by_price = bid_orders.get_index<"byprice"_n>();
+            REQUIRE(by_price.begin() != by_price.end());
+            CHECK(by_price.begin()->price.quantity.amount == price(140).quantity.amount);
+            CHECK(by_price.begin()->volume.quantity.amount == volume(3).quantity.amount);
+            CHECK(by_price.begin()->filled_qty == volume(2).quantity.amount);
+            CHECK(std::next(by_price.begin()) == by_price.end());
+            CHECK(ask_orders.find(ask_id) == ask_orders.end());
+         }
+         AND_THEN("the eosio book tables are never written") {
+            bids default_bids(name("exchange"), eosusd.value);
+            CHECK(default_bids.begin() == default_bids.end());
+         }
+      }
+
+      WHEN("a sell with an expiry is purged") {
+         exchange.adjust_balance(alice, volume(1));
+         exchange.place_bid_order(alice, price(150), volume(1), "2019-05-26T10:10:02"_tp, 3, "2019-05-26T10:11:00"_tp);
+         uint32_t purged = exchange.purge_expired_orders(EOS, USD, "2019-05-26T10:12:00"_tp, 10);
+
+         THEN("only it is found through the byexpiry index") {
+            CHECK(purged == 1);
+            CHECK(exchange.get_balance(alice, EOS_8) == volume(1).quantity.amount);
+
+            auto by_expiry = bid_orders.get_index<"byexpiry"_n>();
+            size_t resting = 0;
+            for( auto itr = by_expiry.begin(); itr != by_expiry.end(); ++itr, ++resting )
+               CHECK(itr->expiration == time_point());
+            CHECK(resting == 2);
+         }
+      }
+   }
+}
+
+TEST_CASE("dust_orders") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("an EOS/USD market pair with orders resting before a minimum volume was set") {
+      create_eos_usd_pair(exchange);
+
+      auto sats   = [&](int64_t amount) { return extended_asset(asset(amount, symbol("EOS",8)), name("eosio.token")); };
+
+      exchange.adjust_balance(alice, volume(10));
+      exchange.adjust_balance(bob, price(2000));
+
+      exchange.place_bid_order(alice, price(130), sats(5000), "2019-05-26T10:10:00"_tp, 1);
+      exchange.place_bid_order(alice, price(140), volume(5), "2019-05-26T10:10:01"_tp, 2);
+      exchange.place_bid_order(alice, price(150), sats(7000), "2019-05-26T10:10:02"_tp, 3);
+
+      exchange.set_min_volume(EOS, USD, sats(10000));
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+
+      THEN("new orders below the minimum are rejected") {
+         CHECK_THROWS_WITH(exchange.place_bid_order(alice, price(130), sats(9999), "2019-05-26T10:10:03"_tp), "order volume is below the pair minimum");
+         CHECK_THROWS_WITH(exchange.set_min_volume(EOS, USD, price(1)), "minimum volume must be in the base token");
+      }
+
+      WHEN("a fill leaves less than the minimum behind") {
+         // fills order 1, then all but 0.00005 EOS of order 2
+         exchange.place_ask_order(bob, price(140), volume(5), "2019-05-26T10:10:03"_tp, 4);
+
+         THEN("the remainder is cancelled and refunded at fill time") {
+            CHECK(bid_orders.find(2) == bid_orders.end());
+            CHECK(ask_orders.find(4) == ask_orders.end());
+            CHECK(exchange.get_balance(bob, EOS_8) == 500000000);
+            CHECK(exchange.get_balance(alice, EOS_8) == 500000000 - 12000 + 5000);
+         }
+      }
+
+      WHEN("the resting dust is swept in windows") {
+         uint32_t first  = exchange.sweep_dust_orders(EOS, USD, 0, 2);
+         uint32_t second = exchange.sweep_dust_orders(EOS, USD, 3, 2);
+
+         THEN("each window only removes and refunds the dust it reads") {
+            CHECK(first == 1);
+            CHECK(second == 1);
+            CHECK(bid_orders.find(1) == bid_orders.end());
+            CHECK(bid_orders.find(2) != bid_orders.end());
+            CHECK(bid_orders.find(3) == bid_orders.end());
+            CHECK(exchange.get_balance(alice, EOS_8) == 500000000);
+            CHECK(exchange.get_balance(name("exchange"), EOS_8) == 500000000);
+         }
+      }
+   }
+}
+
+TEST_CASE("rate_limit") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("an EOS/USD market pair limited to 2 orders per trader every 60 seconds") {
+      name market_name = create_eos_usd_pair(exchange);
+
+      CHECK_THROWS_WITH(exchange.set_rate_limit(EOS, USD, 2, 0), "rate limit window must be positive");
+      exchange.set_rate_limit(EOS, USD, 2, 60);
+
+      ratelimits rate_limits(name("exchange"), market_name.value);
+
+      WHEN("a trader places orders within one window") {
+         exchange.check_rate_limit(market_name, alice, "2019-05-26T10:10:00"_tp);
+         exchange.check_rate_limit(market_name, alice, "2019-05-26T10:10:30"_tp);
+
+         THEN("orders over the limit are rejected without affecting other traders") {
+            CHECK_THROWS_WITH(exchange.check_rate_limit(market_name, alice, "2019-05-26T10:10:59"_tp), "order rate limit exceeded");
+            exchange.check_rate_limit(market_name, bob, "2019-05-26T10:10:59"_tp);
+            CHECK(rate_limits.get(alice.value).orders == 2);
+            CHECK(rate_limits.get(bob.value).orders == 1);
+         }
+
+         THEN("the count starts over once the window has passed") {
+            exchange.check_rate_limit(market_name, alice, "2019-05-26T10:11:00"_tp);
+            CHECK(rate_limits.get(alice.value).orders == 1);
+            CHECK(rate_limits.get(alice.value).window_start == "2019-05-26T10:11:00"_tp.sec_since_epoch());
+         }
+      }
+
+      WHEN("the limit is removed") {
+         exchange.set_rate_limit(EOS, USD, 0, 0);
+         exchange.check_rate_limit(market_name, alice, "2019-05-26T10:10:00"_tp);
+
+         THEN("orders are not counted") {
+            CHECK(rate_limits.find(alice.value) == rate_limits.end());
+         }
+      }
+   }
+}
+
+TEST_CASE("price_bands") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("an EOS/USD market pair that last traded at 1.40") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(20));
+      exchange.adjust_balance(bob, price(5000));
+
+      exchange.place_bid_order(alice, price(140), volume(1), "2019-05-26T10:10:00"_tp, 1);
+      exchange.place_ask_order(bob, price(140), volume(1), "2019-05-26T10:10:01"_tp, 2);
+
+      // sell levels at 1.41, 1.42 and 1.43
+      exchange.place_bid_order(alice, price(141), volume(2), "2019-05-26T10:10:02"_tp, 3);
+      exchange.place_bid_order(alice, price(142), volume(2), "2019-05-26T10:10:03"_tp, 4);
+      exchange.place_bid_order(alice, price(143), volume(2), "2019-05-26T10:10:04"_tp, 5);
+
+      CHECK_THROWS_WITH(exchange.set_price_band(EOS, USD, 10001, 0), "price band is too wide");
+      exchange.set_price_band(EOS, USD, 1000, 2);
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+
+      THEN("orders priced outside the band are rejected") {
+         CHECK_THROWS_WITH(exchange.place_ask_order(bob, price(155), volume(1), "2019-05-26T10:10:05"_tp), "price is outside the pair price band");
+         CHECK_THROWS_WITH(exchange.place_bid_order(alice, price(125), volume(1), "2019-05-26T10:10:05"_tp), "price is outside the pair price band");
+      }
+
+      WHEN("a buy order would sweep three levels") {
+         exchange.place_ask_order(bob, price(150), volume(6), "2019-05-26T10:10:05"_tp, 6);
+
+         THEN("it trades through two levels and the rest is cancelled") {
+            CHECK(bid_orders.find(3) == bid_orders.end());
+            CHECK(bid_orders.find(4) == bid_orders.end());
+            CHECK(bid_orders.find(5) != bid_orders.end());
+            CHECK(ask_orders.find(6) == ask_orders.end());
+            CHECK(exchange.get_balance(bob, EOS_8) == 500000000);
+            // 1.40 and 4 EOS at 1.41 and 1.42 spent, the rest refunded
+            CHECK(exchange.get_balance(bob, USD_8) == 5000000000 - 140000000 - 282000000 - 284000000);
+         }
+      }
+
+      WHEN("a swap would sweep three levels") {
+         extended_asset BTC = extended_asset(asset(0, symbol("BTC",8)), name("btc.token"));
+         auto btc = [&](int64_t amount) { return extended_asset(asset(amount, symbol("BTC",8)), name("btc.token")); };
+
+         exchange.register_token(bob, name("btc.token"), symbol("BTC",8));
+         exchange.add_market_pair(name("exchange"), exchange.create_market_name(USD), BTC);
+
+         // alice buys 1 BTC at 50.00
+         exchange.adjust_balance(alice, price(5000));
+         exchange.place_ask_order(alice, price(5000), btc(100000000), "2019-05-26T10:10:05"_tp, 1);
+
+         // 1 BTC sold for 50.00 USD, enough to buy every EOS level
+         exchange.adjust_balance(bob, btc(100000000));
+         extended_asset output = exchange.swap_tokens(bob, btc(100000000), USD, volume(0), "2019-05-26T10:10:06"_tp);
+
+         THEN("the output leg stops at the level limit and the unused quote is refunded") {
+            CHECK(output.quantity.amount == volume(4).quantity.amount);
+            CHECK(bid_orders.find(5) != bid_orders.end());
+            CHECK(exchange.get_balance(bob, USD_8) == 5000000000 - 140000000 + 5000000000 - 282000000 - 284000000);
+         }
+      }
+   }
+}
+
+TEST_CASE("liquidity_pool") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name carol = name("carol");
+
+   exchange.init_contract(false);
+
+   GIVEN("an EOS/USD market pair with an empty order book") {
+      name market_name = create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(1000));
+      exchange.adjust_balance(alice, price(200000));
+      exchange.adjust_balance(carol, volume(100));
+      exchange.adjust_balance(carol, price(20000));
+
+      CHECK_THROWS_WITH(exchange.swap_pool(bob, EOS, USD, volume(1), price(0)), "market pair has no liquidity pool");
+
+      // 1000 EOS and 2000 USD, a price of 2.00
+      uint64_t alice_shares = exchange.add_liquidity(alice, volume(1000), price(200000));
+
+      pools liquidity_pools(name("exchange"), name("exchange").value);
+      lpshares provider_shares(name("exchange"), market_name.value);
+
+      THEN("the first provider sets the price and receives one share per base unit") {
+         CHECK(alice_shares == 100000000000);
+         CHECK(liquidity_pools.get(market_name.value).shares == alice_shares);
+         CHECK(provider_shares.get(alice.value).shares == alice_shares);
+         CHECK(exchange.get_balance(alice, EOS_8) == 0);
+         CHECK(exchange.get_balance(alice, USD_8) == 0);
+      }
+
+      WHEN("a second provider offers more quote than the pool price needs") {
+         uint64_t carol_shares = exchange.add_liquidity(carol, volume(100), price(20000));
+
+         THEN("only the matching quote is taken") {
+            CHECK(carol_shares == 10000000000);
+            CHECK(exchange.get_balance(carol, EOS_8) == 0);
+            CHECK(exchange.get_balance(carol, USD_8) == 0);
+            CHECK(liquidity_pools.get(market_name.value).quote_reserve.quantity.amount == 220000000000);
+         }
+      }
+
+      WHEN("a trader swaps base for quote against the pool") {
+         exchange.adjust_balance(bob, volume(10));
+
+         CHECK_THROWS_WITH(exchange.swap_pool(bob, EOS, USD, volume(10), price(2000)), "swap output is below the minimum");
+         extended_asset output = exchange.swap_pool(bob, EOS, USD, volume(10), price(1900));
+
+         THEN("the output keeps the product of the reserves and the fee stays in the pool") {
+            // 2000 * 9.97 / ( 1000 + 9.97 )
+            CHECK(output.quantity.amount == 1974316068);
+            CHECK(exchange.get_balance(bob, EOS_8) == 0);
+            CHECK(exchange.get_balance(bob, USD_8) == 1974316068);
+
+            const auto& p = liquidity_pools.get(market_name.value);
+            CHECK(p.base_reserve.quantity.amount == 101000000000);
+            CHECK(p.quote_reserve.quantity.amount == 200000000000 - 1974316068);
+            bool product_kept = int128_t(p.base_reserve.quantity.amount) * p.quote_reserve.quantity.amount > int128_t(100000000000) * 200000000000;
+            CHECK(product_kept);
+         }
+
+         THEN("the market pair cannot be removed while it has liquidity") {
+            CHECK_THROWS_WITH(exchange.remove_market_pair(EOS, USD), "liquidity must be removed before removing the market pair");
+         }
+
+         AND_WHEN("the provider redeems every share") {
+            auto [ base_out, quote_out ] = exchange.remove_liquidity(alice, EOS, USD, alice_shares);
+
+            THEN("the reserves are paid out and the pool is removed") {
+               CHECK(base_out.quantity.amount == 101000000000);
+               CHECK(quote_out.quantity.amount == 200000000000 - 1974316068);
+               CHECK(liquidity_pools.find(market_name.value) == liquidity_pools.end());
+               CHECK(provider_shares.find(alice.value) == provider_shares.end());
+               CHECK_THROWS_WITH(exchange.remove_liquidity(alice, EOS, USD, 1), "market pair has no liquidity pool");
+            }
+         }
+      }
+   }
+}
+
+TEST_CASE("route_swap") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+   name carol = name("carol");
+
+   exchange.init_contract(false);
+
+   GIVEN("an EOS/USD pair with a pool at 2.00 and orders on both sides of the book") {
+      name market_name = create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(carol, volume(1000));
+      exchange.adjust_balance(carol, price(200000));
+      exchange.add_liquidity(carol, volume(1000), price(200000));
+
+      // alice buys at 1.99 and 1.90, and sells at 2.01 and 2.10
+      exchange.adjust_balance(alice, price(5000));
+      exchange.adjust_balance(alice, volume(10));
+      exchange.place_ask_order(alice, price(199), volume(5), "2019-05-26T10:10:00"_tp, 1);
+      exchange.place_ask_order(alice, price(190), volume(5), "2019-05-26T10:10:01"_tp, 2);
+      exchange.place_bid_order(alice, price(201), volume(5), "2019-05-26T10:10:02"_tp, 3);
+      exchange.place_bid_order(alice, price(210), volume(5), "2019-05-26T10:10:03"_tp, 4);
+
+      bids bid_orders(name("exchange"), market_name.value);
+      asks ask_orders(name("exchange"), market_name.value);
+      pools liquidity_pools(name("exchange"), name("exchange").value);
+
+      WHEN("a trader sells 20 EOS") {
+         exchange.adjust_balance(bob, volume(20));
+         extended_asset output = exchange.route_swap(bob, EOS, USD, volume(20), price(0), "2019-05-26T10:10:04"_tp);
+
+         const auto& p = liquidity_pools.get(market_name.value);
+
+         THEN("the pool fills down to 1.99, the book level at 1.99 fills, and the pool takes the rest above 1.90") {
+            CHECK(ask_orders.find(1) == ask_orders.end());
+            CHECK(ask_orders.find(2) != ask_orders.end());
+            CHECK(p.base_reserve.quantity.amount == volume(1015).quantity.amount);
+            CHECK(output.quantity.amount == 995000000 + 200000000000 - p.quote_reserve.quantity.amount);
+            CHECK(exchange.get_balance(bob, EOS_8) == 0);
+            CHECK(exchange.get_balance(bob, USD_8) == output.quantity.amount);
+            CHECK(exchange.get_balance(alice, EOS_8) == 500000000);
+            CHECK(exchange.get_balance(name("exchange"), EOS_8) == 1000000000);
+         }
+
+         THEN("the output beats the pool alone") {
+            // pool only: 2000 * 19.94 / ( 1000 + 19.94 )
+            CHECK(output.quantity.amount > 3910116281);
+         }
+      }
+
+      WHEN("a trader spends 20 USD") {
+         exchange.adjust_balance(bob, price(2000));
+         extended_asset output = exchange.route_swap(bob, EOS, USD, price(2000), volume(0), "2019-05-26T10:10:04"_tp);
+
+         const auto& p = liquidity_pools.get(market_name.value);
+
+         THEN("the pool fills up to 2.01, the book level at 2.01 fills, and the pool takes the rest below 2.10") {
+            CHECK(bid_orders.find(3) == bid_orders.end());
+            CHECK(bid_orders.find(4) != bid_orders.end());
+            CHECK(p.quote_reserve.quantity.amount == price(200000 + 2000 - 1005).quantity.amount);
+            CHECK(output.quantity.amount == 500000000 + 100000000000 - p.base_reserve.quantity.amount);
+            CHECK(exchange.get_balance(bob, USD_8) == 0);
+            CHECK(exchange.get_balance(alice, USD_8) == 5000000000 - 995000000 - 950000000 + 1005000000);
+         }
+      }
+
+      WHEN("a trader sells 3 EOS") {
+         exchange.adjust_balance(bob, volume(3));
+         exchange.route_swap(bob, EOS, USD, volume(3), price(0), "2019-05-26T10:10:04"_tp);
+
+         const auto& p = liquidity_pools.get(market_name.value);
+         int64_t pool_input = p.base_reserve.quantity.amount - volume(1000).quantity.amount;
+
+         THEN("the pools marginal price after its fee stops at the 1.99 level, which takes the rest") {
+            int64_t marginal_price = int128_t(p.quote_reserve.quantity.amount) * (FEE_BPS_SCALE - POOL_FEE_BPS) * 100000000
+                                   / FEE_BPS_SCALE / p.base_reserve.quantity.amount;
+            CHECK(std::abs(marginal_price - price(199).quantity.amount) <= 1);
+            CHECK(ask_orders.get(1).volume.quantity.amount == volume(5).quantity.amount - (volume(3).quantity.amount - pool_input));
+         }
+      }
+
+      WHEN("a trader spends 3 USD") {
+         exchange.adjust_balance(bob, price(300));
+         exchange.route_swap(bob, EOS, USD, price(300), volume(0), "2019-05-26T10:10:04"_tp);
+
+         const auto& p = liquidity_pools.get(market_name.value);
+
+         THEN("the pools marginal price after its fee stops at the 2.01 level") {
+            int64_t marginal_price = int128_t(p.quote_reserve.quantity.amount) * FEE_BPS_SCALE * 100000000
+                                   / (FEE_BPS_SCALE - POOL_FEE_BPS) / p.base_reserve.quantity.amount;
+            CHECK(std::abs(marginal_price - price(201).quantity.amount) <= 1);
+            CHECK(bid_orders.get(3).volume.quantity.amount < volume(5).quantity.amount);
+         }
+      }
+
+      WHEN("a zero priced sell order rests on the book and the pool is drained of base") {
+         bid_orders.emplace(name("exchange"), [&](auto& b) {
+            b.id        = 9;
+            b.trader    = carol;
+            b.timestamp = "2019-05-26T10:10:00"_tp;
+            b.price     = price(0);
+            b.volume    = volume(1);
+         });
+         liquidity_pools.modify(liquidity_pools.find(market_name.value), name("exchange"), [&](auto& p) {
+            p.base_reserve.quantity.amount = 0;
+         });
+
+         exchange.adjust_balance(bob, price(2000));
+         extended_asset output = exchange.route_swap(bob, EOS, USD, price(2000), volume(0), "2019-05-26T10:10:04"_tp);
+
+         THEN("both are skipped and the swap fills from the rest of the book") {
+            CHECK(bid_orders.find(9) != bid_orders.end());
+            CHECK(bid_orders.find(3) == bid_orders.end());
+            CHECK(liquidity_pools.get(market_name.value).quote_reserve.quantity.amount == price(200000).quantity.amount);
+            CHECK(output.quantity.amount > volume(5).quantity.amount);
+         }
+      }
+
+      THEN("the output minimum is enforced") {
+         exchange.adjust_balance(bob, volume(20));
+         CHECK_THROWS_WITH(exchange.route_swap(bob, EOS, USD, volume(20), price(4000), "2019-05-26T10:10:04"_tp), "swap output is below the minimum");
+         CHECK_THROWS_WITH(exchange.route_swap(bob, EOS, USD, volume(20), volume(1), "2019-05-26T10:10:04"_tp), "minimum output must be in the other token of the pair");
+      }
+   }
+}
+
+TEST_CASE("twap") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("an EOS/USD market pair") {
+      name market_name = create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(10));
+      exchange.adjust_balance(bob, price(2000));
+
+      stats market_stats(name("exchange"), name("exchange").value);
+
+      WHEN("trades print at 1.40 for 60 seconds and then at 1.50") {
+         exchange.place_bid_order(alice, price(140), volume(1), "2019-05-26T10:10:00"_tp, 1);
+         exchange.place_ask_order(bob, price(140), volume(1), "2019-05-26T10:10:00"_tp, 2);
+
+         THEN("the first trade only starts the clock") {
+            CHECK(uint64_t(market_stats.get(market_name.value).price_cumulative) == 0);
+            CHECK(market_stats.get(market_name.value).last_update == "2019-05-26T10:10:00"_tp);
+         }
+
+         exchange.place_bid_order(alice, price(150), volume(1), "2019-05-26T10:11:00"_tp, 3);
+         exchange.place_ask_order(bob, price(150), volume(1), "2019-05-26T10:11:00"_tp, 4);
+
+         exchange.place_bid_order(alice, price(150), volume(1), "2019-05-26T10:11:30"_tp, 5);
+         exchange.place_ask_order(bob, price(150), volume(1), "2019-05-26T10:11:30"_tp, 6);
+
+         THEN("the accumulator sums each price over the seconds it stood") {
+            const auto& s = market_stats.get(market_name.value);
+            CHECK(uint64_t(s.price_cumulative) == 140 * 60 + 150 * 30);
+            CHECK(s.last_update == "2019-05-26T10:11:30"_tp);
+
+            // TWAP over the 90 seconds, in the quote precision
+            CHECK(uint64_t(s.price_cumulative / 90) == 143);
+         }
+      }
+   }
+}
+
+TEST_CASE("recent_trades") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("an EOS/USD market pair") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(200));
+      exchange.adjust_balance(bob, price(100000));
+
+      recenttrades trades(name("exchange"), name("eosusd").value);
+
+      WHEN("a buy order takes a resting sell order") {
+         exchange.place_bid_order(alice, price(140), volume(2), "2019-05-26T10:10:00"_tp, 1);
+         exchange.place_ask_order(bob, price(145), volume(2), "2019-05-26T10:10:01"_tp, 2);
+
+         THEN("the fill is recorded with the takers side") {
+            auto by_sequence = trades.get_index<"bysequence"_n>();
+            auto trade = by_sequence.rbegin();
+            REQUIRE(trade != by_sequence.rend());
+            CHECK(trade->price.quantity.amount == price(140).quantity.amount);
+            CHECK(trade->volume.quantity.amount == volume(2).quantity.amount);
+            CHECK(trade->side == ASK);
+            CHECK(trade->timestamp == "2019-05-26T10:10:01"_tp);
+         }
+      }
+
+      WHEN("more fills than the history holds are recorded with orders placed in between") {
+         exchange.adjust_balance(alice, volume(100));
+
+         for( int i = 0; i < TRADE_HISTORY_SIZE + 10; ++i ) {
+            exchange.place_bid_order(alice, price(100 + i), volume(1), "2019-05-26T10:10:00"_tp);
+            exchange.place_bid_order(alice, price(99999), volume(1), "2019-05-26T10:10:00"_tp);
+            exchange.place_ask_order(bob, price(100 + i), volume(1), "2019-05-26T10:10:00"_tp);
+         }
+
+         THEN("exactly the latest fills are kept, in order") {
+            size_t rows = 0;
+            auto by_sequence = trades.get_index<"bysequence"_n>();
+            for( auto t = by_sequence.begin(); t != by_sequence.end(); ++t, ++rows ) {
+               CHECK(t->slot == t->sequence % TRADE_HISTORY_SIZE);
+               CHECK(t->sequence == rows + 10);
+               CHECK(t->price.quantity.amount == price(110 + rows).quantity.amount);
+            }
+            CHECK(rows == TRADE_HISTORY_SIZE);
+         }
+         AND_THEN("a later action numbers its fills on from the ring") {
+            exchange_base_mock later{name("exchange")};
+            later.place_bid_order(alice, price(150), volume(1), "2019-05-26T10:11:00"_tp);
+            later.place_ask_order(bob, price(150), volume(1), "2019-05-26T10:11:00"_tp);
+
+            auto by_sequence = trades.get_index<"bysequence"_n>();
+            auto trade = by_sequence.rbegin();
+            REQUIRE(trade != by_sequence.rend());
+            CHECK(trade->sequence == TRADE_HISTORY_SIZE + 10);
+            CHECK(trade->slot == 10);
+         }
+      }
+
+      WHEN("a batch auction clears") {
+         exchange.set_matching_mode(EOS, USD, BATCH_AUCTION, "2019-05-26T10:09:00"_tp);
+         exchange.place_bid_order(alice, price(140), volume(2), "2019-05-26T10:10:00"_tp, 1);
+         exchange.place_ask_order(bob, price(150), volume(2), "2019-05-26T10:10:01"_tp, 2);
+         exchange.clear_auction(EOS, USD, "2019-05-26T10:11:00"_tp);
+
+         THEN("the auction fill is recorded at the clearing price") {
+            auto by_sequence = trades.get_index<"bysequence"_n>();
+            auto trade = by_sequence.rbegin();
+            REQUIRE(trade != by_sequence.rend());
+            CHECK(trade->price.quantity.amount == price(145).quantity.amount);
+            CHECK(trade->volume.quantity.amount == volume(2).quantity.amount);
+            CHECK(trade->side == ASK);
+            CHECK(trade->timestamp == "2019-05-26T10:11:00"_tp);
+         }
+      }
+   }
+}
+
+TEST_CASE("order_fill_status") {
+   exchange_base_mock exchange{name("exchange")};
+   name alice = name("alice");
+   name bob   = name("bob");
+
+   exchange.init_contract(false);
+
+   GIVEN("a resting sell order of 10 EOS") {
+      create_eos_usd_pair(exchange);
+
+      exchange.adjust_balance(alice, volume(20));
+      exchange.adjust_balance(bob, price(5000));
+
+      exchange.place_bid_order(alice, price(140), volume(10), "2019-05-26T10:10:00"_tp, 1);
+
+      bids bid_orders(name("exchange"), name("eosusd").value);
+      asks ask_orders(name("exchange"), name("eosusd").value);
+
+      THEN("it starts with its original quantity and no fills") {
+         const auto& o = bid_orders.get(1);
+         CHECK(o.orig_qty == volume(10).quantity.amount);
+         CHECK(o.filled_qty == 0);
+         CHECK(o.avg_fill_price == 0);
+      }
+
+      WHEN("it is filled in two trades") {
+         exchange.place_ask_order(bob, price(145), volume(2), "2019-05-26T10:10:01"_tp, 2);
+         exchange.place_ask_order(bob, price(140), volume(3), "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("the row tracks the filled quantity and the average price") {
+            const auto& o = bid_orders.get(1);
+            CHECK(o.orig_qty == volume(10).quantity.amount);
+            CHECK(o.volume.quantity.amount == volume(5).quantity.amount);
+            CHECK(o.filled_qty == volume(5).quantity.amount);
+            CHECK(o.avg_fill_price == price(140).quantity.amount);
+         }
+      }
+
+      WHEN("a buy order fills against two price levels and rests") {
+         exchange.place_bid_order(alice, price(150), volume(2), "2019-05-26T10:10:01"_tp, 2);
+         exchange.place_ask_order(bob, price(150), volume(14), "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("the taker row holds the volume weighted price of its fills") {
+            const auto& o = ask_orders.get(3);
+            CHECK(o.orig_qty == volume(14).quantity.amount);
+            CHECK(o.filled_qty == volume(12).quantity.amount);
+            // ( 10 * 1.40 + 2 * 1.50 ) / 12
+            CHECK(o.avg_fill_price == 141666666);
+         }
+         AND_THEN("the makers taken off the book keep their final status in the filled orders ring") {
+            filledorders filled_orders(name("exchange"), name("eosusd").value);
+            auto by_order = filled_orders.get_index<"byorder"_n>();
+
+            auto first = by_order.find(1);
+            REQUIRE(first != by_order.end());
+            CHECK(first->trader == alice);
+            CHECK(first->side == BID);
+            CHECK(first->orig_qty == volume(10).quantity.amount);
+            CHECK(first->filled_qty == volume(10).quantity.amount);
+            CHECK(first->avg_fill_price == price(140).quantity.amount);
+
+            auto second = by_order.find(2);
+            REQUIRE(second != by_order.end());
+            CHECK(second->filled_qty == volume(2).quantity.amount);
+            CHECK(second->avg_fill_price == price(150).quantity.amount);
+            CHECK(second->sequence == first->sequence + 1);
+            CHECK(by_order.find(3) == by_order.end());
+         }
+      }
+
+      WHEN("it is filled in two trades of a later action") {
+         exchange.place_ask_order(bob, price(140), volume(4), "2019-05-26T10:10:01"_tp, 2);
+
+         exchange_base_mock later{name("exchange")};
+         later.place_ask_order(bob, price(150), volume(6), "2019-05-26T10:10:02"_tp, 3);
+
+         THEN("the order row is gone but its fills are kept") {
+            CHECK(bid_orders.find(1) == bid_orders.end());
+
+            filledorders filled_orders(name("exchange"), name("eosusd").value);
+            auto by_order = filled_orders.get_index<"byorder"_n>();
+            auto filled = by_order.find(1);
+            REQUIRE(filled != by_order.end());
+            CHECK(filled->orig_qty == volume(10).quantity.amount);
+            CHECK(filled->filled_qty == volume(10).quantity.amount);
+            CHECK(filled->avg_fill_price == price(140).quantity.amount);
+            CHECK(filled->slot == filled->sequence % ORDER_HISTORY_SIZE);
+         }
+      }
+   }
+}